@@ -3,9 +3,22 @@
 
 #include "kqnet/common.h"
 #include "kqnet/message.h"
+#include "kqnet/wire.h"
+#include "kqnet/serializer.h"
 #include "kqnet/tsqueue.h"
+#include "kqnet/lfqueue.h"
+#include "kqnet/compression.h"
+#include "kqnet/pool.h"
+#include "kqnet/slotmap.h"
+#include "kqnet/metrics.h"
+#include "kqnet/schema.h"
+#include "kqnet/coro.h"
+#include "kqnet/dispatch.h"
+#include "kqnet/stream.h"
+#include "kqnet/payload.h"
 #include "kqnet/connection.h"
 #include "kqnet/client.h"
+#include "kqnet/multiclient.h"
 #include "kqnet/server.h"
 
 #endif
\ No newline at end of file
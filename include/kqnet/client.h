@@ -1,118 +1,381 @@
-#ifndef kqclient_
-#define kqclient_
-
-#include "common.h"
-#include "message.h"
-#include "tsqueue.h"
-
-namespace kq
-{
-    template<typename T>
-    struct client_interface
-    {
-    public:
-        client_interface(uint64_t(*scrambleFunc)(uint64_t));
-
-        virtual ~client_interface();
-
-        bool Connect(const std::string& host, uint16_t port);
-        
-        void Disconnect();
-
-        bool IsConnected() const;
-
-
-        void Send(const message<T>& msg);
-
-        tsqueue<owned_message<T>>& Incoming();
-
-
-
-    private:
-        asio::io_context m_context;
-        std::thread m_thrContext;
-        
-        connection<T>* m_connection;
-        tsqueue<owned_message<T>> m_qMessagesIn;
-
-        uint64_t(*m_scrambleFunc)(uint64_t);
-    }; // end of client_interface
-
-    template<typename T>
-    client_interface<T>::client_interface(uint64_t(*scrambleFunc)(uint64_t))
-        : m_context(), m_thrContext(), m_connection(nullptr), m_qMessagesIn(), m_scrambleFunc(scrambleFunc)
-    {} 
-
-    template<typename T>
-    client_interface<T>::~client_interface()
-    {
-        Disconnect();
-    }
-
-    template<typename T>
-    bool client_interface<T>::Connect(const std::string& host, uint16_t port)
-    {
-        try
-        {
-            // Resolve hostname/ip to endpoints
-            asio::ip::tcp::resolver resolver(m_context);
-            asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
-
-            m_connection = new connection<T>(connection<T>::owner::client, m_context, asio::ip::tcp::socket(m_context), m_qMessagesIn, m_scrambleFunc, nullptr);
-
-            m_connection->ConnectToServer(endpoints);
-
-            m_thrContext = std::thread([this]() { m_context.run(); });
-
-            while (IsConnected() == false)
-            {
-                // This while loop waits until the client is validated
-                // Until the client is not validated, it is not entitled to send messages
-                // If the client is not validated, the server will close the connection
-
-                //FIXME: change this design :(
-            }
-        }
-        catch (std::exception ec)
-        {
-            std::cout << "[Client] Connect() ERROR: " << ec.what() << '\n';
-            return false;
-        }
-        return true;
-    }
-
-    template<typename T>
-    void client_interface<T>::Disconnect()
-    {
-        if (m_connection->IsConnected())
-            m_connection->Disconnect();
-
-        m_context.stop();
-        if (m_thrContext.joinable())
-            m_thrContext.join();
-
-        delete m_connection;
-    }
-
-    template<typename T>
-    bool client_interface<T>::IsConnected() const
-    {
-        return (m_connection != nullptr) && (m_connection->IsConnected() == true);
-    }
-
-    template<typename T>
-    void client_interface<T>::Send(const message<T>& msg)
-    {
-        if (IsConnected())
-            m_connection->Send(msg);
-    }
-
-    template<typename T>
-    tsqueue<owned_message<T>>& client_interface<T>::Incoming()
-    {
-        return m_qMessagesIn;
-    }
-
-} // namespace kq
-
+#ifndef kqclient_
+#define kqclient_
+
+#include "common.h"
+#include "message.h"
+#include "tsqueue.h"
+#include "pool.h"
+#include "coro.h"
+#include "dispatch.h"
+#include "stream.h"
+
+namespace kq
+{
+    // Q is the queue policy, it selects the queue incoming messages are delivered through (see tsqueue.h and lfqueue.h)
+    template<typename T, typename Q>
+    struct client_interface
+    {
+    public:
+        client_interface(uint64_t(*scrambleFunc)(uint64_t));
+
+        virtual ~client_interface();
+
+        // Blocks until the client is validated, connecting failed or timeout passed, 0 waits as long as it takes
+        // Nothing spins meanwhile, the context's thread wakes the caller
+        // Returns whether the client is connected, GetConnectResult() tells why not
+        bool Connect(const std::string& host, uint16_t port, std::chrono::milliseconds timeout = std::chrono::seconds(10));
+
+        // Starts connecting and returns at once, onConnect(connect_result) is called once when it ended
+        // onConnect runs on the context's thread, so it must not call Connect or Disconnect
+        // Calling it while connecting or connected reports connect_aborted, after a failed connect or Disconnect it connects again
+        void ConnectAsync(const std::string& host, uint16_t port, std::function<void(connect_result)> onConnect, std::chrono::milliseconds timeout = std::chrono::seconds(10));
+        std::future<connect_result> ConnectAsync(const std::string& host, uint16_t port, std::chrono::milliseconds timeout = std::chrono::seconds(10));
+
+        void Disconnect();
+
+        bool IsConnected() const;
+
+        // connect_pending until the last Connect ended
+        connect_result GetConnectResult() const;
+
+#if KQNET_COROUTINES
+        // co_await connect(host, port) resumes with the connect_result, on the context's thread once it connected
+        // The awaitables of connection<T> (see coro.h) then serve the connection, they return at once before connecting
+        connect_awaiter<T, Q> connect(const std::string& host, uint16_t port, std::chrono::milliseconds timeout = std::chrono::seconds(10)) { return connect_awaiter<T, Q>(*this, host, port, timeout); }
+        receive_awaiter<T, Q> receive() { return receive_awaiter<T, Q>(m_connection); }
+        send_awaiter<T, Q> send(const message<T>& msg) { return send_awaiter<T, Q>(m_connection, m_pool->share(msg)); }
+        send_awaiter<T, Q> send(message<T>&& msg) { return send_awaiter<T, Q>(m_connection, m_pool->share(std::move(msg))); }
+        send_awaiter<T, Q> send(const shared_message<T>& msg) { return send_awaiter<T, Q>(m_connection, msg); }
+#endif
+
+
+        // Returns false if not connected or the outbound queue is over a high-water mark, see connection<T, Q>::Send
+        // priority picks the lane of the outbound queue, by default the one set with SetPriority
+        bool Send(const message<T>& msg, message_priority priority = priority_by_id);
+        bool Send(message<T>&& msg, message_priority priority = priority_by_id);
+        bool Send(const shared_message<T>& msg, message_priority priority = priority_by_id);
+
+        // Builds the message in place, fill(message<T>&) writes it's body straight into pooled memory
+        template<typename Fill>
+        bool SendEmplace(T id, Fill&& fill, message_priority priority = priority_by_id);
+
+        // Sends the payload read from source as a stream of fragments of id, see connection<T, Q>::SendStream, returns 0 if not connected
+        uint64_t SendStream(T id, stream_source source, size_t nChunkSize = nDefaultStreamChunkSize);
+
+        // Sends a message of id whose body is written straight out of memory or a file range, see connection<T, Q>::SendExternal
+        bool SendExternal(T id, external_body body, message_priority priority = priority_by_id);
+
+        typename Q::template queue<owned_message<T, Q>>& Incoming();
+
+        // Messages of id are handed to handler(connection<T, Q>*, message<T>&) on the context's thread instead of going to Incoming()
+        // Handlers are set before Connect, returns false if id is too big for the table (see dispatch.h)
+        bool SetHandler(T id, typename dispatch_table<T, Q>::handler_type handler) { return m_dispatch.set(id, dispatch_inline, std::move(handler)); }
+
+        // Messages of id are queued in the lane of priority, higher lanes are written first (see message_priority)
+        // Lanes are set before Connect, returns false if id is too big for the table
+        bool SetPriority(T id, message_priority priority) { return m_priorities.set(id, priority); }
+
+        // Fragments of streams of id are handed to handler(connection<T, Q>*, const stream_chunk&) on the context's thread (see stream.h)
+        bool SetStreamHandler(T id, stream_handler<T, Q> handler) { return m_dispatch.set(id, dispatch_inline, make_stream_dispatch<T, Q>(std::move(handler))); }
+
+        // Gives the body of a message taken from Incoming() back to the pool the connection reads into
+        void Recycle(message<T>& msg);
+
+        const std::shared_ptr<buffer_pool>& GetPool() const;
+
+        // Bodies of nBytes and more are compressed if the server enabled compression as well, 0 (the default) disables it
+        // Compression is agreed on while connecting, so it has to be set before Connect
+        void SetCompressionThreshold(size_t nBytes) { m_nCompressionThreshold = nBytes; }
+
+        // Bodies bigger than nBytes close the connection before anything is allocated for them
+        // nDefaultMaxFrameSize (64 MB) by default, 0 doesn't limit them
+        // Set it before Connect
+        void SetMaxFrameSize(size_t nBytes) { m_nMaxFrameSize = nBytes; }
+
+        // Whether the server agreed on compression
+        bool IsCompressionEnabled() const;
+
+        compression_stats GetCompressionStats() const;
+
+    private:
+        // Stores the result of connecting, wakes Connect and calls the handler, only the first result counts
+        void FinishConnect(connect_result result);
+
+        // Whether a connection exists and connecting it failed, it is released before connecting again
+        bool HasFailed() const;
+
+        // Closes the connection and waits until none of it's operations is pending, then stops the context's thread and deletes it
+        // The context can be run again afterwards
+        void ReleaseConnection();
+
+    private:
+        asio::io_context m_context;
+        std::thread m_thrContext;
+        asio::steady_timer m_timerConnect; // Closes a connection which takes longer than the timeout to validate
+
+        mutable std::mutex m_muxConnect;
+        std::condition_variable m_cvConnect; // Connect waits on it for m_connectResult
+        connect_result m_connectResult;
+        std::function<void(connect_result)> m_onConnect;
+        bool m_bReleased; // Set by the connection once it has no operation pending, see connection<T, Q>::__SetReleaseHandler
+        
+        connection<T, Q>* m_connection;
+        typename Q::template queue<owned_message<T, Q>> m_qMessagesIn;
+        std::shared_ptr<buffer_pool> m_pool;
+        size_t m_nCompressionThreshold;
+        size_t m_nMaxFrameSize;
+        dispatch_table<T, Q> m_dispatch; // Only read once connecting
+        priority_table<T> m_priorities; // Same
+
+        uint64_t(*m_scrambleFunc)(uint64_t);
+    }; // end of client_interface
+
+    template<typename T, typename Q>
+    client_interface<T, Q>::client_interface(uint64_t(*scrambleFunc)(uint64_t))
+        : m_context(), m_thrContext(), m_timerConnect(m_context), m_muxConnect(), m_cvConnect(), m_connectResult(connect_pending), m_onConnect(), m_bReleased(false), m_connection(nullptr), m_qMessagesIn(), m_pool(std::make_shared<buffer_pool>()), m_nCompressionThreshold(0), m_nMaxFrameSize(nDefaultMaxFrameSize), m_dispatch(), m_priorities(), m_scrambleFunc(scrambleFunc)
+    {} 
+
+    template<typename T, typename Q>
+    client_interface<T, Q>::~client_interface()
+    {
+        Disconnect();
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::Connect(const std::string& host, uint16_t port, std::chrono::milliseconds timeout)
+    {
+        if (m_connection != nullptr && HasFailed() == false)
+            return IsConnected();
+
+        ConnectAsync(host, port, nullptr, timeout);
+
+        // Until the client is validated it is not entitled to send messages, the context's thread wakes us once it is or it failed
+        std::unique_lock<std::mutex> lock(m_muxConnect);
+        m_cvConnect.wait(lock, [this]() { return m_connectResult != connect_pending; });
+        return m_connectResult == connect_success;
+    }
+
+    template<typename T, typename Q>
+    void client_interface<T, Q>::ConnectAsync(const std::string& host, uint16_t port, std::function<void(connect_result)> onConnect, std::chrono::milliseconds timeout)
+    {
+        if (m_connection != nullptr && HasFailed() == false)
+        {
+            if (onConnect)
+                onConnect(connect_aborted);
+            return;
+        }
+        // The failed connection and the thread which ran it are gone before the next one starts
+        if (m_connection != nullptr)
+            ReleaseConnection();
+
+        {
+            std::unique_lock<std::mutex> lock(m_muxConnect);
+            m_connectResult = connect_pending;
+            m_onConnect = std::move(onConnect);
+        }
+
+        asio::ip::tcp::resolver::results_type endpoints;
+        try
+        {
+            // Resolve hostname/ip to endpoints
+            asio::ip::tcp::resolver resolver(m_context);
+            endpoints = resolver.resolve(host, std::to_string(port));
+        }
+        catch (std::exception& ec)
+        {
+            std::cout << "[Client] Connect() ERROR: " << ec.what() << '\n';
+            return FinishConnect(connect_resolve_error);
+        }
+
+        m_connection = new connection<T, Q>(connection<T, Q>::owner::client, m_context, asio::ip::tcp::socket(m_context), m_qMessagesIn, m_scrambleFunc, nullptr, m_pool);
+
+        m_connection->SetCompressionThreshold(m_nCompressionThreshold);
+        m_connection->SetMaxFrameSize(m_nMaxFrameSize);
+        m_connection->__SetDispatch(&m_dispatch);
+        m_connection->__SetPriorities(&m_priorities);
+        m_connection->__SetConnectHandler([this](connect_result result) { FinishConnect(result); });
+        m_connection->__SetReleaseHandler([this]() {
+            {
+                std::unique_lock<std::mutex> lock(m_muxConnect);
+                m_bReleased = true;
+            }
+            m_cvConnect.notify_all();
+            });
+        m_connection->ConnectToServer(endpoints);
+
+        if (timeout.count() > 0)
+        {
+            m_timerConnect.expires_after(timeout);
+            m_timerConnect.async_wait([this](const asio::error_code& ec) {
+                if (!ec)
+                    FinishConnect(connect_timeout);
+                });
+        }
+
+        // The context must not run out of work while the connection is idle between handlers, Disconnect stops it
+        auto work = asio::make_work_guard(m_context);
+        m_thrContext = std::thread([this, work]() { m_context.run(); });
+    }
+
+    template<typename T, typename Q>
+    std::future<connect_result> client_interface<T, Q>::ConnectAsync(const std::string& host, uint16_t port, std::chrono::milliseconds timeout)
+    {
+        auto promise = std::make_shared<std::promise<connect_result>>();
+        std::future<connect_result> result = promise->get_future();
+        ConnectAsync(host, port, [promise](connect_result r) { promise->set_value(r); }, timeout);
+        return result;
+    }
+
+    template<typename T, typename Q>
+    void client_interface<T, Q>::FinishConnect(connect_result result)
+    {
+        std::function<void(connect_result)> onConnect;
+        {
+            std::unique_lock<std::mutex> lock(m_muxConnect);
+            if (m_connectResult != connect_pending)
+                return;
+            m_connectResult = result;
+            onConnect = std::move(m_onConnect);
+            m_onConnect = nullptr;
+        }
+        m_cvConnect.notify_all();
+
+        // Both run on the context's thread, so the timer is never touched by two threads at once
+        if (result == connect_success)
+            m_timerConnect.cancel();
+        else if (result == connect_timeout)
+            m_connection->Disconnect();
+
+        if (onConnect)
+            onConnect(result);
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::HasFailed() const
+    {
+        connect_result result = GetConnectResult();
+        return m_connection != nullptr && result != connect_pending && result != connect_success;
+    }
+
+    template<typename T, typename Q>
+    void client_interface<T, Q>::ReleaseConnection()
+    {
+        // A Connect still waiting is woken
+        FinishConnect(connect_aborted);
+
+        if (m_connection != nullptr && m_thrContext.joinable())
+        {
+            // Closing makes the pending operations fail, the last one to fail releases the connection
+            m_connection->Disconnect();
+            std::unique_lock<std::mutex> lock(m_muxConnect);
+            m_cvConnect.wait(lock, [this]() { return m_bReleased; });
+        }
+
+        m_context.stop();
+        if (m_thrContext.joinable())
+            m_thrContext.join();
+        m_timerConnect.cancel();
+
+        // Handlers posted after the connection was released, e.g. the Disconnect above or a Send, run while it still exists
+        m_context.restart();
+        m_context.poll();
+        m_context.restart();
+
+        delete m_connection;
+        m_connection = nullptr;
+        m_bReleased = false;
+    }
+
+    template<typename T, typename Q>
+    void client_interface<T, Q>::Disconnect()
+    {
+        ReleaseConnection();
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::IsConnected() const
+    {
+        return (m_connection != nullptr) && (m_connection->IsConnected() == true);
+    }
+
+    template<typename T, typename Q>
+    connect_result client_interface<T, Q>::GetConnectResult() const
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnect);
+        return m_connectResult;
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::Send(const message<T>& msg, message_priority priority)
+    {
+        return IsConnected() && m_connection->Send(msg, priority);
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::Send(message<T>&& msg, message_priority priority)
+    {
+        return IsConnected() && m_connection->Send(std::move(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::Send(const shared_message<T>& msg, message_priority priority)
+    {
+        return IsConnected() && m_connection->Send(msg, priority);
+    }
+
+    template<typename T, typename Q>
+    template<typename Fill>
+    bool client_interface<T, Q>::SendEmplace(T id, Fill&& fill, message_priority priority)
+    {
+        return IsConnected() && m_connection->SendEmplace(id, std::forward<Fill>(fill), priority);
+    }
+
+    template<typename T, typename Q>
+    uint64_t client_interface<T, Q>::SendStream(T id, stream_source source, size_t nChunkSize)
+    {
+        if (IsConnected() == false)
+            return 0;
+        return m_connection->SendStream(id, std::move(source), nChunkSize);
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::SendExternal(T id, external_body body, message_priority priority)
+    {
+        if (IsConnected() == false)
+            return false;
+        return m_connection->SendExternal(id, std::move(body), priority);
+    }
+
+    template<typename T, typename Q>
+    typename Q::template queue<owned_message<T, Q>>& client_interface<T, Q>::Incoming()
+    {
+        return m_qMessagesIn;
+    }
+
+    template<typename T, typename Q>
+    void client_interface<T, Q>::Recycle(message<T>& msg)
+    {
+        m_pool->recycle(msg);
+    }
+
+    template<typename T, typename Q>
+    const std::shared_ptr<buffer_pool>& client_interface<T, Q>::GetPool() const
+    {
+        return m_pool;
+    }
+
+    template<typename T, typename Q>
+    bool client_interface<T, Q>::IsCompressionEnabled() const
+    {
+        return IsConnected() && m_connection->IsCompressionEnabled();
+    }
+
+    template<typename T, typename Q>
+    compression_stats client_interface<T, Q>::GetCompressionStats() const
+    {
+        return m_connection != nullptr ? m_connection->GetCompressionStats() : compression_stats();
+    }
+
+} // namespace kq
+
 #endif
\ No newline at end of file
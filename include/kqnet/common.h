@@ -1,22 +1,54 @@
-#ifndef kqnetcommon_
-#define kqnetcommon_
-
-#ifdef _WIN32
-#define _WIN32_WINNT 0x0A00
-#endif
-
-
-
-#include <thread>
-#include <mutex>
-#include <iostream>
-#include <chrono>
-#include <cstdint>
-
-
-#include "kqlib.h"
-#include "asio.hpp"
-#include "asio/ts/buffer.hpp"
-#include "asio/ts/internet.hpp"
-
+#ifndef kqnetcommon_
+#define kqnetcommon_
+
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0A00
+#endif
+
+// Counters and histograms of metrics.h, define KQNET_METRICS 0 before including kqnet to compile them out of every hot path
+#ifndef KQNET_METRICS
+#define KQNET_METRICS 1
+#endif
+
+// Awaitables of coro.h, on by default when compiled as C++20 with coroutine support
+#ifndef KQNET_COROUTINES
+#if (defined(_MSVC_LANG) ? _MSVC_LANG : __cplusplus) >= 202002L && defined(__cpp_impl_coroutine)
+#define KQNET_COROUTINES 1
+#else
+#define KQNET_COROUTINES 0
+#endif
+#endif
+
+
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#if KQNET_COROUTINES
+#include <coroutine>
+#include <optional>
+#endif
+
+
+#include "kqlib.h"
+#include "asio.hpp"
+#include "asio/ts/buffer.hpp"
+#include "asio/ts/internet.hpp"
+
 #endif
\ No newline at end of file
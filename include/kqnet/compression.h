@@ -0,0 +1,219 @@
+#ifndef kqcompression_
+#define kqcompression_
+
+#include "common.h"
+
+namespace kq
+{
+    // lz_codec is a small LZ77 block codec in the spirit of LZ4, fast enough to run on every large body a connection writes
+    // A block is a list of sequences: a token (literal count in the high nibble, match length - 4 in the low one),
+    // the literal count past 15 as 255-runs, the literals, a 2 byte little-endian offset, then the match length past 15 as 255-runs
+    // The last sequence has only literals, the block ends right after them
+    struct lz_codec
+    {
+    public:
+        // Largest block compress can produce for nIn bytes
+        static size_t bound(size_t nIn) { return nIn + nIn / 255 + 16; }
+
+        // Compresses nIn bytes into pOut, returns the size of the block or 0 if it doesn't fit in nOutMax bytes
+        // Passing nOutMax < nIn gives up on incompressible data as soon as it can't get smaller
+        static size_t compress(const uint8_t* pIn, size_t nIn, uint8_t* pOut, size_t nOutMax);
+
+        // Decompresses a block of nIn bytes which must expand to exactly nOut bytes
+        // Returns nOut, or -1 if the block is malformed, every read and write is bounds checked
+        static size_t decompress(const uint8_t* pIn, size_t nIn, uint8_t* pOut, size_t nOut);
+
+    private:
+        static const size_t nHashBits = 12;
+        static const size_t nMinMatch = 4;
+        static const size_t nMaxOffset = 65535;
+        static const size_t nLastLiterals = 12; // The end of the input is never searched for matches, so reads never run past it
+
+        static uint32_t Read32(const uint8_t* p)
+        {
+            uint32_t nValue;
+            std::memcpy(&nValue, p, sizeof(nValue));
+            return nValue;
+        }
+
+        static size_t Hash(uint32_t nValue) { return (nValue * 2654435761u) >> (32 - nHashBits); }
+
+        static uint8_t* WriteLength(uint8_t* pOut, size_t nLength);
+        static bool ReadLength(const uint8_t*& pIn, const uint8_t* pInEnd, size_t& nLength);
+    };
+
+
+    inline uint8_t* lz_codec::WriteLength(uint8_t* pOut, size_t nLength)
+    {
+        while (nLength >= 255)
+        {
+            *pOut++ = 255;
+            nLength -= 255;
+        }
+        *pOut++ = static_cast<uint8_t>(nLength);
+        return pOut;
+    }
+
+    inline bool lz_codec::ReadLength(const uint8_t*& pIn, const uint8_t* pInEnd, size_t& nLength)
+    {
+        uint8_t byte;
+        do
+        {
+            if (pIn == pInEnd || nLength > std::numeric_limits<size_t>::max() / 2)
+                return false;
+            byte = *pIn++;
+            nLength += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    inline size_t lz_codec::compress(const uint8_t* pIn, size_t nIn, uint8_t* pOut, size_t nOutMax)
+    {
+        // Positions are kept in 32 bits
+        if (nIn > std::numeric_limits<uint32_t>::max())
+            return 0;
+
+        // Positions of the last 4 byte sequence seen for each hash, relative to pIn
+        uint32_t table[size_t(1) << nHashBits] = {};
+
+        const uint8_t* ip = pIn;
+        const uint8_t* pAnchor = pIn; // Start of the literals not written yet
+        const uint8_t* pInEnd = pIn + nIn;
+        const uint8_t* pMatchLimit = nIn > nLastLiterals ? pInEnd - nLastLiterals : pIn;
+        uint8_t* op = pOut;
+        uint8_t* pOutEnd = pOut + nOutMax;
+        size_t nMisses = 0;
+
+        while (ip < pMatchLimit)
+        {
+            uint32_t nSequence = Read32(ip);
+            size_t nHash = Hash(nSequence);
+            const uint8_t* pRef = pIn + table[nHash];
+            table[nHash] = static_cast<uint32_t>(ip - pIn);
+
+            if (pRef >= ip || static_cast<size_t>(ip - pRef) > nMaxOffset || Read32(pRef) != nSequence)
+            {
+                // Data that doesn't repeat is skipped faster and faster, so incompressible bodies cost little
+                ip += 1 + (nMisses++ >> 6);
+                continue;
+            }
+
+            const uint8_t* pMatchEnd = ip + nMinMatch;
+            const uint8_t* pRefEnd = pRef + nMinMatch;
+            while (pMatchEnd < pMatchLimit && *pMatchEnd == *pRefEnd)
+            {
+                ++pMatchEnd;
+                ++pRefEnd;
+            }
+
+            size_t nLiterals = static_cast<size_t>(ip - pAnchor);
+            size_t nMatch = static_cast<size_t>(pMatchEnd - ip) - nMinMatch;
+            size_t nOffset = static_cast<size_t>(ip - pRef);
+            if (static_cast<size_t>(pOutEnd - op) < 1 + nLiterals / 255 + 1 + nLiterals + 2 + nMatch / 255 + 1)
+                return 0;
+
+            uint8_t* pToken = op++;
+            *pToken = static_cast<uint8_t>((std::min<size_t>(nLiterals, 15) << 4) | std::min<size_t>(nMatch, 15));
+            if (nLiterals >= 15)
+                op = WriteLength(op, nLiterals - 15);
+            std::memcpy(op, pAnchor, nLiterals);
+            op += nLiterals;
+            *op++ = static_cast<uint8_t>(nOffset);
+            *op++ = static_cast<uint8_t>(nOffset >> 8);
+            if (nMatch >= 15)
+                op = WriteLength(op, nMatch - 15);
+
+            ip = pMatchEnd;
+            pAnchor = ip;
+            nMisses = 0;
+        }
+
+        size_t nLiterals = static_cast<size_t>(pInEnd - pAnchor);
+        if (static_cast<size_t>(pOutEnd - op) < 1 + nLiterals / 255 + 1 + nLiterals)
+            return 0;
+        uint8_t* pToken = op++;
+        *pToken = static_cast<uint8_t>(std::min<size_t>(nLiterals, 15) << 4);
+        if (nLiterals >= 15)
+            op = WriteLength(op, nLiterals - 15);
+        if (nLiterals > 0)
+            std::memcpy(op, pAnchor, nLiterals);
+        op += nLiterals;
+
+        return static_cast<size_t>(op - pOut);
+    }
+
+    inline size_t lz_codec::decompress(const uint8_t* pIn, size_t nIn, uint8_t* pOut, size_t nOut)
+    {
+        const uint8_t* ip = pIn;
+        const uint8_t* pInEnd = pIn + nIn;
+        uint8_t* op = pOut;
+        uint8_t* pOutEnd = pOut + nOut;
+
+        while (true)
+        {
+            if (ip == pInEnd)
+                return size_t(-1);
+            uint8_t token = *ip++;
+
+            size_t nLiterals = token >> 4;
+            if (nLiterals < 15 && pInEnd - ip >= 16 && pOutEnd - op >= 16)
+            {
+                // Short literals are copied as a fixed 16 bytes, the bytes past them are overwritten by what follows
+                std::memcpy(op, ip, 16);
+            }
+            else
+            {
+                if (nLiterals == 15 && ReadLength(ip, pInEnd, nLiterals) == false)
+                    return size_t(-1);
+                if (nLiterals > static_cast<size_t>(pInEnd - ip) || nLiterals > static_cast<size_t>(pOutEnd - op))
+                    return size_t(-1);
+                std::memcpy(op, ip, nLiterals);
+            }
+            ip += nLiterals;
+            op += nLiterals;
+
+            // Only the last sequence has no match
+            if (ip == pInEnd)
+                break;
+
+            if (pInEnd - ip < 2)
+                return size_t(-1);
+            size_t nOffset = static_cast<size_t>(ip[0]) | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            if (nOffset == 0 || nOffset > static_cast<size_t>(op - pOut))
+                return size_t(-1);
+
+            size_t nMatch = token & 0x0F;
+            if (nMatch == 15 && ReadLength(ip, pInEnd, nMatch) == false)
+                return size_t(-1);
+            nMatch += nMinMatch;
+            if (nMatch > static_cast<size_t>(pOutEnd - op))
+                return size_t(-1);
+
+            const uint8_t* pRef = op - nOffset;
+            if (nOffset >= 8 && static_cast<size_t>(pOutEnd - op) >= nMatch + 8)
+            {
+                // 8 bytes at a time, each chunk only reads bytes written before it, the last one may write past the match
+                for (size_t i = 0; i < nMatch; i += 8)
+                    std::memcpy(op + i, pRef + i, 8);
+                op += nMatch;
+            }
+            else if (nOffset >= nMatch)
+            {
+                std::memcpy(op, pRef, nMatch);
+                op += nMatch;
+            }
+            else
+            {
+                // The match overlaps the bytes it produces, a run of a short pattern
+                for (size_t i = 0; i < nMatch; ++i)
+                    *op++ = *pRef++;
+            }
+        }
+
+        return op == pOutEnd ? nOut : size_t(-1);
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
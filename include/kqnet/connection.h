@@ -1,471 +1,1849 @@
-#ifndef kqconnection_
-#define kqconnection_
-
-#include "common.h"
-#include "message.h"
-#include "tsqueue.h"
-
-#include "server.h"
-
-namespace kq
-{
-    template<typename T>
-    struct connection
-    {
-    public:
-        enum owner : uint8_t
-        {
-            client,
-            server
-        };
-
-        connection() = delete;
-        connection(owner parent, asio::io_context& context, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn, uint64_t(*func)(uint64_t), kq::server_interface<T>* serverAddress);
-        connection(connection<T>&& other) noexcept;
-        virtual ~connection() {}
-
-        connection<T>& operator=(const connection<T>& other) = delete;
-        connection<T>& operator=(connection<T>&& other) noexcept;
-
-        uint32_t getID() const { return m_id; }
-        asio::ip::tcp::socket::endpoint_type& getIP() { return m_ip; }
-        
-
-        void ConnectToClient(uint32_t uid);
-        void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints);
-        void Disconnect();
-
-        bool IsConnected() const;
-
-        // Send a message to the remote
-        void Send(const kq::message<T>& msg);
-
-    private:    
-
-        // Prime context to write a message header
-        void WriteHead();
-
-        // Prime context to write a message body
-        void WriteBody();
-
-        // Prime context to read a message head.
-        void ReadHead();
-
-        // Prime context to read a message body
-        void ReadBody();
-
-        void AddToIncomingQueue();
-
-        void WriteValidation();
-        void ReadValidation();
-
-        void WriteValidationSuccess();
-        void ReadValidationSuccess();
-        
-        
-
-    protected:
-        asio::io_context& m_context; // The context for the socket to work on                           
-        asio::ip::tcp::socket m_socket; // Each connection will have a unique socket to the remote
-        tsqueue<message<T>> m_qMessagesOut; // Queue holding messages to be sent to remote
-        tsqueue<owned_message<T>>& m_qMessagesIn; // Reference to incoming queue of parent object
-        message<T> m_msgTemporaryIn; // Auxiliary message for reading
-        owner m_ownerType; // A connection behaves differently for a server or client
-
-        uint32_t m_id;
-
-        uint64_t m_ValidateNumberIn;
-        uint64_t m_ValidateNumberOut;
-        uint64_t m_ValidateNumberCheck;
-
-        uint64_t (*m_scrambleFunc)(uint64_t);
-        kq::server_interface<T>* m_serverPtr;
-        asio::ip::tcp::socket::endpoint_type m_ip;
-
-        bool m_bValidated;
-
-
-    }; // end of connection<T>
-    
-    template<typename T>
-    connection<T>::connection(owner parent, asio::io_context& context, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn, uint64_t (*scrambleFunc)(uint64_t), kq::server_interface<T>* serverAddress)
-        : m_context(context), m_socket(std::move(socket)), m_qMessagesOut(), m_qMessagesIn(qIn), m_msgTemporaryIn(), m_ownerType(parent), m_id(0),
-        m_ValidateNumberIn(0), m_ValidateNumberOut(0), m_ValidateNumberCheck(0), m_scrambleFunc(scrambleFunc), m_serverPtr(serverAddress), m_ip(), m_bValidated(false)
-    {
-        if (parent == owner::server)
-        {
-            m_ip = m_socket.remote_endpoint();
-
-            m_ValidateNumberOut = static_cast<uint64_t>(time(NULL));
-
-            m_ValidateNumberCheck = m_scrambleFunc(m_ValidateNumberOut);
-        }
-    }
-
-    template<typename T>
-    connection<T>::connection(connection<T>&& other) noexcept
-        : m_context(std::move(other.m_context)), m_socket(std::move(other.m_socket)), m_qMessagesOut(std::move(other.m_qMessagesOut)), m_qMessagesIn(std::move(m_qMessagesIn)),
-        m_msgTemporaryIn(std::move(other.m_msgTemporaryIn)), m_ownerType(other.m_ownerType), m_id(other.m_id), m_ValidateNumberIn(other.m_ValidateNumberIn),
-        m_ValidateNumberOut(other.m_ValidateNumberOut), m_ValidateNumberCheck(other.m_ValidateNumberCheck), m_scrambleFunc(other.m_scrambleFunc), m_serverPtr(other.m_serverPtr), m_ip(other.m_ip),
-        m_bValidated(other.m_bValidated)
-    {}
-
-    template<typename T>
-    connection<T>& connection<T>::operator=(connection<T>&& other) noexcept
-    {
-        m_context               = std::move(other.m_context);
-        m_socket                = std::move(other.m_socket);
-        m_qMessagesOut          = std::move(other.m_qMessagesOut);
-        m_qMessagesIn           = std::move(other.m_qMessagesIn);
-        m_msgTemporaryIn        = std::move(other.m_msgTemporaryIn);
-        m_ownerType             = other.m_ownerType;
-        m_id                    = other.m_id;
-        m_ValidateNumberIn      = other.m_ValidateNumberIn;
-        m_ValidateNumberOut     = other.m_ValidateNumberOut;
-        m_ValidateNumberCheck   = other.m_ValidateNumberCheck;
-        m_scrambleFunc          = other.m_scrambleFunc;
-        m_serverPtr             = other.m_serverPtr;
-        m_ip                    = std::move(m_ip);
-        other.m_serverPtr       = nullptr; // maybe reconsider ?
-        m_bValidated            = other.m_bValidated;
-    }
-
-    template<typename T>
-    void connection<T>::ConnectToClient(uint32_t uid)
-    {
-        if (m_ownerType == owner::server)
-        {
-            if (m_socket.is_open())
-            {
-                m_ip = m_socket.remote_endpoint();
-                m_id = uid;
-                // Was: ReadHead();
-                // Before starting to read messages, we will validate the client by sending him a number on which he shall perform 
-                // a function which the server will check the result from
-                WriteValidation();
-
-                ReadValidation();
-            }
-        }
-    }
-
-    template<typename T>
-    void connection<T>::ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints)
-    {
-        if (m_ownerType == owner::client)
-        {
-            asio::async_connect(m_socket, endpoints,
-                [this](std::error_code ec, asio::ip::tcp::endpoint endpoint) {
-                    if (!ec)
-                    {
-                        m_ip =  m_socket.remote_endpoint();
-                        //Was: ReadHead();
-                        //Whenever we connect to the server we expect to receive a number for validation
-                        ReadValidation();
-                        //std::cout << "Connected\n";
-                    }
-                    else
-                    {
-                        std::cout << "ConnectToServer() ERROR: " << ec.message() << "\n";
-                    }
-                });
-        }
-    }
-
-    template<typename T>
-    void connection<T>::Disconnect()
-    {
-        if (IsConnected())
-            asio::post(m_context, [this]() { m_socket.close(); });
-    }
-
-    template<typename T>
-    bool connection<T>::IsConnected() const
-    {
-        // A client is "only" connected to the server once it's validated
-        return m_bValidated;
-    }
-
-    
-
-    template<typename T>
-    // Send a message to the remote
-    void connection<T>::Send(const kq::message<T>& msg)
-    {
-        asio::post(m_context, [this, msg]() {
-
-            // We assume that if the queue is not empty, it is in the process of sending a message
-            bool writing = !m_qMessagesOut.empty();
-            // Either way we add the message to the queue.
-            m_qMessagesOut.push_back(msg);
-            // If we are not sending messages, start sending
-            if (writing == false)
-            {
-                WriteHead();
-            }
-            });
-    }
-
-    template<typename T>
-    void connection<T>::WriteHead()
-    {
-        // We are making a buffer with the first message's head and send it
-        asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().head, sizeof(message_header<T>)),
-            [this](asio::error_code ec, size_t length) {
-                if (!ec)
-                {
-                    // We sent the message with no problem.
-                    if (m_qMessagesOut.front().size() > 0)
-                    {
-                        // We check if the message has a body and if so, write it
-                        WriteBody();
-                    }
-                    else
-                    {
-                        // If the message has no body, we are done with it and we can start sending the next one, if available
-                        m_qMessagesOut.pop_front();
-                        if (m_qMessagesOut.empty() == false)
-                        {
-                            WriteHead();
-                        }
-                    }
-                }
-                else
-                {
-                    //There was a problem in sending the message
-                    std::cout << '[' << m_id << ']' << "WriteHead() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                    if (m_serverPtr != nullptr)
-                        return m_serverPtr->__RemoveClient(this);
-                }
-            });
-    }
-
-    template<typename T>
-    // Prime context to write a message body
-    void connection<T>::WriteBody()
-    {
-        asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().size()),
-            [this](asio::error_code ec, size_t length) {
-                if (!ec)
-                {
-                    // There was no problem in sending the body message, so we are done with this message and can move to the next one.
-                    m_qMessagesOut.pop_front();
-                    if (m_qMessagesOut.empty() == false)
-                    {
-                        WriteHead();
-                    }
-                }
-                else
-                {
-                    // There was a problem in sending the body message.
-                    std::cout << '[' << m_id << ']' << "WriteBody() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                    if (m_serverPtr != nullptr)
-                        return m_serverPtr->__RemoveClient(this);
-                }
-            });
-    }
-
-    template<typename T>
-    // Prime context to read a message head.
-    void connection<T>::ReadHead()
-    {
-
-        asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.head, sizeof(message_header<T>)),
-            [this](std::error_code ec, size_t length) {
-                if (!ec)
-                {
-
-                    // A message head was successfully read
-
-                    // Check if the message has a body
-                    // Note:don't use .size() because we didnt read a body
-                    if (m_msgTemporaryIn.head.size > 0)
-                    {
-                        m_msgTemporaryIn.body.resize(m_msgTemporaryIn.head.size);
-                        // We continue reading the message body
-                        ReadBody();
-                    }
-                    else
-                    {
-                        // We finished reading a whole message, so we add it to the queue of the parent object
-                        AddToIncomingQueue();
-                    }
-                }
-                else
-                {
-                    // There was a problem in reading the message head.
-                    std::cout << '[' << m_id << ']' << "ReadHead() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                    if (m_serverPtr != nullptr)
-                        return m_serverPtr->__RemoveClient(this);
-                }
-            });
-    }
-
-    template<typename T>
-    // Prime context to read a message body
-    void connection<T>::ReadBody()
-    {
-        asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-            [this](asio::error_code ec, size_t length) {
-                if (!ec)
-                {
-                    // We read a message body successfully
-                    AddToIncomingQueue();
-                }
-                else
-                {
-                    std::cout << '[' << m_id << ']' << "ReadBody() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                    if (m_serverPtr != nullptr)
-                        return m_serverPtr->__RemoveClient(this);
-                }
-            });
-    }
-
-    template<typename T>
-    void connection<T>::AddToIncomingQueue()
-    {
-        if (m_ownerType == owner::server)
-        {
-            m_qMessagesIn.push_back({ this, m_msgTemporaryIn });
-        }
-        else
-        {
-            m_qMessagesIn.push_back({ nullptr, m_msgTemporaryIn });
-            // A client doesnt need to know "who" sent the message, it is always the server.
-        }
-
-        // After successfully reading a message, start reading the next one.
-        ReadHead();
-
-    }
-
-    template<typename T>
-    void connection<T>::WriteValidation()
-    {
-
-        asio::async_write(m_socket, asio::buffer(&m_ValidateNumberOut, sizeof(uint64_t)),
-            [this](asio::error_code ec, size_t length) {
-                if (!ec) {
-                    //std::cout << "Wrote Validation number\n";
-                    if (m_ownerType == owner::client)
-                    {
-
-                        // Was: m_bValidated = true; 
-                        // Old system used this boolean to confirm validation status, now a message is sent by the server to confirm validation
-                        ReadValidationSuccess();
-                    }
-                }
-                else
-                {
-                    std::cout << '[' << m_id << ']' << "WriteValidation() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                    if (m_serverPtr != nullptr)
-                        return m_serverPtr->__RemoveUnvalidatedClient(this);
-                }
-            });
-    }
-
-    
-
-    template<typename T>
-    void connection<T>::ReadValidation()
-    {
-        asio::async_read(m_socket, asio::buffer(&m_ValidateNumberIn, sizeof(uint64_t)),
-            [this](asio::error_code ec, size_t length) {
-                if (!ec)
-                {
-                    //std::cout << "Read Validation number\n";
-                    if (m_ownerType == owner::client)
-                    {
-                        // If a client reads a validation, perform the certain function on it and send it back to the server for validation
-                        m_ValidateNumberOut = m_scrambleFunc(m_ValidateNumberIn);
-                        WriteValidation();
-                    }
-                    else
-                    {
-                        // If a server reads a validation, it means the client send it's validation and we check it's validity
-                        if (m_ValidateNumberIn == m_ValidateNumberCheck)
-                        {
-                            // Send a message to the client, informing it that it has been successfully validated;
-                            WriteValidationSuccess();
-                            if (m_serverPtr != nullptr)
-                                m_serverPtr->OnClientValidated(this);
-
-                        }
-                        else
-                        {
-                            m_socket.close();
-                            if (m_serverPtr != nullptr)
-                                return m_serverPtr->__RemoveUnvalidatedClient(this);
-                        }
-                    }
-                }
-                else
-                {
-                    std::cout << '[' << m_id << ']' << "ReadValidation() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                    if (m_serverPtr != nullptr)
-                        return m_serverPtr->__RemoveUnvalidatedClient(this);
-                }
-            });
-    }
-
-    template<typename T>
-    void connection<T>::WriteValidationSuccess()
-    {
-        // Send the validation confirmation to the client
-        m_bValidated = true;
-        asio::async_write(m_socket, asio::buffer(&m_bValidated, sizeof(bool)),
-            [this](asio::error_code ec, size_t length) {
-                if (!ec)
-                {
-                    //std::cout << "Wrote ValidationSuccess\n";
-                    if (m_ownerType == owner::server)
-                        ReadHead();
-                }
-                else
-                {
-                    std::cout << '[' << m_id << ']' << "WriteValidationSuccess() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                }
-            });
-    }
-
-    template<typename T>
-    void connection<T>::ReadValidationSuccess()
-    {
-        asio::async_read(m_socket, asio::buffer(&m_bValidated, sizeof(bool)),
-            [this](asio::error_code ec, size_t length) {
-                if (!ec)
-                {
-                    //std::cout << "Read ValidationSuccess\n";
-                    if (m_ownerType == owner::client)
-                    {
-                        //std::cout << "Read " << length << " bytes\n";
-                        // if the client succesfully got this message, we know it's validation it's confirmed
-                        // if the client was denied by the server, the connection is closed by the server without sending a message to the client
-
-                        // if the client is validated, the servers sends out a bool with the value true, which is read in    m_bValidated
-
-
-
-
-                        ReadHead();
-                    }
-                }
-                else
-                {
-                    std::cout << '[' << m_id << ']' << "ReadValidationSuccess() ERROR: " << ec.message() << '\n';
-                    m_socket.close();
-                }
-            });
-
-    }
-
-} // namespace kq
-
+#ifndef kqconnection_
+#define kqconnection_
+
+#include "common.h"
+#include "message.h"
+#include "wire.h"
+#include "tsqueue.h"
+#include "pool.h"
+#include "compression.h"
+#include "metrics.h"
+#include "coro.h"
+#include "dispatch.h"
+#include "stream.h"
+#include "payload.h"
+
+#include "server.h"
+
+namespace kq
+{
+    // Counters describing how the outbound queue has been coalesced into socket writes
+    struct write_stats
+    {
+        uint64_t nWrites = 0; // Number of gather-writes issued
+        uint64_t nMessages = 0; // Number of messages carried by those writes
+        uint64_t nBytes = 0; // Number of bytes carried by those writes, headers included
+        uint64_t nMaxMessagesPerWrite = 0; // Largest number of messages carried by a single write
+    };
+
+    // Counters describing how many messages each read of the socket delivered
+    struct read_stats
+    {
+        uint64_t nReads = 0; // Number of reads issued, buffered and direct
+        uint64_t nMessages = 0; // Number of messages parsed out of those reads
+        uint64_t nBytes = 0; // Number of bytes carried by those reads, headers included
+    };
+
+    // Counters describing how bodies were compressed and decompressed, to tune the compression threshold
+    struct compression_stats
+    {
+        uint64_t nCompressed = 0; // Bodies written compressed
+        uint64_t nIncompressible = 0; // Bodies over the threshold written raw, because they didn't get smaller
+        uint64_t nBytesIn = 0; // Raw bytes of the bodies written compressed
+        uint64_t nBytesOut = 0; // Bytes those bodies were compressed to
+        uint64_t nCompressNanoseconds = 0; // Time spent compressing, incompressible bodies included, a message shared with other connections counts for the one that compressed it
+        uint64_t nDecompressed = 0; // Compressed bodies read
+        uint64_t nDecompressBytesIn = 0; // Compressed bytes read
+        uint64_t nDecompressBytesOut = 0; // Bytes they expanded to
+        uint64_t nDecompressNanoseconds = 0; // Time spent decompressing
+
+        // Raw bytes per compressed byte written
+        double Ratio() const { return nBytesOut > 0 ? double(nBytesIn) / double(nBytesOut) : 0.0; }
+    };
+
+    // Counters of one lane of the outbound queue, to check control messages aren't held up by bulk data
+    struct lane_stats
+    {
+        uint64_t nQueued = 0; // Messages waiting in the lane
+        uint64_t nWritten = 0; // Messages taken out of the lane into a write
+        uint64_t nWaitNanoseconds = 0; // Time the written messages waited in the lane, all together (only measured with KQNET_METRICS)
+        uint64_t nMaxWaitNanoseconds = 0;
+
+        double MeanWaitNanoseconds() const { return nWritten > 0 ? double(nWaitNanoseconds) / double(nWritten) : 0.0; }
+    };
+
+    // A message waiting in a lane of the outbound queue
+    template<typename T>
+    struct queued_message
+    {
+        shared_message<T> msg;
+        uint64_t nQueuedAt; // metrics_now() when it was queued, 0 without KQNET_METRICS
+        std::shared_ptr<const external_body> external; // Written instead of msg's body, see payload.h
+
+        size_t body_size() const { return external ? external->nSize : msg->size(); }
+    };
+
+    // Optional features offered during validation, a feature is used once both sides offered it
+    enum connection_features : uint8_t
+    {
+        feature_compression = 1
+    };
+
+    // A buffer sequence referring to buffers owned by the connection, so asio's write operation copies two pointers instead of the buffers
+    struct const_buffer_view
+    {
+        typedef asio::const_buffer value_type;
+        typedef const asio::const_buffer* const_iterator;
+
+        const_iterator begin() const { return pBegin; }
+        const_iterator end() const { return pEnd; }
+
+        const asio::const_buffer* pBegin;
+        const asio::const_buffer* pEnd;
+    };
+
+    template<typename T, typename Q>
+    struct connection
+    {
+    public:
+        enum owner : uint8_t
+        {
+            client,
+            server
+        };
+
+        connection() = delete;
+        connection(owner parent, asio::io_context& context, asio::ip::tcp::socket socket, typename Q::template queue<owned_message<T, Q>>& qIn, uint64_t(*func)(uint64_t), kq::server_interface<T, Q>* serverAddress,
+            const std::shared_ptr<buffer_pool>& pool);
+        connection(connection<T, Q>&& other) noexcept;
+        virtual ~connection()
+        {
+#if KQNET_COROUTINES
+            CloseAwaiters();
+#endif
+        }
+
+        connection<T, Q>& operator=(const connection<T, Q>& other) = delete;
+        connection<T, Q>& operator=(connection<T, Q>&& other) noexcept;
+
+        uint32_t getID() const { return m_id; }
+        asio::ip::tcp::socket::endpoint_type& getIP() { return m_ip; }
+        
+
+        void ConnectToClient(uint32_t uid);
+        // uid becomes the ID of a client connection, e.g. it's key in a multi_client_interface
+        void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints, uint32_t uid = 0);
+        // Closes the socket from the strand, the pending read and write fail and remove the connection
+        void Disconnect();
+
+        bool IsConnected() const;
+
+        // Every Send returns false if the outbound queue is over a high-water mark (see SetBackpressure)
+        // priority picks the lane of the outbound queue, by default the one set for the message's ID
+
+        // Send a message to the remote
+        bool Send(const kq::message<T>& msg, message_priority priority = priority_by_id);
+
+        // Send a message to the remote, it's body is handed over without a copy
+        bool Send(kq::message<T>&& msg, message_priority priority = priority_by_id);
+
+        // Send a message which may be queued to many connections at once, it is not copied
+        bool Send(const kq::shared_message<T>& msg, message_priority priority = priority_by_id);
+        bool Send(kq::shared_message<T>&& msg, message_priority priority = priority_by_id);
+
+        // Send a message built in place, fill(message<T>&) writes it's body straight into pooled memory
+        template<typename Fill>
+        bool SendEmplace(T id, Fill&& fill, message_priority priority = priority_by_id);
+
+        // Send a message of id whose body is written straight out of memory or a file range (see payload.h), a file range with sendfile on Linux
+        // The body is neither copied nor compressed, it's lifetime handle is released once it was written
+        bool SendExternal(T id, external_body body, message_priority priority = priority_by_id);
+
+        // High-water marks of the outbound queue, in messages and in bytes (headers included), 0 (the default) leaves it unbounded
+        // policy decides what happens to a message sent over a mark, the server's OnClientBackpressure is called once each time a mark is crossed
+        // The marks count again once the queue drained to half of them
+        void SetBackpressure(size_t nMaxMessages, size_t nMaxBytes, backpressure_policy policy = backpressure_report);
+        size_t GetMaxQueuedMessages() const { return m_nMaxQueuedMessages; }
+        size_t GetMaxQueuedBytes() const { return m_nMaxQueuedBytes; }
+        backpressure_policy GetBackpressurePolicy() const { return m_backpressurePolicy; }
+
+        // Messages and bytes sent but not written yet, including the write in progress
+        size_t GetQueuedMessages() const { return m_nQueuedMessages.load(std::memory_order_relaxed); }
+        size_t GetQueuedBytes() const { return m_nQueuedBytes.load(std::memory_order_relaxed); }
+
+        // Whether a mark was crossed and the queue hasn't drained to half of it yet
+        bool IsBackpressured() const { return m_bBackpressure; }
+
+        // Messages not queued or dropped because of the marks
+        uint64_t GetDroppedMessages() const { return m_nDropped.load(std::memory_order_relaxed); }
+
+        lane_stats GetLaneStats(message_priority lane) const;
+
+        // Sends the payload read from source as a stream of fragments of id, returns the stream's number (see stream.h)
+        // Fragments are built whenever a write has room left after the queued messages, nChunkSize data bytes each
+        // Every fragment must fit the remote's maximum frame size, with up to nMaxStreamHeaderSize bytes more
+        uint64_t SendStream(T id, stream_source source, size_t nChunkSize = nDefaultStreamChunkSize);
+
+        // Streams whose last fragment wasn't built yet
+        size_t GetActiveStreams() const { return m_nActiveStreams.load(std::memory_order_relaxed); }
+
+        // Bodies bigger than nBytes close the connection as soon as their head is read, before anything is allocated for them
+        // A compressed body expanding past it closes the connection as malformed
+        // nDefaultMaxFrameSize (64 MB) by default, 0 doesn't limit them
+        void SetMaxFrameSize(size_t nBytes) { m_nMaxFrameSize = nBytes; }
+        size_t GetMaxFrameSize() const { return m_nMaxFrameSize; }
+
+#if KQNET_COROUTINES
+        // auto msg = co_await receive() resumes on the thread which read the message, msg is empty once the connection closed
+        // From the first receive on, messages are kept for the coroutine instead of going to the incoming queue
+        // Call it first from the strand (OnClientValidated, or after co_await connect) so no message goes to the queue before
+        // One coroutine at a time may receive, and one send
+        receive_awaiter<T, Q> receive() { return receive_awaiter<T, Q>(this); }
+
+        // co_await send(msg) is Send, but waits for a backpressured queue to drain first
+        send_awaiter<T, Q> send(const message<T>& msg) { return send_awaiter<T, Q>(this, m_pool->share(msg)); }
+        send_awaiter<T, Q> send(message<T>&& msg) { return send_awaiter<T, Q>(this, m_pool->share(std::move(msg))); }
+        send_awaiter<T, Q> send(const shared_message<T>& msg) { return send_awaiter<T, Q>(this, msg); }
+#endif
+
+    public:
+        // Counts reason in the server's metrics, unless the connection was already counted
+        void __CountDisconnect(disconnect_reason reason);
+
+        // A client connection of a multi_client_interface is handed back to it once it failed, instead of to a server
+        void __SetMultiClient(kq::multi_client_interface<T, Q>* clients) { m_clientsPtr = clients; }
+
+        // Called once from the strand with how connecting and validating a client connection ended, set it before ConnectToServer
+        void __SetConnectHandler(std::function<void(connect_result)> handler) { m_connectHandler = std::move(handler); }
+
+        // Called once from the strand when no operation of a client connection without a multi_client_interface is pending anymore
+        // Only handlers posted to the connection may still be queued, it can be deleted once they ran
+        void __SetReleaseHandler(std::function<void()> handler) { m_releaseHandler = std::move(handler); }
+
+        // The owner's handlers, inline ones are called by the connection instead of queueing the message
+        void __SetDispatch(const dispatch_table<T, Q>* table) { m_pDispatch = table; }
+
+        // The owner's lanes per message ID, used by sends with priority_by_id
+        void __SetPriorities(const priority_table<T>* table) { m_pPriorities = table; }
+
+#if KQNET_COROUTINES
+        // Return true if the awaiter stays suspended, it is resumed from the strand later
+        bool __AwaitReceive(receive_awaiter<T, Q>* receiver);
+        bool __AwaitSend(send_awaiter<T, Q>* sender);
+#endif
+
+        // Upper bound of bytes gathered into a single write, a message bigger than the limit is still written on it's own
+        void SetWriteBatchLimit(size_t nBytes) { m_nWriteBatchLimit = nBytes; }
+        size_t GetWriteBatchLimit() const { return m_nWriteBatchLimit; }
+
+        write_stats GetWriteStats() const;
+
+        read_stats GetReadStats() const;
+
+        // Bodies of nBytes and more are compressed, if the remote enabled compression as well, 0 (the default) disables it
+        // Compression is agreed on during validation, so it has to be set before the connection is validated
+        void SetCompressionThreshold(size_t nBytes);
+        size_t GetCompressionThreshold() const { return m_nCompressionThreshold; }
+
+        // Whether both sides agreed on compression, frames then carry a flag marking compressed bodies (see wire_header::encode_flagged)
+        bool IsCompressionEnabled() const { return m_bCompression; }
+
+        compression_stats GetCompressionStats() const;
+
+    private:    
+
+        // Queues msg in it's lane from the strand, with the body written instead of it's own if external is set
+        bool Enqueue(shared_message<T>&& msg, std::shared_ptr<const external_body>&& external, message_priority priority);
+
+        // Accounts a message of nBytes to the queue, returns false if it must not be queued
+        // bAccepted is what Send returns
+        bool AdmitMessage(size_t nBytes, bool& bAccepted);
+
+        // Drops the oldest queued messages until the queue is under the marks, lowest lane first, the newest message (queued in nNewestLane) is kept
+        void DropOldest(size_t nNewestLane);
+
+        // Whether any lane holds a message
+        bool HasQueuedMessages() const;
+
+        // Adds a fragment of every stream to the batch while it has room, round robin so streams share the bandwidth
+        void TakeFragments(size_t& nBatchBytes);
+
+        bool IsOverMarks(size_t nMessages, size_t nBytes) const;
+
+        // Prime context to write every queued message (up to the batch limit) with a single gather-write
+        void WriteMessages();
+
+        // Sends the file range ending the batch once the gather-write wrote the rest, nWritten bytes of it
+        void WriteFileBody(size_t nWritten);
+
+        // Accounts the nWritten bytes of the batch as written and starts the next write, if there is anything left
+        void FinishWrite(size_t nWritten);
+
+        // Prime context to read as many bytes as the socket has into the receive buffer
+        void ReadMessages();
+
+        // Prime context to read the rest of a big body straight into the message
+        void ReadBody(size_t nOffset);
+
+        // Delivers every complete message of the receive buffer
+        // Returns false if a body is left to be read by ReadBody, the incoming queue is full or the connection was closed
+        bool ParseMessages();
+
+        // Hands m_msgTemporaryIn to it's handler, receiver or the incoming queue, returns false if the queue is full and it's kept
+        bool AddToIncomingQueue();
+
+        // Pushes m_msgTemporaryIn to the incoming queue, returns false if the queue is full and it's kept
+        bool PushIncoming();
+
+        // Reading stops while the incoming queue is full, the consumer thread is never waited for on the strand
+        // m_msgTemporaryIn is pushed once there's room, then the buffer is parsed and read again
+        void WaitForIncomingRoom();
+
+        // Closes the socket after a read (or write) failed, then the server removes the connection
+        // If the other one is still pending it fails as well, it's handler removes the connection once nothing refers to it anymore
+        void CloseAfterError(bool bWrite, disconnect_reason reason);
+
+        // Hands a closed client connection with nothing pending back to it's multi_client_interface, which deletes it
+        void ReleaseToClients();
+
+        // Takes a closed connection with nothing pending out of the server's table, it's deleted from the strand afterwards
+        void ReleaseToServer(bool bValidated);
+
+        // Calls the connect handler, only the first result is reported
+        void ReportConnect(connect_result result);
+
+#if KQNET_COROUTINES
+        // Hands m_msgTemporaryIn to the waiting receiver and resumes it, or keeps it until the next receive
+        void DeliverToReceiver();
+
+        // Resumes the waiting sender once the queue isn't backpressured anymore
+        void ResumeSender();
+
+        // Resumes every waiting coroutine with nothing, from then on they don't wait anymore
+        void CloseAwaiters();
+#endif
+
+        static disconnect_reason ReadErrorReason(const asio::error_code& ec)
+        {
+            return ec == asio::error::eof || ec == asio::error::connection_reset ? disconnect_remote : disconnect_read_error;
+        }
+
+
+        // Returns the compressed body of msg, or nullptr if it didn't get smaller
+        // A message of the pool is compressed once, whichever connection writes it first, the others write the same body
+        // Any other message is compressed into m_vWriteCompressed
+        const kq::vector<uint8_t>* CompressBody(const shared_message<T>& msg);
+
+        // Compresses the body of msg into body, returns false (leaving body empty) if it didn't get smaller
+        bool CompressInto(const message<T>& msg, kq::vector<uint8_t>& body);
+
+        // Expands the compressed body of nSize bytes at pIn into m_msgTemporaryIn, returns false if it's malformed
+        bool DecompressBody(const uint8_t* pIn, size_t nSize);
+
+        void WriteValidation();
+        void ReadValidation();
+
+        void WriteValidationSuccess();
+        void ReadValidationSuccess();
+        
+        
+
+    protected:
+        asio::io_context& m_context; // The context for the socket to work on                           
+        asio::strand<asio::io_context::executor_type> m_strand; // Serializes every handler of this connection, even when the context is run by several threads
+        asio::ip::tcp::socket m_socket; // Each connection will have a unique socket to the remote
+        std::array<kq::vector<queued_message<T>>, priority_count> m_qMessagesOut; // A queue per lane holding messages to be sent to remote, only touched from the strand so it needs no lock
+        kq::vector<shared_message<T>> m_vMessagesWriting; // Messages taken out of m_qMessagesOut that are currently being written
+        kq::vector<std::shared_ptr<const external_body>> m_vWritingExternal; // External bodies of m_vMessagesWriting by index, fragments come after it's end
+        size_t m_nFileSent; // Bytes of the file range ending the batch sent so far
+        kq::vector<uint8_t> m_vFileChunk; // Where sendfile isn't available, file ranges are written through it
+        kq::vector<uint8_t> m_vWriteHeads; // Encoded heads of m_vMessagesWriting
+        kq::vector<asio::const_buffer> m_vWriteBuffers; // Header and body buffers of m_vMessagesWriting
+        size_t m_nWriteBatchLimit;
+        bool m_bWriting;
+        size_t m_nWritingBytes; // Bytes of m_vMessagesWriting, as accounted in m_nQueuedBytes
+        bool m_bReadFailed; // No read is pending anymore, see CloseAfterError
+        std::atomic<bool> m_bDisconnectCounted; // Only the first reason a connection closed for is counted
+        typename Q::template queue<owned_message<T, Q>>& m_qMessagesIn; // Reference to incoming queue of parent object
+        message<T> m_msgTemporaryIn; // Auxiliary message for reading
+        kq::vector<uint8_t> m_vReadBuffer; // Receive buffer, bytes in [m_nReadStart, m_nReadEnd) are yet to be parsed
+        size_t m_nReadStart;
+        size_t m_nReadEnd;
+        asio::steady_timer m_timerIncoming; // While the incoming queue is full, retries m_msgTemporaryIn every millisecond without reading
+        std::shared_ptr<buffer_pool> m_pool; // Pool of the parent object, bodies are read into and recycled from it
+        owner m_ownerType; // A connection behaves differently for a server or client
+
+        uint32_t m_id;
+
+        uint64_t m_ValidateNumberIn;
+        uint64_t m_ValidateNumberOut;
+        uint64_t m_ValidateNumberCheck;
+
+        uint64_t (*m_scrambleFunc)(uint64_t);
+        kq::server_interface<T, Q>* m_serverPtr;
+        kq::multi_client_interface<T, Q>* m_clientsPtr;
+        std::function<void(connect_result)> m_connectHandler; // Cleared once called
+        std::function<void()> m_releaseHandler; // Same
+        const dispatch_table<T, Q>* m_pDispatch; // Owned by the server or client, nullptr without handlers
+        const priority_table<T>* m_pPriorities; // Owned by the server or client, nullptr sends every message normal
+        asio::ip::tcp::socket::endpoint_type m_ip;
+
+        std::atomic<bool> m_bValidated; // Read by the owner's thread while the context sets it
+        bool m_bValidationSuccess; // The byte exchanged with the remote to confirm validation
+
+        std::atomic<uint64_t> m_nWrites;
+        std::atomic<uint64_t> m_nMessagesWritten;
+        std::atomic<uint64_t> m_nBytesWritten;
+        std::atomic<uint64_t> m_nMaxMessagesPerWrite;
+
+        std::atomic<uint64_t> m_nReads;
+        std::atomic<uint64_t> m_nMessagesRead;
+        std::atomic<uint64_t> m_nBytesRead;
+
+        size_t m_nCompressionThreshold; // Bodies from this size up are compressed, 0 doesn't offer compression to the remote
+        bool m_bCompression; // Both sides offered compression during validation
+        bool m_bCompressedIn; // The body being read is compressed
+        uint8_t m_nFeaturesOut; // Features the client offers, or the server agreed on, sent during validation
+        uint8_t m_nFeaturesIn; // Features the client offered, or the server agreed on, read during validation
+        kq::vector<kq::vector<uint8_t>> m_vWriteCompressed; // Compressed bodies of m_vMessagesWriting, given back to the pool once written
+
+        std::atomic<uint64_t> m_nCompressed;
+        std::atomic<uint64_t> m_nIncompressible;
+        std::atomic<uint64_t> m_nCompressBytesIn;
+        std::atomic<uint64_t> m_nCompressBytesOut;
+        std::atomic<uint64_t> m_nCompressNanoseconds;
+        std::atomic<uint64_t> m_nDecompressed;
+        std::atomic<uint64_t> m_nDecompressBytesIn;
+        std::atomic<uint64_t> m_nDecompressBytesOut;
+        std::atomic<uint64_t> m_nDecompressNanoseconds;
+
+        // Set by the owner's thread, read by every thread sending
+        std::atomic<size_t> m_nMaxQueuedMessages;
+        std::atomic<size_t> m_nMaxQueuedBytes;
+        std::atomic<backpressure_policy> m_backpressurePolicy;
+
+        // Counted when sent, so they are known on the sender's thread before the message reaches the strand
+        std::atomic<size_t> m_nQueuedMessages;
+        std::atomic<size_t> m_nQueuedBytes;
+        std::atomic<bool> m_bBackpressure;
+        std::atomic<uint64_t> m_nDropped;
+
+        // Per lane, see lane_stats
+        std::array<std::atomic<uint64_t>, priority_count> m_nLaneQueued;
+        std::array<std::atomic<uint64_t>, priority_count> m_nLaneWritten;
+        std::array<std::atomic<uint64_t>, priority_count> m_nLaneWaitNanoseconds;
+        std::array<std::atomic<uint64_t>, priority_count> m_nLaneMaxWaitNanoseconds;
+
+        kq::vector<outbound_stream<T>> m_vStreamsOut; // Only touched from the strand
+        size_t m_nNextStream; // Index of the stream whose fragment comes first in the next write
+        std::atomic<uint64_t> m_nStreamsOpened; // Numbers the streams
+        std::atomic<size_t> m_nActiveStreams;
+        size_t m_nMaxFrameSize;
+
+#if KQNET_COROUTINES
+        // Only touched from the strand, or once nothing runs the connection anymore
+        bool m_bReceiveAwaited = false; // receive was called, messages go to m_qReceived instead of m_qMessagesIn
+        kq::deque<message<T>> m_qReceived; // Messages read while no coroutine was waiting
+        receive_awaiter<T, Q>* m_pReceiver = nullptr;
+        send_awaiter<T, Q>* m_pSender = nullptr;
+        std::atomic<bool> m_bAwaitClosed = false;
+#endif
+
+        static const size_t nReadBufferSize = 64 * 1024;
+        static const size_t nDirectReadSize = 16 * 1024; // Bodies above this size which are not complete in the buffer skip it
+
+    }; // end of connection<T, Q>
+    
+    template<typename T, typename Q>
+    connection<T, Q>::connection(owner parent, asio::io_context& context, asio::ip::tcp::socket socket, typename Q::template queue<owned_message<T, Q>>& qIn, uint64_t (*scrambleFunc)(uint64_t), kq::server_interface<T, Q>* serverAddress,
+        const std::shared_ptr<buffer_pool>& pool)
+        : m_context(context), m_strand(asio::make_strand(context)), m_socket(std::move(socket)), m_qMessagesOut(), m_vMessagesWriting(), m_vWritingExternal(), m_nFileSent(0), m_vFileChunk(), m_vWriteHeads(), m_vWriteBuffers(), m_nWriteBatchLimit(64 * 1024), m_bWriting(false), m_nWritingBytes(0), m_bReadFailed(false), m_bDisconnectCounted(false),
+        m_qMessagesIn(qIn), m_msgTemporaryIn(), m_vReadBuffer(), m_nReadStart(0), m_nReadEnd(0), m_timerIncoming(context), m_pool(pool), m_ownerType(parent), m_id(0),
+        m_ValidateNumberIn(0), m_ValidateNumberOut(0), m_ValidateNumberCheck(0), m_scrambleFunc(scrambleFunc), m_serverPtr(serverAddress), m_clientsPtr(nullptr), m_connectHandler(), m_releaseHandler(), m_pDispatch(nullptr), m_pPriorities(nullptr), m_ip(), m_bValidated(false), m_bValidationSuccess(false),
+        m_nWrites(0), m_nMessagesWritten(0), m_nBytesWritten(0), m_nMaxMessagesPerWrite(0), m_nReads(0), m_nMessagesRead(0), m_nBytesRead(0),
+        m_nCompressionThreshold(0), m_bCompression(false), m_bCompressedIn(false), m_nFeaturesOut(0), m_nFeaturesIn(0), m_vWriteCompressed(),
+        m_nCompressed(0), m_nIncompressible(0), m_nCompressBytesIn(0), m_nCompressBytesOut(0), m_nCompressNanoseconds(0),
+        m_nDecompressed(0), m_nDecompressBytesIn(0), m_nDecompressBytesOut(0), m_nDecompressNanoseconds(0),
+        m_nMaxQueuedMessages(0), m_nMaxQueuedBytes(0), m_backpressurePolicy(backpressure_report), m_nQueuedMessages(0), m_nQueuedBytes(0), m_bBackpressure(false), m_nDropped(0),
+        m_nLaneQueued(), m_nLaneWritten(), m_nLaneWaitNanoseconds(), m_nLaneMaxWaitNanoseconds(),
+        m_vStreamsOut(), m_nNextStream(0), m_nStreamsOpened(0), m_nActiveStreams(0), m_nMaxFrameSize(nDefaultMaxFrameSize)
+    {
+        if (parent == owner::server)
+        {
+            m_ip = m_socket.remote_endpoint();
+
+            m_ValidateNumberOut = static_cast<uint64_t>(time(NULL));
+
+            m_ValidateNumberCheck = m_scrambleFunc(m_ValidateNumberOut);
+        }
+    }
+
+    template<typename T, typename Q>
+    connection<T, Q>::connection(connection<T, Q>&& other) noexcept
+        : m_context(std::move(other.m_context)), m_strand(std::move(other.m_strand)), m_socket(std::move(other.m_socket)), m_qMessagesOut(std::move(other.m_qMessagesOut)),
+        m_vMessagesWriting(std::move(other.m_vMessagesWriting)), m_vWritingExternal(std::move(other.m_vWritingExternal)), m_nFileSent(other.m_nFileSent), m_vFileChunk(std::move(other.m_vFileChunk)), m_vWriteHeads(std::move(other.m_vWriteHeads)), m_vWriteBuffers(std::move(other.m_vWriteBuffers)), m_nWriteBatchLimit(other.m_nWriteBatchLimit),
+        m_bWriting(other.m_bWriting), m_nWritingBytes(other.m_nWritingBytes), m_bReadFailed(other.m_bReadFailed), m_bDisconnectCounted(other.m_bDisconnectCounted.load()), m_qMessagesIn(std::move(m_qMessagesIn)),
+        m_msgTemporaryIn(std::move(other.m_msgTemporaryIn)), m_vReadBuffer(std::move(other.m_vReadBuffer)), m_nReadStart(other.m_nReadStart), m_nReadEnd(other.m_nReadEnd), m_timerIncoming(std::move(other.m_timerIncoming)), m_pool(std::move(other.m_pool)), m_ownerType(other.m_ownerType), m_id(other.m_id), m_ValidateNumberIn(other.m_ValidateNumberIn),
+        m_ValidateNumberOut(other.m_ValidateNumberOut), m_ValidateNumberCheck(other.m_ValidateNumberCheck), m_scrambleFunc(other.m_scrambleFunc), m_serverPtr(other.m_serverPtr), m_clientsPtr(other.m_clientsPtr), m_connectHandler(std::move(other.m_connectHandler)), m_releaseHandler(std::move(other.m_releaseHandler)), m_pDispatch(other.m_pDispatch), m_pPriorities(other.m_pPriorities), m_ip(other.m_ip),
+        m_bValidated(other.m_bValidated.load()), m_bValidationSuccess(other.m_bValidationSuccess), m_nWrites(other.m_nWrites.load()), m_nMessagesWritten(other.m_nMessagesWritten.load()),
+        m_nBytesWritten(other.m_nBytesWritten.load()), m_nMaxMessagesPerWrite(other.m_nMaxMessagesPerWrite.load()), m_nReads(other.m_nReads.load()),
+        m_nMessagesRead(other.m_nMessagesRead.load()), m_nBytesRead(other.m_nBytesRead.load()),
+        m_nCompressionThreshold(other.m_nCompressionThreshold), m_bCompression(other.m_bCompression), m_bCompressedIn(other.m_bCompressedIn), m_nFeaturesOut(other.m_nFeaturesOut),
+        m_nFeaturesIn(other.m_nFeaturesIn), m_vWriteCompressed(std::move(other.m_vWriteCompressed)), m_nCompressed(other.m_nCompressed.load()), m_nIncompressible(other.m_nIncompressible.load()),
+        m_nCompressBytesIn(other.m_nCompressBytesIn.load()), m_nCompressBytesOut(other.m_nCompressBytesOut.load()), m_nCompressNanoseconds(other.m_nCompressNanoseconds.load()),
+        m_nDecompressed(other.m_nDecompressed.load()), m_nDecompressBytesIn(other.m_nDecompressBytesIn.load()), m_nDecompressBytesOut(other.m_nDecompressBytesOut.load()),
+        m_nDecompressNanoseconds(other.m_nDecompressNanoseconds.load()), m_nMaxQueuedMessages(other.m_nMaxQueuedMessages.load()), m_nMaxQueuedBytes(other.m_nMaxQueuedBytes.load()),
+        m_backpressurePolicy(other.m_backpressurePolicy.load()), m_nQueuedMessages(other.m_nQueuedMessages.load()), m_nQueuedBytes(other.m_nQueuedBytes.load()),
+        m_bBackpressure(other.m_bBackpressure.load()), m_nDropped(other.m_nDropped.load()),
+        m_nLaneQueued(), m_nLaneWritten(), m_nLaneWaitNanoseconds(), m_nLaneMaxWaitNanoseconds(),
+        m_vStreamsOut(std::move(other.m_vStreamsOut)), m_nNextStream(other.m_nNextStream), m_nStreamsOpened(other.m_nStreamsOpened.load()),
+        m_nActiveStreams(other.m_nActiveStreams.load()), m_nMaxFrameSize(other.m_nMaxFrameSize)
+    {
+        for (size_t i = 0; i < priority_count; ++i)
+        {
+            m_nLaneQueued[i] = other.m_nLaneQueued[i].load();
+            m_nLaneWritten[i] = other.m_nLaneWritten[i].load();
+            m_nLaneWaitNanoseconds[i] = other.m_nLaneWaitNanoseconds[i].load();
+            m_nLaneMaxWaitNanoseconds[i] = other.m_nLaneMaxWaitNanoseconds[i].load();
+        }
+    }
+
+    template<typename T, typename Q>
+    connection<T, Q>& connection<T, Q>::operator=(connection<T, Q>&& other) noexcept
+    {
+        m_context               = std::move(other.m_context);
+        m_strand                = std::move(other.m_strand);
+        m_socket                = std::move(other.m_socket);
+        m_qMessagesOut          = std::move(other.m_qMessagesOut);
+        m_vMessagesWriting      = std::move(other.m_vMessagesWriting);
+        m_vWritingExternal      = std::move(other.m_vWritingExternal);
+        m_nFileSent             = other.m_nFileSent;
+        m_vFileChunk            = std::move(other.m_vFileChunk);
+        m_vWriteHeads           = std::move(other.m_vWriteHeads);
+        m_vWriteBuffers         = std::move(other.m_vWriteBuffers);
+        m_nWriteBatchLimit      = other.m_nWriteBatchLimit;
+        m_bWriting              = other.m_bWriting;
+        m_nWritingBytes         = other.m_nWritingBytes;
+        m_bReadFailed           = other.m_bReadFailed;
+        m_bDisconnectCounted    = other.m_bDisconnectCounted.load();
+        m_qMessagesIn           = std::move(other.m_qMessagesIn);
+        m_msgTemporaryIn        = std::move(other.m_msgTemporaryIn);
+        m_vReadBuffer           = std::move(other.m_vReadBuffer);
+        m_nReadStart            = other.m_nReadStart;
+        m_nReadEnd              = other.m_nReadEnd;
+        m_timerIncoming         = std::move(other.m_timerIncoming);
+        m_pool                  = std::move(other.m_pool);
+        m_ownerType             = other.m_ownerType;
+        m_id                    = other.m_id;
+        m_ValidateNumberIn      = other.m_ValidateNumberIn;
+        m_ValidateNumberOut     = other.m_ValidateNumberOut;
+        m_ValidateNumberCheck   = other.m_ValidateNumberCheck;
+        m_scrambleFunc          = other.m_scrambleFunc;
+        m_serverPtr             = other.m_serverPtr;
+        m_clientsPtr            = other.m_clientsPtr;
+        m_connectHandler        = std::move(other.m_connectHandler);
+        m_releaseHandler        = std::move(other.m_releaseHandler);
+        m_pDispatch             = other.m_pDispatch;
+        m_pPriorities           = other.m_pPriorities;
+        m_ip                    = std::move(m_ip);
+        other.m_serverPtr       = nullptr; // maybe reconsider ?
+        other.m_clientsPtr      = nullptr;
+        m_bValidated            = other.m_bValidated.load();
+        m_bValidationSuccess    = other.m_bValidationSuccess;
+        m_nWrites               = other.m_nWrites.load();
+        m_nMessagesWritten      = other.m_nMessagesWritten.load();
+        m_nBytesWritten         = other.m_nBytesWritten.load();
+        m_nMaxMessagesPerWrite  = other.m_nMaxMessagesPerWrite.load();
+        m_nReads                = other.m_nReads.load();
+        m_nMessagesRead         = other.m_nMessagesRead.load();
+        m_nBytesRead            = other.m_nBytesRead.load();
+        m_nCompressionThreshold = other.m_nCompressionThreshold;
+        m_bCompression          = other.m_bCompression;
+        m_bCompressedIn         = other.m_bCompressedIn;
+        m_nFeaturesOut          = other.m_nFeaturesOut;
+        m_nFeaturesIn           = other.m_nFeaturesIn;
+        m_vWriteCompressed      = std::move(other.m_vWriteCompressed);
+        m_nCompressed           = other.m_nCompressed.load();
+        m_nIncompressible       = other.m_nIncompressible.load();
+        m_nCompressBytesIn      = other.m_nCompressBytesIn.load();
+        m_nCompressBytesOut     = other.m_nCompressBytesOut.load();
+        m_nCompressNanoseconds  = other.m_nCompressNanoseconds.load();
+        m_nDecompressed         = other.m_nDecompressed.load();
+        m_nDecompressBytesIn    = other.m_nDecompressBytesIn.load();
+        m_nDecompressBytesOut   = other.m_nDecompressBytesOut.load();
+        m_nDecompressNanoseconds = other.m_nDecompressNanoseconds.load();
+        m_nMaxQueuedMessages    = other.m_nMaxQueuedMessages.load();
+        m_nMaxQueuedBytes       = other.m_nMaxQueuedBytes.load();
+        m_backpressurePolicy    = other.m_backpressurePolicy.load();
+        m_nQueuedMessages       = other.m_nQueuedMessages.load();
+        m_nQueuedBytes          = other.m_nQueuedBytes.load();
+        m_bBackpressure         = other.m_bBackpressure.load();
+        m_nDropped              = other.m_nDropped.load();
+        for (size_t i = 0; i < priority_count; ++i)
+        {
+            m_nLaneQueued[i]             = other.m_nLaneQueued[i].load();
+            m_nLaneWritten[i]            = other.m_nLaneWritten[i].load();
+            m_nLaneWaitNanoseconds[i]    = other.m_nLaneWaitNanoseconds[i].load();
+            m_nLaneMaxWaitNanoseconds[i] = other.m_nLaneMaxWaitNanoseconds[i].load();
+        }
+        m_vStreamsOut           = std::move(other.m_vStreamsOut);
+        m_nNextStream           = other.m_nNextStream;
+        m_nStreamsOpened        = other.m_nStreamsOpened.load();
+        m_nActiveStreams        = other.m_nActiveStreams.load();
+        m_nMaxFrameSize         = other.m_nMaxFrameSize;
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ConnectToClient(uint32_t uid)
+    {
+        if (m_ownerType == owner::server)
+        {
+            if (m_socket.is_open())
+            {
+                m_ip = m_socket.remote_endpoint();
+                m_id = uid;
+                // Was: ReadHead();
+                // Before starting to read messages, we will validate the client by sending him a number on which he shall perform 
+                // a function which the server will check the result from
+                // Both are started from the strand, so their handlers can't run while the other one is being primed
+                asio::post(m_strand, [this]() {
+                    WriteValidation();
+
+                    ReadValidation();
+                    });
+            }
+        }
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints, uint32_t uid)
+    {
+        if (m_ownerType == owner::client)
+        {
+            m_id = uid;
+            asio::async_connect(m_socket, endpoints,
+                asio::bind_executor(m_strand, [this](std::error_code ec, asio::ip::tcp::endpoint endpoint) {
+                    if (!ec)
+                    {
+                        m_ip =  m_socket.remote_endpoint();
+                        //Was: ReadHead();
+                        //Whenever we connect to the server we expect to receive a number for validation
+                        ReadValidation();
+                        //std::cout << "Connected\n";
+                    }
+                    else
+                    {
+                        std::cout << "ConnectToServer() ERROR: " << ec.message() << "\n";
+                        ReportConnect(connect_refused);
+                        ReleaseToClients();
+                    }
+                }));
+        }
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::Disconnect()
+    {
+        // A connection still connecting or validating is closed as well, it's pending operation fails like any other
+        asio::post(m_strand, [this]() {
+            if (m_socket.is_open())
+                m_socket.close();
+            });
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::IsConnected() const
+    {
+        // A client is "only" connected to the server once it's validated
+        return m_bValidated;
+    }
+
+    
+
+    template<typename T, typename Q>
+    // Send a message to the remote
+    bool connection<T, Q>::Send(const kq::message<T>& msg, message_priority priority)
+    {
+        return Send(m_pool->share(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    // Send a message to the remote, it's body is handed over without a copy
+    bool connection<T, Q>::Send(kq::message<T>&& msg, message_priority priority)
+    {
+        return Send(m_pool->share(std::move(msg)), priority);
+    }
+
+    template<typename T, typename Q>
+    // Send a message which may be queued to many connections at once, it is not copied
+    bool connection<T, Q>::Send(const kq::shared_message<T>& msg, message_priority priority)
+    {
+        return Send(kq::shared_message<T>(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::Send(kq::shared_message<T>&& msg, message_priority priority)
+    {
+        return Enqueue(std::move(msg), nullptr, priority);
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::SendExternal(T id, external_body body, message_priority priority)
+    {
+        if (body.pData == nullptr && body.fd < 0)
+            return false;
+
+        // The message only carries the header, it's size is the external body's
+        message<T> head(id);
+        head.head.size = body.nSize;
+        return Enqueue(m_pool->share(std::move(head)), std::allocate_shared<external_body>(pool_allocator<external_body>(m_pool), std::move(body)), priority);
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::Enqueue(shared_message<T>&& msg, std::shared_ptr<const external_body>&& external, message_priority priority)
+    {
+        size_t nBodySize = external ? external->nSize : msg->size();
+        bool bAccepted = true;
+        if (AdmitMessage(wire_header<T>::size(nBodySize) + nBodySize, bAccepted) == false)
+            return bAccepted;
+
+        if (priority >= priority_count)
+            priority = m_pPriorities != nullptr ? m_pPriorities->get(msg->head.id) : priority_normal;
+
+        // The handler is allocated from the pool, Send is usually called from a thread which doesn't run the context
+        // The reference is moved into the handler and from there into the queue
+        asio::post(m_strand, make_pooled_handler(m_pool, [this, msg = std::move(msg), external = std::move(external), priority, nBodySize]() mutable {
+            // A closed connection writes nothing anymore, starting a write would only fail into CloseAfterError a second time
+            if (m_socket.is_open() == false)
+            {
+                m_nQueuedMessages.fetch_sub(1, std::memory_order_relaxed);
+                m_nQueuedBytes.fetch_sub(wire_header<T>::size(nBodySize) + nBodySize, std::memory_order_relaxed);
+                return;
+            }
+
+            // Either way we add the message to the queue of it's lane.
+#if KQNET_METRICS
+            m_qMessagesOut[priority].push_back({ std::move(msg), metrics_now(), std::move(external) });
+#else
+            m_qMessagesOut[priority].push_back({ std::move(msg), 0, std::move(external) });
+#endif
+            m_nLaneQueued[priority].fetch_add(1, std::memory_order_relaxed);
+            if (m_backpressurePolicy == backpressure_drop_oldest)
+                DropOldest(priority);
+            // If we are not sending messages, start sending
+            // Otherwise the message will be picked up by the next batch, once the current write completes
+            if (m_bWriting == false)
+            {
+                m_bWriting = true;
+                WriteMessages();
+            }
+            }));
+        return bAccepted;
+    }
+
+    template<typename T, typename Q>
+    template<typename Fill>
+    // Send a message built in place, fill(message<T>&) writes it's body straight into pooled memory
+    bool connection<T, Q>::SendEmplace(T id, Fill&& fill, message_priority priority)
+    {
+        return Send(m_pool->make(id, std::forward<Fill>(fill)), priority);
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::SetBackpressure(size_t nMaxMessages, size_t nMaxBytes, backpressure_policy policy)
+    {
+        m_nMaxQueuedMessages = nMaxMessages;
+        m_nMaxQueuedBytes = nMaxBytes;
+        m_backpressurePolicy = policy;
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::IsOverMarks(size_t nMessages, size_t nBytes) const
+    {
+        size_t nMaxMessages = m_nMaxQueuedMessages.load(std::memory_order_relaxed);
+        size_t nMaxBytes = m_nMaxQueuedBytes.load(std::memory_order_relaxed);
+        return (nMaxMessages > 0 && nMessages > nMaxMessages) || (nMaxBytes > 0 && nBytes > nMaxBytes);
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::AdmitMessage(size_t nBytes, bool& bAccepted)
+    {
+        // Several threads may send at once, each one judges the queue including it's own message
+        size_t nQueuedMessages = m_nQueuedMessages.fetch_add(1, std::memory_order_relaxed) + 1;
+        size_t nQueuedBytes = m_nQueuedBytes.fetch_add(nBytes, std::memory_order_relaxed) + nBytes;
+        if (IsOverMarks(nQueuedMessages, nQueuedBytes) == false)
+            return true;
+
+        backpressure_policy policy = m_backpressurePolicy;
+        // Only the send crossing a mark tells the server, not every send while the queue is over it
+        if (m_bBackpressure.exchange(true) == false)
+        {
+            // The sender may hold the server's connection table, so the server is told from the strand, before the connection can be deleted there
+            kq::server_interface<T, Q>* server = m_serverPtr;
+            if (server != nullptr)
+                asio::post(m_strand, [server, this]() { server->OnClientBackpressure(this); });
+            if (policy == backpressure_disconnect)
+            {
+                __CountDisconnect(disconnect_backpressure);
+                Disconnect();
+            }
+        }
+
+        switch (policy)
+        {
+        case backpressure_drop_oldest:
+            return true;
+        case backpressure_report:
+            bAccepted = false;
+            return true;
+        default:
+            m_nQueuedMessages.fetch_sub(1, std::memory_order_relaxed);
+            m_nQueuedBytes.fetch_sub(nBytes, std::memory_order_relaxed);
+            m_nDropped.fetch_add(1, std::memory_order_relaxed);
+            bAccepted = false;
+            return false;
+        }
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::DropOldest(size_t nNewestLane)
+    {
+        size_t nMessages = m_nQueuedMessages.load(std::memory_order_relaxed);
+        size_t nBytes = m_nQueuedBytes.load(std::memory_order_relaxed);
+        // Bulk data goes first, control messages are only dropped once no lower lane holds anything
+        for (size_t nLane = priority_count; nLane-- > 0 && IsOverMarks(nMessages, nBytes);)
+        {
+            kq::vector<queued_message<T>>& lane = m_qMessagesOut[nLane];
+            size_t nKeep = nLane == nNewestLane ? 1 : 0;
+            size_t nDrop = 0;
+            while (nDrop + nKeep < lane.size() && IsOverMarks(nMessages, nBytes))
+            {
+                size_t nMessageBytes = wire_header<T>::size(lane[nDrop].body_size()) + lane[nDrop].body_size();
+                --nMessages;
+                nBytes -= nMessageBytes;
+                m_nQueuedMessages.fetch_sub(1, std::memory_order_relaxed);
+                m_nQueuedBytes.fetch_sub(nMessageBytes, std::memory_order_relaxed);
+                ++nDrop;
+            }
+
+            if (nDrop > 0)
+            {
+                lane.erase(lane.begin(), lane.begin() + nDrop);
+                m_nLaneQueued[nLane].fetch_sub(nDrop, std::memory_order_relaxed);
+                m_nDropped.fetch_add(nDrop, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::HasQueuedMessages() const
+    {
+        for (auto& lane : m_qMessagesOut)
+        {
+            if (lane.empty() == false)
+                return true;
+        }
+        return false;
+    }
+
+    template<typename T, typename Q>
+    lane_stats connection<T, Q>::GetLaneStats(message_priority lane) const
+    {
+        lane_stats stats;
+        if (lane >= priority_count)
+            return stats;
+        stats.nQueued = m_nLaneQueued[lane].load(std::memory_order_relaxed);
+        stats.nWritten = m_nLaneWritten[lane].load(std::memory_order_relaxed);
+        stats.nWaitNanoseconds = m_nLaneWaitNanoseconds[lane].load(std::memory_order_relaxed);
+        stats.nMaxWaitNanoseconds = m_nLaneMaxWaitNanoseconds[lane].load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    template<typename T, typename Q>
+    uint64_t connection<T, Q>::SendStream(T id, stream_source source, size_t nChunkSize)
+    {
+        if (!source)
+            return 0;
+        uint64_t nStream = m_nStreamsOpened.fetch_add(1, std::memory_order_relaxed) + 1;
+        m_nActiveStreams.fetch_add(1, std::memory_order_relaxed);
+        asio::post(m_strand, [this, stream = outbound_stream<T>{ id, nStream, 0, nChunkSize > 0 ? nChunkSize : 1, std::move(source) }]() mutable {
+            if (m_socket.is_open() == false)
+            {
+                m_nActiveStreams.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            m_vStreamsOut.push_back(std::move(stream));
+            if (m_bWriting == false)
+            {
+                m_bWriting = true;
+                WriteMessages();
+            }
+            });
+        return nStream;
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::TakeFragments(size_t& nBatchBytes)
+    {
+        size_t nStreams = m_vStreamsOut.size();
+        size_t nTaken = 0;
+        for (; nTaken < nStreams; ++nTaken)
+        {
+            outbound_stream<T>& stream = m_vStreamsOut[(m_nNextStream + nTaken) % nStreams];
+            size_t nMaxBody = nMaxStreamHeaderSize + stream.nChunkSize;
+            if (m_vMessagesWriting.empty() == false && nBatchBytes + wire_header<T>::size(nMaxBody) + nMaxBody > m_nWriteBatchLimit)
+                break;
+
+            // The data is read straight into the pooled body, behind the header whose flags are only known afterwards
+            shared_message<T> fragment = m_pool->make(stream.id, [&](message<T>& msg) {
+                msg.body = m_pool->acquire(nMaxBody);
+                size_t nHeadSize = encode_stream_header(stream.nStream, stream.nOffset, 0, msg.body.data());
+                size_t nData = std::min(stream.source(msg.body.data() + nHeadSize, stream.nChunkSize), stream.nChunkSize);
+                if (nData < stream.nChunkSize)
+                {
+                    msg.body[nHeadSize - 1] = stream_last;
+                    stream.source = nullptr;
+                }
+                msg.body.resize(nHeadSize + nData);
+                stream.nOffset += nData;
+                });
+
+            // Counted like a sent message, so the write's completion takes it out again
+            size_t nFragmentBytes = wire_header<T>::size(fragment->size()) + fragment->size();
+            m_nQueuedMessages.fetch_add(1, std::memory_order_relaxed);
+            m_nQueuedBytes.fetch_add(nFragmentBytes, std::memory_order_relaxed);
+            nBatchBytes += nFragmentBytes;
+            m_vMessagesWriting.push_back(std::move(fragment));
+        }
+
+        // Streams which built their last fragment are done
+        auto itDone = std::remove_if(m_vStreamsOut.begin(), m_vStreamsOut.end(), [](const outbound_stream<T>& stream) { return !stream.source; });
+        size_t nDone = static_cast<size_t>(m_vStreamsOut.end() - itDone);
+        m_vStreamsOut.erase(itDone, m_vStreamsOut.end());
+        m_nActiveStreams.fetch_sub(nDone, std::memory_order_relaxed);
+        m_nNextStream = m_vStreamsOut.empty() ? 0 : (m_nNextStream + nTaken) % m_vStreamsOut.size();
+    }
+
+    template<typename T, typename Q>
+    write_stats connection<T, Q>::GetWriteStats() const
+    {
+        write_stats stats;
+        stats.nWrites = m_nWrites.load(std::memory_order_relaxed);
+        stats.nMessages = m_nMessagesWritten.load(std::memory_order_relaxed);
+        stats.nBytes = m_nBytesWritten.load(std::memory_order_relaxed);
+        stats.nMaxMessagesPerWrite = m_nMaxMessagesPerWrite.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    template<typename T, typename Q>
+    read_stats connection<T, Q>::GetReadStats() const
+    {
+        read_stats stats;
+        stats.nReads = m_nReads.load(std::memory_order_relaxed);
+        stats.nMessages = m_nMessagesRead.load(std::memory_order_relaxed);
+        stats.nBytes = m_nBytesRead.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::SetCompressionThreshold(size_t nBytes)
+    {
+        m_nCompressionThreshold = nBytes;
+        m_nFeaturesOut = nBytes > 0 ? feature_compression : 0;
+    }
+
+    template<typename T, typename Q>
+    compression_stats connection<T, Q>::GetCompressionStats() const
+    {
+        compression_stats stats;
+        stats.nCompressed = m_nCompressed.load(std::memory_order_relaxed);
+        stats.nIncompressible = m_nIncompressible.load(std::memory_order_relaxed);
+        stats.nBytesIn = m_nCompressBytesIn.load(std::memory_order_relaxed);
+        stats.nBytesOut = m_nCompressBytesOut.load(std::memory_order_relaxed);
+        stats.nCompressNanoseconds = m_nCompressNanoseconds.load(std::memory_order_relaxed);
+        stats.nDecompressed = m_nDecompressed.load(std::memory_order_relaxed);
+        stats.nDecompressBytesIn = m_nDecompressBytesIn.load(std::memory_order_relaxed);
+        stats.nDecompressBytesOut = m_nDecompressBytesOut.load(std::memory_order_relaxed);
+        stats.nDecompressNanoseconds = m_nDecompressNanoseconds.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    template<typename T, typename Q>
+    // Prime context to write every queued message (up to the batch limit) with a single gather-write
+    void connection<T, Q>::WriteMessages()
+    {
+        // Move queued messages into the batch, higher lanes first, until the next one would exceed the limit
+        // The first message is always taken, so a message bigger than the limit is still sent
+        // Every write is chosen again from the highest lane, so a control message waits for one batch at most
+        size_t nBatchBytes = 0;
+        bool bFull = false;
+#if KQNET_METRICS
+        uint64_t nNow = metrics_now();
+#endif
+        for (size_t nLane = 0; nLane < priority_count && bFull == false; ++nLane)
+        {
+            kq::vector<queued_message<T>>& lane = m_qMessagesOut[nLane];
+            size_t nTaken = 0;
+            uint64_t nWaitNanoseconds = 0;
+            uint64_t nMaxWaitNanoseconds = 0;
+            while (nTaken < lane.size())
+            {
+                size_t nMessageBytes = wire_header<T>::size(lane[nTaken].body_size()) + lane[nTaken].body_size();
+                if (m_vMessagesWriting.empty() == false && nBatchBytes + nMessageBytes > m_nWriteBatchLimit)
+                {
+                    bFull = true;
+                    break;
+                }
+
+#if KQNET_METRICS
+                uint64_t nWait = nNow - std::min(lane[nTaken].nQueuedAt, nNow);
+                nWaitNanoseconds += nWait;
+                nMaxWaitNanoseconds = std::max(nMaxWaitNanoseconds, nWait);
+                if (m_serverPtr != nullptr)
+                    m_serverPtr->__GetCounters().laneWait[nLane].record(nWait);
+#endif
+                nBatchBytes += nMessageBytes;
+                m_vMessagesWriting.push_back(std::move(lane[nTaken].msg));
+                bool bFile = lane[nTaken].external && lane[nTaken].external->pData == nullptr;
+                m_vWritingExternal.push_back(std::move(lane[nTaken].external));
+                ++nTaken;
+                // A file range can't be part of the gather-write, it is sent on it's own once the batch before it was written
+                if (bFile)
+                {
+                    bFull = true;
+                    break;
+                }
+            }
+
+            if (nTaken == 0)
+                continue;
+            // Clearing keeps the lane's capacity, so a lane written at once allocates nothing
+            if (nTaken == lane.size())
+                lane.clear();
+            else
+                lane.erase(lane.begin(), lane.begin() + nTaken);
+            m_nLaneQueued[nLane].fetch_sub(nTaken, std::memory_order_relaxed);
+            m_nLaneWritten[nLane].fetch_add(nTaken, std::memory_order_relaxed);
+            m_nLaneWaitNanoseconds[nLane].fetch_add(nWaitNanoseconds, std::memory_order_relaxed);
+            if (nMaxWaitNanoseconds > m_nLaneMaxWaitNanoseconds[nLane].load(std::memory_order_relaxed))
+                m_nLaneMaxWaitNanoseconds[nLane].store(nMaxWaitNanoseconds, std::memory_order_relaxed);
+        }
+        // Streams fill what the lanes left of the batch
+        if (bFull == false && m_vStreamsOut.empty() == false)
+            TakeFragments(nBatchBytes);
+        m_nWritingBytes = nBatchBytes;
+
+        // Every message contributes it's encoded head and, if present, it's body to the buffer sequence
+        // Heads are encoded into m_vWriteHeads first, it is not resized again until the write completes, so the buffers stay valid
+        m_vWriteHeads.resize(m_vMessagesWriting.size() * wire_header<T>::nMaxSize);
+        m_vWriteBuffers.clear();
+        for (size_t i = 0; i < m_vMessagesWriting.size(); ++i)
+        {
+            const message<T>& msg = *m_vMessagesWriting[i];
+            uint8_t* pHead = m_vWriteHeads.data() + i * wire_header<T>::nMaxSize;
+            const external_body* pExternal = i < m_vWritingExternal.size() ? m_vWritingExternal[i].get() : nullptr;
+            if (pExternal != nullptr)
+            {
+                // The head goes through the normal framing, the body straight from it's memory (a file range follows after the write)
+                size_t nHeadSize = m_bCompression ? wire_header<T>::encode_flagged(msg.head, false, pHead) : wire_header<T>::encode(msg.head, pHead);
+                m_vWriteBuffers.push_back(asio::buffer(pHead, nHeadSize));
+                if (pExternal->pData != nullptr && pExternal->nSize > 0)
+                    m_vWriteBuffers.push_back(asio::buffer(pExternal->pData, pExternal->nSize));
+                continue;
+            }
+            const kq::vector<uint8_t>* pCompressed = m_bCompression && msg.size() >= m_nCompressionThreshold ? CompressBody(m_vMessagesWriting[i]) : nullptr;
+            if (pCompressed != nullptr)
+            {
+                // The frame carries the compressed body instead, the shared message itself is never changed
+                message_header<T> head(msg.head.id);
+                head.size = pCompressed->size();
+                m_vWriteBuffers.push_back(asio::buffer(pHead, wire_header<T>::encode_flagged(head, true, pHead)));
+                m_vWriteBuffers.push_back(asio::buffer(pCompressed->data(), pCompressed->size()));
+                continue;
+            }
+
+            size_t nHeadSize = m_bCompression ? wire_header<T>::encode_flagged(msg.head, false, pHead) : wire_header<T>::encode(msg.head, pHead);
+            m_vWriteBuffers.push_back(asio::buffer(pHead, nHeadSize));
+            if (msg.size() > 0)
+                m_vWriteBuffers.push_back(asio::buffer(msg.body.data(), msg.size()));
+        }
+
+        asio::async_write(m_socket, const_buffer_view{ m_vWriteBuffers.data(), m_vWriteBuffers.data() + m_vWriteBuffers.size() },
+            asio::bind_executor(m_strand, make_pooled_handler(m_pool, [this](asio::error_code ec, size_t length) {
+                if (!ec)
+                {
+                    const external_body* pLast = m_vWritingExternal.empty() ? nullptr : m_vWritingExternal.back().get();
+                    if (pLast != nullptr && pLast->pData == nullptr)
+                    {
+                        m_nFileSent = 0;
+                        return WriteFileBody(length);
+                    }
+                    FinishWrite(length);
+                }
+                else
+                {
+                    //There was a problem in sending the messages
+                    std::cout << '[' << m_id << ']' << "WriteMessages() ERROR: " << ec.message() << '\n';
+                    CloseAfterError(true, disconnect_write_error);
+                }
+            })));
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::FinishWrite(size_t nWritten)
+    {
+        // The whole batch was sent with no problem
+        uint64_t nMessages = m_vMessagesWriting.size();
+        m_nWrites.fetch_add(1, std::memory_order_relaxed);
+        m_nMessagesWritten.fetch_add(nMessages, std::memory_order_relaxed);
+        m_nBytesWritten.fetch_add(nWritten, std::memory_order_relaxed);
+        if (nMessages > m_nMaxMessagesPerWrite.load(std::memory_order_relaxed))
+            m_nMaxMessagesPerWrite.store(nMessages, std::memory_order_relaxed);
+
+#if KQNET_METRICS
+        if (m_serverPtr != nullptr)
+        {
+            server_counters& counters = m_serverPtr->__GetCounters();
+            for (auto& msg : m_vMessagesWriting)
+                counters.messagesOutById[server_counters::id_index(msg->head.id)].fetch_add(1, std::memory_order_relaxed);
+        }
+#endif
+
+        // Releasing our references frees every message no other connection is still writing
+        // Messages shared through the pool give their body back to it when freed
+        m_vMessagesWriting.clear();
+        m_vWritingExternal.clear();
+        size_t nQueuedMessages = m_nQueuedMessages.fetch_sub(nMessages, std::memory_order_relaxed) - nMessages;
+        size_t nQueuedBytes = m_nQueuedBytes.fetch_sub(m_nWritingBytes, std::memory_order_relaxed) - m_nWritingBytes;
+        if (m_bBackpressure && IsOverMarks(nQueuedMessages * 2, nQueuedBytes * 2) == false)
+            m_bBackpressure = false;
+        for (auto& body : m_vWriteCompressed)
+            m_pool->release(std::move(body));
+        m_vWriteCompressed.clear();
+
+        // Messages queued while we were writing make up the next batch, or the next fragments of the streams
+        if (HasQueuedMessages() || m_vStreamsOut.empty() == false)
+        {
+            WriteMessages();
+        }
+        else
+        {
+            m_bWriting = false;
+        }
+#if KQNET_COROUTINES
+        ResumeSender();
+#endif
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::WriteFileBody(size_t nWritten)
+    {
+        const external_body& body = *m_vWritingExternal.back();
+        while (m_nFileSent < body.nSize)
+        {
+#if defined(__linux__)
+            // The kernel copies from the page cache to the socket, the socket is non-blocking so it sends what fits and we wait for room
+            asio::error_code ecMode;
+            m_socket.native_non_blocking(true, ecMode);
+            off_t nOffset = static_cast<off_t>(body.nOffset + m_nFileSent);
+            ssize_t nSent = ::sendfile(m_socket.native_handle(), body.fd, &nOffset, body.nSize - m_nFileSent);
+            if (nSent > 0)
+            {
+                m_nFileSent += static_cast<size_t>(nSent);
+                continue;
+            }
+            if (nSent < 0 && errno == EINTR)
+                continue;
+            if (nSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                m_socket.async_wait(asio::ip::tcp::socket::wait_write,
+                    asio::bind_executor(m_strand, make_pooled_handler(m_pool, [this, nWritten](asio::error_code ec) {
+                        if (!ec)
+                            return WriteFileBody(nWritten);
+                        std::cout << '[' << m_id << ']' << "WriteFileBody() ERROR: " << ec.message() << '\n';
+                        CloseAfterError(true, disconnect_write_error);
+                    })));
+                return;
+            }
+            std::cout << '[' << m_id << ']' << "WriteFileBody() ERROR: " << (nSent == 0 ? "the file ended before the range" : std::strerror(errno)) << '\n';
+            return CloseAfterError(true, disconnect_write_error);
+#else
+            // Without sendfile the range is read into a pooled buffer and written a chunk at a time
+            if (m_vFileChunk.empty())
+                m_vFileChunk = m_pool->acquire(nReadBufferSize);
+            int64_t nRead = read_file_range(body.fd, body.nOffset + m_nFileSent, m_vFileChunk.data(), std::min(m_vFileChunk.size(), body.nSize - m_nFileSent));
+            if (nRead <= 0)
+            {
+                std::cout << '[' << m_id << ']' << "WriteFileBody() ERROR: " << (nRead == 0 ? "the file ended before the range" : "reading the file failed") << '\n';
+                return CloseAfterError(true, disconnect_write_error);
+            }
+            asio::async_write(m_socket, asio::buffer(m_vFileChunk.data(), static_cast<size_t>(nRead)),
+                asio::bind_executor(m_strand, make_pooled_handler(m_pool, [this, nWritten](asio::error_code ec, size_t length) {
+                    if (!ec)
+                    {
+                        m_nFileSent += length;
+                        return WriteFileBody(nWritten);
+                    }
+                    std::cout << '[' << m_id << ']' << "WriteFileBody() ERROR: " << ec.message() << '\n';
+                    CloseAfterError(true, disconnect_write_error);
+                })));
+            return;
+#endif
+        }
+
+        if (m_vFileChunk.empty() == false)
+            m_pool->release(std::move(m_vFileChunk));
+        m_vFileChunk.clear();
+        FinishWrite(nWritten + body.nSize);
+    }
+
+    template<typename T, typename Q>
+    // Prime context to read as many bytes as the socket has into the receive buffer
+    void connection<T, Q>::ReadMessages()
+    {
+        // The buffer is only allocated once the connection is validated and starts reading messages
+        if (m_vReadBuffer.empty())
+            m_vReadBuffer.resize(nReadBufferSize);
+
+        // Move the incomplete message left at the end of the buffer to it's start, to make room for the rest of it
+        if (m_nReadStart > 0)
+        {
+            std::memmove(m_vReadBuffer.data(), m_vReadBuffer.data() + m_nReadStart, m_nReadEnd - m_nReadStart);
+            m_nReadEnd -= m_nReadStart;
+            m_nReadStart = 0;
+        }
+
+        m_socket.async_read_some(asio::buffer(m_vReadBuffer.data() + m_nReadEnd, m_vReadBuffer.size() - m_nReadEnd),
+            asio::bind_executor(m_strand, make_pooled_handler(m_pool, [this](asio::error_code ec, size_t length) {
+                if (!ec)
+                {
+                    m_nReads.fetch_add(1, std::memory_order_relaxed);
+                    m_nBytesRead.fetch_add(length, std::memory_order_relaxed);
+                    m_nReadEnd += length;
+
+                    // Deliver every message we have in full, then read again unless a big body is being read on it's own
+                    if (ParseMessages())
+                        ReadMessages();
+                }
+                else
+                {
+                    // There was a problem in reading from the socket
+                    std::cout << '[' << m_id << ']' << "ReadMessages() ERROR: " << ec.message() << '\n';
+                    return CloseAfterError(false, ReadErrorReason(ec));
+                }
+            })));
+    }
+
+    template<typename T, typename Q>
+    // Delivers every complete message of the receive buffer
+    bool connection<T, Q>::ParseMessages()
+    {
+        while (m_nReadStart < m_nReadEnd)
+        {
+            const uint8_t* pFrame = m_vReadBuffer.data() + m_nReadStart;
+            size_t nHeadSize = m_bCompression ? wire_header<T>::decode_flagged(pFrame, m_nReadEnd - m_nReadStart, m_msgTemporaryIn.head, m_bCompressedIn)
+                : wire_header<T>::decode(pFrame, m_nReadEnd - m_nReadStart, m_msgTemporaryIn.head);
+            if (nHeadSize == 0)
+            {
+                // The rest of the head is yet to arrive
+                break;
+            }
+            if (nHeadSize == size_t(-1))
+            {
+                // The remote doesn't speak our protocol, nothing after this point can be trusted
+                std::cout << '[' << m_id << ']' << "ParseMessages() ERROR: malformed message head\n";
+                CloseAfterError(false, disconnect_malformed);
+                return false;
+            }
+
+            size_t nBodySize = m_msgTemporaryIn.head.size;
+            size_t nAvailable = m_nReadEnd - m_nReadStart - nHeadSize;
+            if (m_nMaxFrameSize > 0 && nBodySize > m_nMaxFrameSize)
+            {
+                // Refused before anything is allocated for it, the size alone could make us run out of memory
+                std::cout << '[' << m_id << ']' << "ParseMessages() ERROR: frame of " << nBodySize << " bytes over the limit\n";
+                CloseAfterError(false, disconnect_oversized);
+                return false;
+            }
+
+            if (nAvailable >= nBodySize)
+            {
+                // The whole message is in the buffer
+                if (m_bCompressedIn)
+                {
+                    // Expanded straight out of the buffer into a pooled body
+                    if (DecompressBody(pFrame + nHeadSize, nBodySize) == false)
+                    {
+                        std::cout << '[' << m_id << ']' << "ParseMessages() ERROR: malformed compressed body\n";
+                        CloseAfterError(false, disconnect_malformed);
+                        return false;
+                    }
+                }
+                else if (nBodySize > 0)
+                {
+                    m_msgTemporaryIn.body = m_pool->acquire(nBodySize);
+                    std::memcpy(m_msgTemporaryIn.body.data(), pFrame + nHeadSize, nBodySize);
+                }
+                else
+                {
+                    // Drop the body left over from the previous message, otherwise it would be delivered (and echoed) with this one
+                    m_msgTemporaryIn.body.clear();
+                }
+                m_nReadStart += nHeadSize + nBodySize;
+                if (AddToIncomingQueue() == false)
+                {
+                    WaitForIncomingRoom();
+                    return false;
+                }
+            }
+            else if (nBodySize > nDirectReadSize || nBodySize > m_vReadBuffer.size() - nHeadSize)
+            {
+                // A big body is read straight into the message instead of passing through the buffer, only the bytes we already have are copied
+                m_msgTemporaryIn.body = m_pool->acquire(nBodySize);
+                std::memcpy(m_msgTemporaryIn.body.data(), pFrame + nHeadSize, nAvailable);
+                m_nReadStart = 0;
+                m_nReadEnd = 0;
+                ReadBody(nAvailable);
+                return false;
+            }
+            else
+            {
+                // The rest of the message is yet to arrive
+                break;
+            }
+        }
+
+        if (m_nReadStart == m_nReadEnd)
+        {
+            m_nReadStart = 0;
+            m_nReadEnd = 0;
+        }
+        return true;
+    }
+
+    template<typename T, typename Q>
+    // Prime context to read the rest of a big body straight into the message
+    void connection<T, Q>::ReadBody(size_t nOffset)
+    {
+        asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data() + nOffset, m_msgTemporaryIn.body.size() - nOffset),
+            asio::bind_executor(m_strand, make_pooled_handler(m_pool, [this](asio::error_code ec, size_t length) {
+                if (!ec)
+                {
+                    // We read a message body successfully
+                    m_nReads.fetch_add(1, std::memory_order_relaxed);
+                    m_nBytesRead.fetch_add(length, std::memory_order_relaxed);
+
+                    if (m_bCompressedIn)
+                    {
+                        // The compressed bytes were read into the body, they are expanded into a body of their own
+                        kq::vector<uint8_t> compressed = std::move(m_msgTemporaryIn.body);
+                        bool bValid = DecompressBody(compressed.data(), compressed.size());
+                        m_pool->release(std::move(compressed));
+                        if (bValid == false)
+                        {
+                            std::cout << '[' << m_id << ']' << "ReadBody() ERROR: malformed compressed body\n";
+                            CloseAfterError(false, disconnect_malformed);
+                            return;
+                        }
+                    }
+                    if (AddToIncomingQueue() == false)
+                        return WaitForIncomingRoom();
+
+                    // Go back to reading through the buffer
+                    ReadMessages();
+                }
+                else
+                {
+                    std::cout << '[' << m_id << ']' << "ReadBody() ERROR: " << ec.message() << '\n';
+                    return CloseAfterError(false, ReadErrorReason(ec));
+                }
+            })));
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::AddToIncomingQueue()
+    {
+        m_nMessagesRead.fetch_add(1, std::memory_order_relaxed);
+#if KQNET_METRICS
+        if (m_serverPtr != nullptr)
+            m_serverPtr->__GetCounters().messagesInById[server_counters::id_index(m_msgTemporaryIn.head.id)].fetch_add(1, std::memory_order_relaxed);
+#endif
+
+        // An inline handler answers right here on the strand, the message never waits in a queue
+        const typename dispatch_table<T, Q>::entry* entry = m_pDispatch != nullptr ? m_pDispatch->find_inline(m_msgTemporaryIn.head.id) : nullptr;
+        if (entry != nullptr)
+        {
+#if KQNET_METRICS
+            uint64_t nStart = metrics_now();
+            entry->handler(this, m_msgTemporaryIn);
+            if (m_serverPtr != nullptr)
+                m_serverPtr->__GetCounters().handlerDuration.record(metrics_now() - nStart);
+#else
+            entry->handler(this, m_msgTemporaryIn);
+#endif
+            // Whatever body the handler left in the message goes back to the pool
+            m_pool->recycle(m_msgTemporaryIn);
+            return true;
+        }
+
+#if KQNET_COROUTINES
+        if (m_bReceiveAwaited)
+        {
+            DeliverToReceiver();
+            return true;
+        }
+#endif
+        return PushIncoming();
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::PushIncoming()
+    {
+        owned_message<T, Q> item;
+        if (m_ownerType == owner::server)
+        {
+            item.remote = this;
+#if KQNET_METRICS
+            item.nQueuedAt = metrics_now();
+#endif
+        }
+        else
+        {
+            // A client doesnt need to know "who" sent the message, it is always the server.
+            // Unless many connections share the queue of a multi_client_interface
+            item.remote = m_clientsPtr != nullptr ? this : nullptr;
+        }
+        item.msg = std::move(m_msgTemporaryIn);
+
+        // A bounded queue leaves the item untouched if it's full, the message is taken back to be retried
+        if (m_qMessagesIn.try_push_back(std::move(item)))
+            return true;
+        m_msgTemporaryIn = std::move(item.msg);
+        return false;
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::WaitForIncomingRoom()
+    {
+        m_timerIncoming.expires_after(std::chrono::milliseconds(1));
+        m_timerIncoming.async_wait(asio::bind_executor(m_strand, make_pooled_handler(m_pool, [this](const asio::error_code&) {
+            // No read is pending meanwhile, so a connection closed in between is closed from here
+            if (m_socket.is_open() == false)
+                return CloseAfterError(false, disconnect_read_error);
+            if (PushIncoming() == false)
+                return WaitForIncomingRoom();
+            if (ParseMessages())
+                ReadMessages();
+            })));
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::__CountDisconnect(disconnect_reason reason)
+    {
+#if KQNET_METRICS
+        if (m_serverPtr != nullptr && m_bDisconnectCounted.exchange(true) == false)
+            m_serverPtr->__GetCounters().disconnects[reason].fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::CloseAfterError(bool bWrite, disconnect_reason reason)
+    {
+        m_socket.close();
+        __CountDisconnect(reason);
+#if KQNET_COROUTINES
+        CloseAwaiters();
+#endif
+        // Nothing will be written anymore, the sources may hold files open
+        m_nActiveStreams.fetch_sub(m_vStreamsOut.size(), std::memory_order_relaxed);
+        m_vStreamsOut.clear();
+
+        // Closing the socket makes the pending read or write fail too, deleting the connection now would leave it's handler dangling
+        bool bOtherPending;
+        if (bWrite)
+        {
+            // The write is over, so the external bodies it was sending can be let go of
+            m_vWritingExternal.clear();
+            m_bWriting = false;
+            bOtherPending = m_bReadFailed == false;
+        }
+        else
+        {
+            m_bReadFailed = true;
+            bOtherPending = m_bWriting;
+        }
+
+        if (bOtherPending == false && m_serverPtr != nullptr)
+            ReleaseToServer(true);
+        else if (bOtherPending == false)
+            ReleaseToClients();
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ReleaseToClients()
+    {
+        // Deleted from the strand, after every handler posted before it, e.g. a Disconnect which raced with the error
+        if (m_clientsPtr != nullptr && m_clientsPtr->__RemoveConnection(this))
+            asio::post(m_strand, [this]() { delete this; });
+        else if (m_clientsPtr == nullptr && m_releaseHandler)
+        {
+            std::function<void()> handler = std::move(m_releaseHandler);
+            m_releaseHandler = nullptr;
+            handler();
+        }
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ReleaseToServer(bool bValidated)
+    {
+        // Same as ReleaseToClients, a Send or Disconnect may have posted to the strand before the connection left the table
+        kq::server_interface<T, Q>* server = m_serverPtr;
+        bool bRemoved = bValidated ? server->__RemoveClient(this) : server->__RemoveUnvalidatedClient(this);
+        if (bRemoved)
+            asio::post(m_strand, [server, this]() { server->__DeleteClient(this); });
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ReportConnect(connect_result result)
+    {
+        if (m_connectHandler)
+        {
+            std::function<void(connect_result)> handler = std::move(m_connectHandler);
+            m_connectHandler = nullptr;
+            handler(result);
+        }
+#if KQNET_COROUTINES
+        if (result != connect_success)
+            CloseAwaiters();
+#endif
+    }
+
+#if KQNET_COROUTINES
+    template<typename T, typename Q>
+    bool connection<T, Q>::__AwaitReceive(receive_awaiter<T, Q>* receiver)
+    {
+        // Returns true if the receiver has to wait
+        auto wait = [this, receiver]() {
+            m_bReceiveAwaited = true;
+            if (m_qReceived.empty() == false)
+            {
+                receiver->msg = std::move(m_qReceived.front());
+                m_qReceived.pop_front();
+                return false;
+            }
+            if (m_bAwaitClosed)
+                return false;
+            m_pReceiver = receiver;
+            return true;
+        };
+
+        // A coroutine resumed by the strand receives again without another trip through the context
+        if (m_strand.running_in_this_thread() || m_bAwaitClosed)
+            return wait();
+
+        asio::post(m_strand, [receiver, wait]() {
+            if (wait() == false)
+                receiver->handle.resume();
+            });
+        return true;
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::__AwaitSend(send_awaiter<T, Q>* sender)
+    {
+        // m_bBackpressure is only cleared on the strand, so it is checked again there before waiting
+        auto wait = [this, sender]() {
+            if (m_bAwaitClosed)
+                return false;
+            if (m_bBackpressure == false)
+            {
+                sender->bSent = Send(std::move(sender->msg));
+                return false;
+            }
+            m_pSender = sender;
+            return true;
+        };
+
+        if (m_strand.running_in_this_thread() || m_bAwaitClosed)
+            return wait();
+
+        asio::post(m_strand, [sender, wait]() {
+            if (wait() == false)
+                sender->handle.resume();
+            });
+        return true;
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::DeliverToReceiver()
+    {
+        if (m_pReceiver == nullptr)
+            return m_qReceived.push_back(std::move(m_msgTemporaryIn));
+
+        // The coroutine runs right here until it suspends again, usually at it's next receive
+        receive_awaiter<T, Q>* receiver = m_pReceiver;
+        m_pReceiver = nullptr;
+        receiver->msg = std::move(m_msgTemporaryIn);
+        receiver->handle.resume();
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ResumeSender()
+    {
+        if (m_pSender == nullptr || m_bBackpressure)
+            return;
+
+        send_awaiter<T, Q>* sender = m_pSender;
+        m_pSender = nullptr;
+        sender->bSent = Send(std::move(sender->msg));
+        sender->handle.resume();
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::CloseAwaiters()
+    {
+        m_bAwaitClosed = true;
+        if (m_pSender != nullptr)
+        {
+            send_awaiter<T, Q>* sender = m_pSender;
+            m_pSender = nullptr;
+            sender->bSent = false;
+            sender->handle.resume();
+        }
+        if (m_pReceiver != nullptr)
+        {
+            receive_awaiter<T, Q>* receiver = m_pReceiver;
+            m_pReceiver = nullptr;
+            receiver->handle.resume();
+        }
+    }
+#endif
+
+    template<typename T, typename Q>
+    const kq::vector<uint8_t>* connection<T, Q>::CompressBody(const shared_message<T>& msg)
+    {
+        // The compressed body of a pooled message lives as long as the message, m_vMessagesWriting holds it until written
+        const kq::vector<uint8_t>* pBody = nullptr;
+        pooled_message_deleter<T>* pDeleter = std::get_deleter<pooled_message_deleter<T>>(msg);
+        if (pDeleter != nullptr)
+        {
+            compressed_body& compressed = pDeleter->compressed();
+            std::call_once(compressed.once, [&]() { CompressInto(*msg, compressed.body); });
+            pBody = &compressed.body;
+        }
+        else
+        {
+            kq::vector<uint8_t> body;
+            if (CompressInto(*msg, body))
+            {
+                m_vWriteCompressed.push_back(std::move(body));
+                pBody = &m_vWriteCompressed.back();
+            }
+        }
+
+        if (pBody == nullptr || pBody->empty())
+        {
+            m_nIncompressible.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        m_nCompressed.fetch_add(1, std::memory_order_relaxed);
+        m_nCompressBytesIn.fetch_add(msg->size(), std::memory_order_relaxed);
+        m_nCompressBytesOut.fetch_add(pBody->size(), std::memory_order_relaxed);
+        return pBody;
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::CompressInto(const message<T>& msg, kq::vector<uint8_t>& body)
+    {
+        // The compressed body starts with the original size, so the remote can take a body of the right size from the pool
+        // Whatever doesn't come out smaller than the raw body is sent raw
+        size_t nPrefix = varint_size(msg.size());
+        if (msg.size() < nPrefix + 2)
+            return false;
+
+        auto start = std::chrono::steady_clock::now();
+        body = m_pool->acquire(msg.size());
+        encode_varint(msg.size(), body.data());
+        size_t nBlock = lz_codec::compress(msg.body.data(), msg.size(), body.data() + nPrefix, msg.size() - nPrefix - 1);
+        m_nCompressNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+
+        if (nBlock == 0)
+        {
+            m_pool->release(std::move(body));
+            body = kq::vector<uint8_t>();
+            return false;
+        }
+
+        // Shrinking keeps the capacity, the body goes back to the class it came from
+        body.resize(nPrefix + nBlock);
+        return true;
+    }
+
+    template<typename T, typename Q>
+    bool connection<T, Q>::DecompressBody(const uint8_t* pIn, size_t nSize)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        uint64_t nOriginal = 0;
+        size_t nPrefix = decode_varint(pIn, nSize, nOriginal);
+        // A block expands at most 255 times, a bigger size is a lie and must not make us allocate it
+        if (nPrefix == 0 || nPrefix == size_t(-1) || nOriginal > static_cast<uint64_t>(nSize - nPrefix) * 256)
+            return false;
+        if (m_nMaxFrameSize > 0 && nOriginal > m_nMaxFrameSize)
+            return false;
+
+        m_msgTemporaryIn.body = m_pool->acquire(static_cast<size_t>(nOriginal));
+        if (lz_codec::decompress(pIn + nPrefix, nSize - nPrefix, m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()) != nOriginal)
+            return false;
+        m_msgTemporaryIn.head.size = static_cast<size_t>(nOriginal);
+
+        m_nDecompressNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+        m_nDecompressed.fetch_add(1, std::memory_order_relaxed);
+        m_nDecompressBytesIn.fetch_add(nSize, std::memory_order_relaxed);
+        m_nDecompressBytesOut.fetch_add(nOriginal, std::memory_order_relaxed);
+        return true;
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::WriteValidation()
+    {
+        // The client follows it's answer with the features it offers, the server sends the number alone
+        std::array<asio::const_buffer, 2> buffers = { { asio::buffer(&m_ValidateNumberOut, sizeof(uint64_t)),
+            asio::buffer(&m_nFeaturesOut, m_ownerType == owner::client ? sizeof(uint8_t) : 0) } };
+
+        asio::async_write(m_socket, buffers,
+            asio::bind_executor(m_strand, [this](asio::error_code ec, size_t length) {
+                if (!ec) {
+                    //std::cout << "Wrote Validation number\n";
+                    if (m_ownerType == owner::client)
+                    {
+
+                        // Was: m_bValidated = true; 
+                        // Old system used this boolean to confirm validation status, now a message is sent by the server to confirm validation
+                        ReadValidationSuccess();
+                    }
+                }
+                else
+                {
+                    std::cout << '[' << m_id << ']' << "WriteValidation() ERROR: " << ec.message() << '\n';
+                    m_socket.close();
+                    if (m_serverPtr != nullptr)
+                        return ReleaseToServer(false);
+                    ReportConnect(connect_validation_failed);
+                    ReleaseToClients();
+                }
+            }));
+    }
+
+    
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ReadValidation()
+    {
+        // The server also reads the features the client offers
+        std::array<asio::mutable_buffer, 2> buffers = { { asio::buffer(&m_ValidateNumberIn, sizeof(uint64_t)),
+            asio::buffer(&m_nFeaturesIn, m_ownerType == owner::server ? sizeof(uint8_t) : 0) } };
+
+        asio::async_read(m_socket, buffers,
+            asio::bind_executor(m_strand, [this](asio::error_code ec, size_t length) {
+                if (!ec)
+                {
+                    //std::cout << "Read Validation number\n";
+                    if (m_ownerType == owner::client)
+                    {
+                        // If a client reads a validation, perform the certain function on it and send it back to the server for validation
+                        m_ValidateNumberOut = m_scrambleFunc(m_ValidateNumberIn);
+                        WriteValidation();
+                    }
+                    else
+                    {
+                        // If a server reads a validation, it means the client send it's validation and we check it's validity
+                        if (m_ValidateNumberIn == m_ValidateNumberCheck)
+                        {
+                            // The features both sides offered are agreed on, and sent back with the confirmation
+                            m_nFeaturesOut &= m_nFeaturesIn;
+                            m_bCompression = (m_nFeaturesOut & feature_compression) != 0;
+
+                            // Send a message to the client, informing it that it has been successfully validated;
+                            WriteValidationSuccess();
+                            if (m_serverPtr != nullptr)
+                            {
+#if KQNET_METRICS
+                                m_serverPtr->__GetCounters().nValidated.fetch_add(1, std::memory_order_relaxed);
+#endif
+                                m_serverPtr->OnClientValidated(this);
+                            }
+
+                        }
+                        else
+                        {
+                            m_socket.close();
+                            if (m_serverPtr != nullptr)
+                                return ReleaseToServer(false);
+                        }
+                    }
+                }
+                else
+                {
+                    std::cout << '[' << m_id << ']' << "ReadValidation() ERROR: " << ec.message() << '\n';
+                    m_socket.close();
+                    if (m_serverPtr != nullptr)
+                        return ReleaseToServer(false);
+                    ReportConnect(connect_validation_failed);
+                    ReleaseToClients();
+                }
+            }));
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::WriteValidationSuccess()
+    {
+        // Send the validation confirmation to the client
+        m_bValidationSuccess = true;
+        m_bValidated = true;
+        std::array<asio::const_buffer, 2> buffers = { { asio::buffer(&m_bValidationSuccess, sizeof(bool)), asio::buffer(&m_nFeaturesOut, sizeof(uint8_t)) } };
+        asio::async_write(m_socket, buffers,
+            asio::bind_executor(m_strand, [this](asio::error_code ec, size_t length) {
+                if (!ec)
+                {
+                    //std::cout << "Wrote ValidationSuccess\n";
+                    if (m_ownerType == owner::server)
+                        ReadMessages();
+                }
+                else
+                {
+                    std::cout << '[' << m_id << ']' << "WriteValidationSuccess() ERROR: " << ec.message() << '\n';
+                    m_socket.close();
+                }
+            }));
+    }
+
+    template<typename T, typename Q>
+    void connection<T, Q>::ReadValidationSuccess()
+    {
+        // The confirmation is followed by the features the server agreed on
+        std::array<asio::mutable_buffer, 2> buffers = { { asio::buffer(&m_bValidationSuccess, sizeof(bool)), asio::buffer(&m_nFeaturesIn, sizeof(uint8_t)) } };
+        asio::async_read(m_socket, buffers,
+            asio::bind_executor(m_strand, [this](asio::error_code ec, size_t length) {
+                if (!ec)
+                {
+                    //std::cout << "Read ValidationSuccess\n";
+                    if (m_ownerType == owner::client)
+                    {
+                        //std::cout << "Read " << length << " bytes\n";
+                        // if the client succesfully got this message, we know it's validation it's confirmed
+                        // if the client was denied by the server, the connection is closed by the server without sending a message to the client
+
+                        // if the client is validated, the servers sends out a bool with the value true, which is read in m_bValidationSuccess
+                        // It is set before m_bValidated, so nothing is sent before we know how to frame it
+                        m_bCompression = (m_nFeaturesIn & m_nFeaturesOut & feature_compression) != 0;
+                        m_bValidated = m_bValidationSuccess;
+                        ReportConnect(m_bValidated ? connect_success : connect_validation_failed);
+
+                        ReadMessages();
+                    }
+                }
+                else
+                {
+                    std::cout << '[' << m_id << ']' << "ReadValidationSuccess() ERROR: " << ec.message() << '\n';
+                    m_socket.close();
+                    ReportConnect(connect_validation_failed);
+                    ReleaseToClients();
+                }
+            }));
+
+    }
+
+} // namespace kq
+
 #endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+#ifndef kqcoro_
+#define kqcoro_
+
+#include "common.h"
+#include "message.h"
+
+#if KQNET_COROUTINES
+
+namespace kq
+{
+    // Return type of a coroutine which is started and forgotten, e.g. one serving a client from OnClientValidated
+    // It runs on the calling thread until it's first suspension and frees itself once it returns
+    struct task
+    {
+        struct promise_type
+        {
+            task get_return_object() noexcept { return task(); }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    // co_await connection<T>::receive(), resumes with the next message, or with nothing once the connection closed
+    template<typename T, typename Q>
+    struct receive_awaiter
+    {
+        explicit receive_awaiter(connection<T, Q>* remote) : conn(remote), msg(), handle() {}
+
+        bool await_ready() const noexcept { return conn == nullptr; }
+        bool await_suspend(std::coroutine_handle<> h) { handle = h; return conn->__AwaitReceive(this); }
+        std::optional<message<T>> await_resume() { return std::move(msg); }
+
+        connection<T, Q>* conn;
+        std::optional<message<T>> msg;
+        std::coroutine_handle<> handle;
+    };
+
+    // co_await connection<T>::send(msg), resumes with what Send returned once the message is queued
+    // It only suspends while the outbound queue is backpressured, until it drained to half of it's marks (see connection::SetBackpressure)
+    template<typename T, typename Q>
+    struct send_awaiter
+    {
+        send_awaiter(connection<T, Q>* remote, shared_message<T> shared) : conn(remote), msg(std::move(shared)), bSent(false), handle() {}
+
+        bool await_ready()
+        {
+            // Without backpressure it is a plain Send, the coroutine goes on without suspending
+            if (conn == nullptr || conn->IsBackpressured() == false)
+            {
+                bSent = conn != nullptr && conn->Send(std::move(msg));
+                return true;
+            }
+            return false;
+        }
+        bool await_suspend(std::coroutine_handle<> h) { handle = h; return conn->__AwaitSend(this); }
+        bool await_resume() const noexcept { return bSent; }
+
+        connection<T, Q>* conn;
+        shared_message<T> msg;
+        bool bSent;
+        std::coroutine_handle<> handle;
+    };
+
+    // co_await client_interface<T>::connect(host, port), resumes with the connect_result once connecting ended
+    template<typename T, typename Q>
+    struct connect_awaiter
+    {
+        connect_awaiter(client_interface<T, Q>& owner, const std::string& address, uint16_t nPort, std::chrono::milliseconds wait)
+            : client(owner), host(address), port(nPort), timeout(wait), result(connect_pending), bDone(false), handle() {}
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            client.ConnectAsync(host, port, [this](connect_result r) {
+                result = r;
+                // Whichever comes second of the callback and await_suspend resumes
+                if (bDone.exchange(true))
+                    handle.resume();
+                }, timeout);
+            // The callback already ran if it failed at once, e.g. resolving
+            return bDone.exchange(true) == false;
+        }
+        connect_result await_resume() const noexcept { return result; }
+
+        client_interface<T, Q>& client;
+        std::string host;
+        uint16_t port;
+        std::chrono::milliseconds timeout;
+        connect_result result;
+        std::atomic<bool> bDone;
+        std::coroutine_handle<> handle;
+    };
+
+} // namespace kq
+
+#endif // KQNET_COROUTINES
+
+#endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef kqdispatch_
+#define kqdispatch_
+
+#include "common.h"
+#include "message.h"
+
+namespace kq
+{
+    // Where a handler of a dispatch_table runs
+    enum dispatch_mode : uint8_t
+    {
+        dispatch_queued, // Through the incoming queue, from Update on the thread calling it, like OnMessage
+        dispatch_inline // On the context thread which read the message, right after it was read, the incoming queue is skipped
+    };
+
+    // Message handlers per ID, found by indexing an array with the ID instead of switching on it
+    // IDs from nIds up can't have a handler, their messages take the default path (OnMessage or Incoming)
+    // The table is only read while connections run, so handlers must be set before them
+    template<typename T, typename Q>
+    struct dispatch_table
+    {
+    public:
+        typedef std::function<void(connection<T, Q>*, message<T>&)> handler_type;
+
+        struct entry
+        {
+            handler_type handler;
+            dispatch_mode mode = dispatch_queued;
+        };
+
+        static const size_t nIds = 256;
+
+        // Returns false if id is nIds or above, an empty handler removes the one set before
+        bool set(T id, dispatch_mode mode, handler_type handler)
+        {
+            uint64_t nId = static_cast<uint64_t>(id);
+            if (nId >= nIds)
+                return false;
+            m_entries[nId].handler = std::move(handler);
+            m_entries[nId].mode = mode;
+            return true;
+        }
+
+        // The entry with a handler for id, or nullptr
+        const entry* find(T id) const
+        {
+            uint64_t nId = static_cast<uint64_t>(id);
+            if (nId >= nIds || !m_entries[nId].handler)
+                return nullptr;
+            return &m_entries[nId];
+        }
+
+        // Finds an inline handler for id, so a connection can check it with a single lookup
+        const entry* find_inline(T id) const
+        {
+            const entry* found = find(id);
+            return found != nullptr && found->mode == dispatch_inline ? found : nullptr;
+        }
+
+    private:
+        std::array<entry, nIds> m_entries;
+    };
+
+} // namespace kq
+
+#endif
\ No newline at end of file
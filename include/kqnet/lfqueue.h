@@ -0,0 +1,450 @@
+#ifndef kqlfqueue_
+#define kqlfqueue_
+
+#include "common.h"
+#include "tsqueue.h"
+
+namespace kq
+{
+	// Padding placed between indices written by different threads, so they never share a cache line
+	static const size_t nCacheLineSize = 64;
+
+	// Lets the consumer of a lock-free queue sleep while the queue is empty, or a producer while it's full
+	// The other side only touches the mutex when somebody is actually sleeping
+	class lfqueue_waiter
+	{
+	public:
+		template<typename Ready>
+		void wait(Ready ready)
+		{
+			if (ready())
+				return;
+
+			std::unique_lock<std::mutex> lock(muxWaiting);
+			nWaiting.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			cvBlocking.wait(lock, ready);
+			nWaiting.fetch_sub(1);
+		}
+
+		template<typename Rep, typename Period, typename Ready>
+		bool wait_for(const std::chrono::duration<Rep, Period>& timeout, Ready ready)
+		{
+			if (ready())
+				return true;
+
+			std::unique_lock<std::mutex> lock(muxWaiting);
+			nWaiting.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			bool bReady = cvBlocking.wait_for(lock, timeout, ready);
+			nWaiting.fetch_sub(1);
+			return bReady;
+		}
+
+		// Called by the other side after publishing an item, or freeing a slot
+		void notify()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (nWaiting.load() > 0)
+			{
+				// Taking the mutex makes sure the consumer is either sleeping or yet to check the queue
+				{ std::unique_lock<std::mutex> lock(muxWaiting); }
+				cvBlocking.notify_all();
+			}
+		}
+
+	private:
+		std::mutex muxWaiting;
+		std::condition_variable cvBlocking;
+		std::atomic<size_t> nWaiting{ 0 };
+	};
+
+	// Bounded single producer, single consumer queue over a ring of N items, N must be a power of two
+	// Offers the part of tsqueue's interface a ring can: items are pushed at the back and taken (or drained) from the front
+	template<typename T, size_t N = 4096>
+	class spscqueue
+	{
+		static_assert(N > 1 && (N & (N - 1)) == 0, "spscqueue size must be a power of two");
+
+	public:
+		spscqueue() : pRing(new Slot[N]) {}
+		spscqueue(const spscqueue<T, N>&) = delete;
+		virtual ~spscqueue() { clear(); }
+
+	public:
+		// Returns and maintains item at front of Queue, Queue must not be empty
+		const T& front()
+		{
+			return *pRing[nHead.load(std::memory_order_relaxed) & (N - 1)].get();
+		}
+
+		// Removes and returns item from front of Queue, Queue must not be empty
+		T pop_front()
+		{
+			size_t nIndex = nHead.load(std::memory_order_relaxed);
+			T* pItem = pRing[nIndex & (N - 1)].get();
+			T t = std::move(*pItem);
+			pItem->~T();
+			nHead.store(nIndex + 1, std::memory_order_release);
+			// Producers sleeping on a full Queue are woken once it drained to half, not on every pop
+			if (nTail.load(std::memory_order_relaxed) - nIndex - 1 == N / 2)
+				waiterSpace.notify();
+			return t;
+		}
+
+		// Adds an item to back of Queue, returns false if Queue is full
+		bool try_push_back(const T& item) { return try_emplace_back(item); }
+
+		// Moves an item to back of Queue, returns false (leaving item untouched) if Queue is full
+		bool try_push_back(T&& item) { return try_emplace_back(std::move(item)); }
+
+		// Adds an item to back of Queue, sleeps while Queue is full until the consumer drained it to half
+		// It must not be called from a thread the consumer waits for, e.g. one running the asio context while the consumer stops it
+		void push_back(const T& item)
+		{
+			while (try_push_back(item) == false)
+				waitSpace();
+		}
+
+		// Moves an item to back of Queue, sleeps while Queue is full until the consumer drained it to half
+		void push_back(T&& item)
+		{
+			while (try_push_back(std::move(item)) == false)
+				waitSpace();
+		}
+
+		// Constructs an item in place at back of Queue, sleeps while Queue is full until the consumer drained it to half
+		// The arguments are only used once a slot is free
+		template<typename... Args>
+		void emplace_back(Args&&... args)
+		{
+			while (try_emplace_back(std::forward<Args>(args)...) == false)
+				waitSpace();
+		}
+
+		// Returns true if Queue has no items
+		bool empty()
+		{
+			size_t nIndex = nHead.load(std::memory_order_relaxed);
+			if (nIndex != nTailCached)
+				return false;
+			nTailCached = nTail.load(std::memory_order_acquire);
+			return nIndex == nTailCached;
+		}
+
+		// Returns number of items in Queue
+		size_t count()
+		{
+			return nTail.load(std::memory_order_acquire) - nHead.load(std::memory_order_acquire);
+		}
+
+		// Clears Queue, must be called by the consumer
+		void clear()
+		{
+			while (empty() == false)
+				pop_front();
+		}
+
+		// Moves up to nMax items from front of Queue to the back of out, returns the amount of items moved
+		template<typename Container>
+		size_t drain(Container& out, size_t nMax = -1)
+		{
+			size_t nMoved = 0;
+			while (nMoved < nMax && empty() == false)
+			{
+				out.push_back(pop_front());
+				++nMoved;
+			}
+			return nMoved;
+		}
+
+		// Blocks until Queue has at least one item or wake was called
+		void wait()
+		{
+			waiter.wait([this]() { return !empty() || bWoken.load(); });
+		}
+
+		// Blocks until Queue has at least one item, timeout passes or wake was called, returns true if Queue has items
+		template<typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+		{
+			waiter.wait_for(timeout, [this]() { return !empty() || bWoken.load(); });
+			return !empty();
+		}
+
+		// Blocks until Queue has at least one item, then removes and returns item from front of Queue
+		T wait_pop()
+		{
+			waiter.wait([this]() { return !empty(); });
+			return pop_front();
+		}
+
+		// Wakes the consumer in wait and wait_for, both return at once from then on until rearm, wait_pop still waits for an item
+		void wake()
+		{
+			bWoken.store(true);
+			waiter.notify();
+		}
+
+		// Lets wait and wait_for sleep again after wake
+		void rearm()
+		{
+			bWoken.store(false);
+		}
+
+	protected:
+		void waitSpace()
+		{
+			waiterSpace.wait([this]() { return count() <= N / 2; });
+		}
+
+		template<typename... Args>
+		bool try_emplace_back(Args&&... args)
+		{
+			size_t nIndex = nTail.load(std::memory_order_relaxed);
+			if (nIndex - nHeadCached == N)
+			{
+				nHeadCached = nHead.load(std::memory_order_acquire);
+				if (nIndex - nHeadCached == N)
+					return false;
+			}
+			new (pRing[nIndex & (N - 1)].get()) T(std::forward<Args>(args)...);
+			nTail.store(nIndex + 1, std::memory_order_release);
+			waiter.notify();
+			return true;
+		}
+
+	protected:
+		struct Slot
+		{
+			T* get() { return reinterpret_cast<T*>(&storage); }
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+		};
+
+	protected:
+		std::unique_ptr<Slot[]> pRing;
+		char padStart[nCacheLineSize];
+		std::atomic<size_t> nHead{ 0 }; // Next item to pop, written by the consumer
+		size_t nTailCached = 0; // Consumer's last look at nTail
+		char padHead[nCacheLineSize];
+		std::atomic<size_t> nTail{ 0 }; // Next free slot, written by the producer
+		size_t nHeadCached = 0; // Producer's last look at nHead
+		char padTail[nCacheLineSize];
+		lfqueue_waiter waiter; // The consumer sleeps on it while Queue is empty
+		lfqueue_waiter waiterSpace; // Producers sleep on it while Queue is full
+		std::atomic<bool> bWoken{ false }; // Set by wake, makes wait and wait_for return
+	};
+
+	// Bounded multiple producer, single consumer queue over a ring of N items, N must be a power of two
+	// Every slot carries a sequence number, producers claim slots with a compare and swap on the tail
+	template<typename T, size_t N = 4096>
+	class mpscqueue
+	{
+		static_assert(N > 1 && (N & (N - 1)) == 0, "mpscqueue size must be a power of two");
+
+	public:
+		mpscqueue() : pRing(new Slot[N])
+		{
+			for (size_t i = 0; i < N; ++i)
+				pRing[i].nSequence.store(i, std::memory_order_relaxed);
+		}
+		mpscqueue(const mpscqueue<T, N>&) = delete;
+		virtual ~mpscqueue() { clear(); }
+
+	public:
+		// Returns and maintains item at front of Queue, Queue must not be empty
+		const T& front()
+		{
+			return *pRing[nHead.load(std::memory_order_relaxed) & (N - 1)].get();
+		}
+
+		// Removes and returns item from front of Queue, Queue must not be empty
+		T pop_front()
+		{
+			size_t nIndex = nHead.load(std::memory_order_relaxed);
+			Slot& slot = pRing[nIndex & (N - 1)];
+			T t = std::move(*slot.get());
+			slot.get()->~T();
+			// The slot becomes free for the producer which is one lap ahead
+			slot.nSequence.store(nIndex + N, std::memory_order_release);
+			nHead.store(nIndex + 1, std::memory_order_release);
+			// Producers sleeping on a full Queue are woken once it drained to half, not on every pop
+			if (nTail.load(std::memory_order_relaxed) - nIndex - 1 == N / 2)
+				waiterSpace.notify();
+			return t;
+		}
+
+		// Adds an item to back of Queue, returns false if Queue is full
+		bool try_push_back(const T& item) { return try_emplace_back(item); }
+
+		// Moves an item to back of Queue, returns false (leaving item untouched) if Queue is full
+		bool try_push_back(T&& item) { return try_emplace_back(std::move(item)); }
+
+		// Adds an item to back of Queue, sleeps while Queue is full until the consumer drained it to half
+		// It must not be called from a thread the consumer waits for, e.g. one running the asio context while the consumer stops it
+		void push_back(const T& item)
+		{
+			while (try_push_back(item) == false)
+				waitSpace();
+		}
+
+		// Moves an item to back of Queue, sleeps while Queue is full until the consumer drained it to half
+		void push_back(T&& item)
+		{
+			while (try_push_back(std::move(item)) == false)
+				waitSpace();
+		}
+
+		// Constructs an item in place at back of Queue, sleeps while Queue is full until the consumer drained it to half
+		// The arguments are only used once a slot is free
+		template<typename... Args>
+		void emplace_back(Args&&... args)
+		{
+			while (try_emplace_back(std::forward<Args>(args)...) == false)
+				waitSpace();
+		}
+
+		// Returns true if Queue has no items
+		bool empty()
+		{
+			size_t nIndex = nHead.load(std::memory_order_relaxed);
+			return pRing[nIndex & (N - 1)].nSequence.load(std::memory_order_acquire) != nIndex + 1;
+		}
+
+		// Returns number of items in Queue, includes items still being pushed
+		size_t count()
+		{
+			return nTail.load(std::memory_order_acquire) - nHead.load(std::memory_order_acquire);
+		}
+
+		// Clears Queue, must be called by the consumer
+		void clear()
+		{
+			while (empty() == false)
+				pop_front();
+		}
+
+		// Moves up to nMax items from front of Queue to the back of out, returns the amount of items moved
+		template<typename Container>
+		size_t drain(Container& out, size_t nMax = -1)
+		{
+			size_t nMoved = 0;
+			while (nMoved < nMax && empty() == false)
+			{
+				out.push_back(pop_front());
+				++nMoved;
+			}
+			return nMoved;
+		}
+
+		// Blocks until Queue has at least one item or wake was called
+		void wait()
+		{
+			waiter.wait([this]() { return !empty() || bWoken.load(); });
+		}
+
+		// Blocks until Queue has at least one item, timeout passes or wake was called, returns true if Queue has items
+		template<typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+		{
+			waiter.wait_for(timeout, [this]() { return !empty() || bWoken.load(); });
+			return !empty();
+		}
+
+		// Blocks until Queue has at least one item, then removes and returns item from front of Queue
+		T wait_pop()
+		{
+			waiter.wait([this]() { return !empty(); });
+			return pop_front();
+		}
+
+		// Wakes the consumer in wait and wait_for, both return at once from then on until rearm, wait_pop still waits for an item
+		void wake()
+		{
+			bWoken.store(true);
+			waiter.notify();
+		}
+
+		// Lets wait and wait_for sleep again after wake
+		void rearm()
+		{
+			bWoken.store(false);
+		}
+
+	protected:
+		void waitSpace()
+		{
+			waiterSpace.wait([this]() { return count() <= N / 2; });
+		}
+
+		template<typename... Args>
+		bool try_emplace_back(Args&&... args)
+		{
+			size_t nIndex = nTail.load(std::memory_order_relaxed);
+			Slot* pSlot = nullptr;
+			while (true)
+			{
+				pSlot = &pRing[nIndex & (N - 1)];
+				size_t nSequence = pSlot->nSequence.load(std::memory_order_acquire);
+				intptr_t nDiff = static_cast<intptr_t>(nSequence) - static_cast<intptr_t>(nIndex);
+				if (nDiff == 0)
+				{
+					// The slot is free, try to claim it
+					if (nTail.compare_exchange_weak(nIndex, nIndex + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (nDiff < 0)
+				{
+					// The slot still holds an item from the previous lap
+					return false;
+				}
+				else
+				{
+					// Another producer claimed the slot
+					nIndex = nTail.load(std::memory_order_relaxed);
+				}
+			}
+			new (pSlot->get()) T(std::forward<Args>(args)...);
+			pSlot->nSequence.store(nIndex + 1, std::memory_order_release);
+			waiter.notify();
+			return true;
+		}
+
+	protected:
+		struct Slot
+		{
+			T* get() { return reinterpret_cast<T*>(&storage); }
+			std::atomic<size_t> nSequence;
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+		};
+
+	protected:
+		std::unique_ptr<Slot[]> pRing;
+		char padStart[nCacheLineSize];
+		std::atomic<size_t> nHead{ 0 }; // Next item to pop, written by the consumer
+		char padHead[nCacheLineSize];
+		std::atomic<size_t> nTail{ 0 }; // Next slot to claim, written by the producers
+		char padTail[nCacheLineSize];
+		lfqueue_waiter waiter; // The consumer sleeps on it while Queue is empty
+		lfqueue_waiter waiterSpace; // Producers sleep on it while Queue is full
+		std::atomic<bool> bWoken{ false }; // Set by wake, makes wait and wait_for return
+	};
+
+	// Lock-free, only valid while the asio context is run by a single thread
+	template<size_t N = 4096>
+	struct spsc_policy
+	{
+		template<typename U>
+		using queue = spscqueue<U, N>;
+	};
+
+	// Lock-free, valid for any amount of threads running the asio context
+	template<size_t N = 4096>
+	struct mpsc_policy
+	{
+		template<typename U>
+		using queue = mpscqueue<U, N>;
+	};
+}
+
+#endif
\ No newline at end of file
@@ -1,174 +1,264 @@
-#ifndef kqmessages_
-#define kqmessages_
-
-#include "common.h"
-
-namespace kq
-{
-    // message_header will always have a fixed size holding information about the size of the additional message
-    template<typename T>
-    struct message_header
-    {
-    public:
-        message_header();
-        message_header(T _id);
-        message_header(const message_header<T>& other);
-        message_header(message_header<T>&& other);
-
-        message_header<T>& operator=(const message_header<T>& other);
-        message_header<T>& operator=(message_header<T>&& other);
-
-        T& getID() { return id; }
-        const T& getID() const { return id; }
-            
-    public: 
-        T id;
-        size_t size = 0;
-    };
-
-    template<typename T>
-    struct message
-    {
-    public:
-        message();
-        message(T _id);
-        message(const message<T>& other);
-        message(message<T>&& other);
-
-        message<T>& operator=(const message<T>& other);
-        message<T>& operator=(message<T>&& other);
-
-        const T& getID() const { return head.getID(); }
-        T& getID() { return head.getID(); }
-        void setID(T newid) const { head.getID() = newid; }
-        size_t size() const { return body.size(); }
-
-        // This operator will allow addition of information into the message | e.g: msg << int(4) << bool(false);
-        template<typename dataType>
-        message<T>& operator<<(const dataType& value);
-
-        // This operator will allow reading information from the message | e.g: msg >> b >> i;
-        // Make sure to read the data out in the reverse order that has been sent
-        template<typename dataType>
-        message<T>& operator>>(dataType& value);
-
-    public:
-        message_header<T> head;
-        kq::vector<uint8_t> body;
-
-    };
-
-    // Forward declaring of connection
-    template<typename T>
-    struct connection;
-
-    // An owned message is just a message paired with a pointer to a connection
-    template<typename T>
-    struct owned_message
-    {
-        // implementation uses automatically generated constructors from compiler
-        connection<T>* remote = nullptr;
-        message<T> msg;
-    };
-
-
-    template<typename T>
-    message_header<T>::message_header()
-        : id(), size() {}
-
-    template<typename T>
-    message_header<T>::message_header(T _id)
-        : id(_id), size() {}
-
-    template<typename T>
-    message_header<T>::message_header(const message_header<T>& other)
-        : id(other.id), size(other.size) {}
-
-    template<typename T>
-    message_header<T>::message_header(message_header<T>&& other)
-        : id(other.id), size(other.size) 
-    {
-        other.size = 0;
-    }
-            
-
-    template<typename T>
-    message_header<T>& message_header<T>::operator=(const message_header<T>& other)
-    {
-        id = other.id;
-        size = other.size;
-        return *this;
-    }
-
-    template<typename T>
-    message_header<T>& message_header<T>::operator=(message_header<T>&& other)
-    {
-        id = other.id;
-        size = other.size;
-        other.size = 0;
-        //FIXME: consider discarding of id value somehow ?
-        return *this;
-    }
-
-
-    template<typename T>
-    message<T>::message()
-        : head(), body() {}
-    
-
-    template<typename T>
-    message<T>::message(T id)
-        : head(id), body() {}
-
-    template<typename T>
-    message<T>::message(const message<T>& other)
-        : head(other.head), body(other.body) {}
-
-    template<typename T>
-    message<T>::message(message<T>&& other)
-        : head(std::move(other.head)), body(std::move(other.body)) {}
-
-
-    template<typename T>
-    message<T>& message<T>::operator=(const message<T>& other)
-    {
-        head = other.head;
-        body = other.body;
-        return *this;
-    }
-
-    template<typename T>
-    message<T>& message<T>::operator=(message<T>&& other)
-    {
-        head = std::move(other.head);
-        body = std::move(other.body);
-        return *this;
-    }
-
-    template<typename T>
-    template<typename dataType>
-    message<T>& message<T>::operator<<(const dataType& value)
-    {
-        size_t i = size();
-        body.resize(size() + sizeof(dataType));
-        std::memcpy(body.data() + i, &value, sizeof(dataType));
-        head.size = size();
-
-        return *this;
-    }
-
-    template<typename T>
-    template<typename dataType>
-    message<T>& message<T>::operator>>(dataType& value)
-    {
-        size_t i = size() - sizeof(dataType);
-        std::memcpy(&value, body.data() + i, sizeof(dataType));
-        body.resize(i);
-        head.size = size();
-
-        return *this;
-    }
-
-}
-
+#ifndef kqmessages_
+#define kqmessages_
+
+#include "common.h"
+#include "tsqueue.h"
+
+namespace kq
+{
+    // message_header will always have a fixed size holding information about the size of the additional message
+    template<typename T>
+    struct message_header
+    {
+    public:
+        message_header();
+        message_header(T _id);
+        message_header(const message_header<T>& other);
+        message_header(message_header<T>&& other) noexcept;
+
+        message_header<T>& operator=(const message_header<T>& other);
+        message_header<T>& operator=(message_header<T>&& other) noexcept;
+
+        T& getID() { return id; }
+        const T& getID() const { return id; }
+            
+    public: 
+        T id;
+        size_t size = 0;
+    };
+
+    template<typename T>
+    struct message
+    {
+    public:
+        message();
+        message(T _id);
+        message(const message<T>& other);
+        message(message<T>&& other) noexcept;
+
+        message<T>& operator=(const message<T>& other);
+        message<T>& operator=(message<T>&& other) noexcept;
+
+        const T& getID() const { return head.getID(); }
+        T& getID() { return head.getID(); }
+        void setID(T newid) const { head.getID() = newid; }
+        size_t size() const { return body.size(); }
+
+        // This operator will allow addition of information into the message | e.g: msg << int(4) << bool(false);
+        template<typename dataType>
+        message<T>& operator<<(const dataType& value);
+
+        // This operator will allow reading information from the message | e.g: msg >> b >> i;
+        // Make sure to read the data out in the reverse order that has been sent
+        template<typename dataType>
+        message<T>& operator>>(dataType& value);
+
+        // For ranges, strings, vectors and reading in the order things were written, see message_writer and message_reader (serializer.h)
+
+    public:
+        message_header<T> head;
+        kq::vector<uint8_t> body;
+
+    };
+
+    // A shared_message is an immutable message which can sit in the outbound queue of many connections at once
+    // Header and body are the bytes written to the socket, so they are produced once and freed when the last connection wrote them
+    template<typename T>
+    using shared_message = std::shared_ptr<const message<T>>;
+
+    template<typename T>
+    shared_message<T> make_shared_message(const message<T>& msg)
+    {
+        return std::make_shared<const message<T>>(msg);
+    }
+
+    template<typename T>
+    shared_message<T> make_shared_message(message<T>&& msg)
+    {
+        return std::make_shared<const message<T>>(std::move(msg));
+    }
+
+    // Forward declaring of connection
+    // Q is the queue policy, it selects the queue incoming messages are delivered through (see tsqueue.h and lfqueue.h)
+    template<typename T, typename Q = tsqueue_policy>
+    struct connection;
+
+    template<typename T, typename Q = tsqueue_policy>
+    struct multi_client_interface;
+
+    template<typename T, typename Q = tsqueue_policy>
+    struct client_interface;
+
+    // What a connection does with a message sent while it's outbound queue is over one of it's high-water marks
+    enum backpressure_policy : uint8_t
+    {
+        backpressure_report, // Queue it anyway, Send returns false so the sender can slow down
+        backpressure_drop_newest, // Don't queue it, Send returns false
+        backpressure_drop_oldest, // Queue it and drop the oldest messages not being written yet, until the queue is under the marks again
+        backpressure_disconnect // Don't queue it and close the connection, Send returns false
+    };
+
+    // Lanes of a connection's outbound queue, every write takes the messages of a higher lane before any of a lower one
+    enum message_priority : uint8_t
+    {
+        priority_high, // Control traffic, e.g. heartbeats and acks
+        priority_normal, // Every message unless told otherwise
+        priority_low, // Bulk data
+        priority_count,
+        priority_by_id = 0xFF // The lane set for the message's ID (see priority_table), normal if none was set
+    };
+
+    // Lane of every message ID, looked up by indexing an array with the ID, IDs from nIds up are always normal
+    template<typename T>
+    struct priority_table
+    {
+    public:
+        static const size_t nIds = 256;
+
+        priority_table() { m_priorities.fill(priority_normal); }
+
+        // Returns false if id is nIds or above, or priority isn't a lane
+        bool set(T id, message_priority priority)
+        {
+            uint64_t nId = static_cast<uint64_t>(id);
+            if (nId >= nIds || priority >= priority_count)
+                return false;
+            m_priorities[nId] = priority;
+            return true;
+        }
+
+        message_priority get(T id) const
+        {
+            uint64_t nId = static_cast<uint64_t>(id);
+            return nId < nIds ? m_priorities[nId] : priority_normal;
+        }
+
+    private:
+        std::array<message_priority, nIds> m_priorities;
+    };
+
+    // How connecting a client ended, connect and validation failures are told apart
+    enum connect_result : uint8_t
+    {
+        connect_pending, // Still connecting or validating
+        connect_success, // Connected and validated, messages can be sent
+        connect_resolve_error, // The host couldn't be resolved
+        connect_refused, // No endpoint of the host accepted the connection
+        connect_validation_failed, // The connection broke off during validation, e.g. the server rejected the client
+        connect_timeout, // Neither succeeded nor failed in time, the connection is closed
+        connect_aborted // Disconnect came first, or the client was already connected before
+    };
+
+    // An owned message is just a message paired with a pointer to a connection
+    template<typename T, typename Q = tsqueue_policy>
+    struct owned_message
+    {
+        // implementation uses automatically generated constructors from compiler
+        connection<T, Q>* remote = nullptr;
+        message<T> msg;
+#if KQNET_METRICS
+        uint64_t nQueuedAt = 0; // metrics_now() when the message entered the incoming queue
+#endif
+    };
+
+
+    template<typename T>
+    message_header<T>::message_header()
+        : id(), size() {}
+
+    template<typename T>
+    message_header<T>::message_header(T _id)
+        : id(_id), size() {}
+
+    template<typename T>
+    message_header<T>::message_header(const message_header<T>& other)
+        : id(other.id), size(other.size) {}
+
+    template<typename T>
+    message_header<T>::message_header(message_header<T>&& other) noexcept
+        : id(other.id), size(other.size) 
+    {
+        other.size = 0;
+    }
+            
+
+    template<typename T>
+    message_header<T>& message_header<T>::operator=(const message_header<T>& other)
+    {
+        id = other.id;
+        size = other.size;
+        return *this;
+    }
+
+    template<typename T>
+    message_header<T>& message_header<T>::operator=(message_header<T>&& other) noexcept
+    {
+        id = other.id;
+        size = other.size;
+        other.size = 0;
+        //FIXME: consider discarding of id value somehow ?
+        return *this;
+    }
+
+
+    template<typename T>
+    message<T>::message()
+        : head(), body() {}
+    
+
+    template<typename T>
+    message<T>::message(T id)
+        : head(id), body() {}
+
+    template<typename T>
+    message<T>::message(const message<T>& other)
+        : head(other.head), body(other.body) {}
+
+    template<typename T>
+    message<T>::message(message<T>&& other) noexcept
+        : head(std::move(other.head)), body(std::move(other.body)) {}
+
+
+    template<typename T>
+    message<T>& message<T>::operator=(const message<T>& other)
+    {
+        head = other.head;
+        body = other.body;
+        return *this;
+    }
+
+    template<typename T>
+    message<T>& message<T>::operator=(message<T>&& other) noexcept
+    {
+        head = std::move(other.head);
+        body = std::move(other.body);
+        return *this;
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message<T>& message<T>::operator<<(const dataType& value)
+    {
+        size_t i = size();
+        body.resize(size() + sizeof(dataType));
+        std::memcpy(body.data() + i, &value, sizeof(dataType));
+        head.size = size();
+
+        return *this;
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message<T>& message<T>::operator>>(dataType& value)
+    {
+        size_t i = size() - sizeof(dataType);
+        std::memcpy(&value, body.data() + i, sizeof(dataType));
+        body.resize(i);
+        head.size = size();
+
+        return *this;
+    }
+
+}
+
 #endif
\ No newline at end of file
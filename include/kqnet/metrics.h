@@ -0,0 +1,234 @@
+#ifndef kqmetrics_
+#define kqmetrics_
+
+#include "common.h"
+#include "message.h"
+
+namespace kq
+{
+    // Why the server lost a validated connection
+    enum disconnect_reason : uint8_t
+    {
+        disconnect_remote, // The remote closed the connection or reset it
+        disconnect_read_error,
+        disconnect_write_error,
+        disconnect_malformed, // The remote sent something that isn't our protocol
+        disconnect_backpressure, // The backpressure_disconnect policy closed it
+        disconnect_kicked, // KickClient
+        disconnect_oversized, // The remote sent a frame over the maximum frame size (see connection::SetMaxFrameSize)
+        disconnect_reason_count
+    };
+
+    // Copy of a histogram, taken by histogram::snapshot
+    struct histogram_snapshot
+    {
+        kq::vector<uint64_t> counts; // Values recorded in each bucket, see histogram::bucket_lower
+        uint64_t nCount = 0;
+        uint64_t nSum = 0;
+        uint64_t nMin = 0;
+        uint64_t nMax = 0;
+
+        double mean() const { return nCount > 0 ? double(nSum) / double(nCount) : 0.0; }
+
+        // Smallest value at least p percent of the recorded values are at or below, within the bucket precision of 1/16
+        uint64_t percentile(double p) const;
+    };
+
+    // A log-linear histogram in the spirit of HdrHistogram, every power of two is split into 16 buckets
+    // so a value is known within 1/16 of itself, from 0 to 2^64 - 1, in 976 buckets
+    // record is a few relaxed atomic adds, so any thread may record while another one takes snapshots
+    struct histogram
+    {
+    public:
+        static const size_t nSubBucketBits = 4;
+        static const size_t nSubBuckets = size_t(1) << nSubBucketBits;
+        static const size_t nBuckets = (64 - nSubBucketBits + 1) * nSubBuckets;
+
+        histogram();
+
+        histogram(const histogram&) = delete;
+        histogram& operator=(const histogram&) = delete;
+
+        void record(uint64_t nValue);
+
+        histogram_snapshot snapshot() const;
+
+        static size_t bucket_index(uint64_t nValue);
+
+        // Smallest and largest value counted by a bucket
+        static uint64_t bucket_lower(size_t nIndex);
+        static uint64_t bucket_upper(size_t nIndex);
+
+    private:
+        std::array<std::atomic<uint64_t>, nBuckets> m_counts;
+        std::atomic<uint64_t> m_nCount;
+        std::atomic<uint64_t> m_nSum;
+        std::atomic<uint64_t> m_nMin;
+        std::atomic<uint64_t> m_nMax;
+    };
+
+    // Monotonic nanoseconds, what timestamps and durations of the metrics are measured in
+    inline uint64_t metrics_now()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // Counters of server_interface updated by it and it's connections, read through server_interface::GetMetrics
+    struct server_counters
+    {
+        // Messages are counted per ID for IDs below nIds, all other IDs share the last counter
+        static const size_t nIds = 256;
+
+        template<typename T>
+        static size_t id_index(T id)
+        {
+            uint64_t nId = static_cast<uint64_t>(id);
+            return nId < nIds ? static_cast<size_t>(nId) : nIds;
+        }
+
+        server_counters();
+
+        std::atomic<uint64_t> nAccepted;
+        std::atomic<uint64_t> nRejected; // Declined by OnClientConnect
+        std::atomic<uint64_t> nValidated;
+        std::atomic<uint64_t> nValidationFailed;
+        std::array<std::atomic<uint64_t>, disconnect_reason_count> disconnects;
+
+        // Totals of connections already deleted, live connections keep their own (see read_stats, write_stats)
+        std::atomic<uint64_t> nRetiredMessagesIn;
+        std::atomic<uint64_t> nRetiredBytesIn;
+        std::atomic<uint64_t> nRetiredMessagesOut;
+        std::atomic<uint64_t> nRetiredBytesOut;
+
+        std::array<std::atomic<uint64_t>, nIds + 1> messagesInById;
+        std::array<std::atomic<uint64_t>, nIds + 1> messagesOutById;
+
+        histogram queueResidence; // Nanoseconds from a message entering the incoming queue to OnMessage being called with it
+        histogram handlerDuration; // Nanoseconds spent in OnMessage
+        std::array<histogram, priority_count> laneWait; // Nanoseconds a message waited in it's lane of the outbound queue until it was written, per message_priority
+    };
+
+    // Everything the server knows about itself at one point in time
+    // Rates (accepts, handshakes, bytes per second) are the difference of two snapshots over the difference of their nNanoseconds
+    // Without KQNET_METRICS only the connection and queue counts are filled in
+    struct server_metrics
+    {
+        uint64_t nNanoseconds = 0; // metrics_now() when the snapshot was taken
+
+        uint64_t nConnections = 0;
+        uint64_t nAccepted = 0;
+        uint64_t nRejected = 0;
+        uint64_t nValidated = 0;
+        uint64_t nValidationFailed = 0;
+        std::array<uint64_t, disconnect_reason_count> disconnects = {}; // Indexed by disconnect_reason
+
+        uint64_t nMessagesIn = 0;
+        uint64_t nBytesIn = 0; // Headers included
+        uint64_t nMessagesOut = 0; // Messages written, a message sent to many clients counts once per client
+        uint64_t nBytesOut = 0;
+        kq::vector<uint64_t> messagesInById; // Indexed by ID, IDs from server_counters::nIds up share the last entry
+        kq::vector<uint64_t> messagesOutById;
+
+        uint64_t nIncomingQueued = 0; // Messages waiting for Update
+        uint64_t nOutgoingQueuedMessages = 0; // Messages waiting to be written, to all clients
+        uint64_t nOutgoingQueuedBytes = 0;
+        std::array<uint64_t, priority_count> outgoingQueuedByLane = {}; // Indexed by message_priority
+
+        histogram_snapshot queueResidence;
+        histogram_snapshot handlerDuration;
+        std::array<histogram_snapshot, priority_count> laneWait;
+    };
+
+
+    inline uint64_t histogram_snapshot::percentile(double p) const
+    {
+        if (nCount == 0)
+            return 0;
+
+        uint64_t nRank = static_cast<uint64_t>(std::ceil(std::min(std::max(p, 0.0), 100.0) / 100.0 * double(nCount)));
+        nRank = std::max<uint64_t>(nRank, 1);
+        uint64_t nSeen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            nSeen += counts[i];
+            if (nSeen >= nRank)
+                return std::min(std::max(histogram::bucket_upper(i), nMin), nMax);
+        }
+        return nMax;
+    }
+
+    inline histogram::histogram()
+        : m_nCount(0), m_nSum(0), m_nMin(std::numeric_limits<uint64_t>::max()), m_nMax(0)
+    {
+        for (auto& count : m_counts)
+            count.store(0, std::memory_order_relaxed);
+    }
+
+    inline size_t histogram::bucket_index(uint64_t nValue)
+    {
+        if (nValue < nSubBuckets)
+            return static_cast<size_t>(nValue);
+
+        // The highest set bit picks the power of two, the nSubBucketBits bits below it the bucket within it
+        size_t nExponent = 63;
+        while ((nValue >> nExponent) == 0)
+            --nExponent;
+        size_t nSub = static_cast<size_t>(nValue >> (nExponent - nSubBucketBits)) & (nSubBuckets - 1);
+        return (nExponent - nSubBucketBits + 1) * nSubBuckets + nSub;
+    }
+
+    inline uint64_t histogram::bucket_lower(size_t nIndex)
+    {
+        if (nIndex < nSubBuckets)
+            return nIndex;
+
+        size_t nExponent = nIndex / nSubBuckets + nSubBucketBits - 1;
+        uint64_t nSub = nIndex % nSubBuckets;
+        return (nSubBuckets + nSub) << (nExponent - nSubBucketBits);
+    }
+
+    inline uint64_t histogram::bucket_upper(size_t nIndex)
+    {
+        return nIndex + 1 < nBuckets ? bucket_lower(nIndex + 1) - 1 : std::numeric_limits<uint64_t>::max();
+    }
+
+    inline void histogram::record(uint64_t nValue)
+    {
+        m_counts[bucket_index(nValue)].fetch_add(1, std::memory_order_relaxed);
+        m_nCount.fetch_add(1, std::memory_order_relaxed);
+        m_nSum.fetch_add(nValue, std::memory_order_relaxed);
+
+        // The extremes rarely change, so this is usually a load each
+        uint64_t nMin = m_nMin.load(std::memory_order_relaxed);
+        while (nValue < nMin && m_nMin.compare_exchange_weak(nMin, nValue, std::memory_order_relaxed) == false) {}
+        uint64_t nMax = m_nMax.load(std::memory_order_relaxed);
+        while (nValue > nMax && m_nMax.compare_exchange_weak(nMax, nValue, std::memory_order_relaxed) == false) {}
+    }
+
+    inline histogram_snapshot histogram::snapshot() const
+    {
+        histogram_snapshot snapshot;
+        snapshot.counts.resize(nBuckets);
+        for (size_t i = 0; i < nBuckets; ++i)
+            snapshot.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        snapshot.nCount = m_nCount.load(std::memory_order_relaxed);
+        snapshot.nSum = m_nSum.load(std::memory_order_relaxed);
+        snapshot.nMin = snapshot.nCount > 0 ? m_nMin.load(std::memory_order_relaxed) : 0;
+        snapshot.nMax = m_nMax.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
+    inline server_counters::server_counters()
+        : nAccepted(0), nRejected(0), nValidated(0), nValidationFailed(0), nRetiredMessagesIn(0), nRetiredBytesIn(0), nRetiredMessagesOut(0), nRetiredBytesOut(0), queueResidence(), handlerDuration(), laneWait()
+    {
+        for (auto& count : disconnects)
+            count.store(0, std::memory_order_relaxed);
+        for (auto& count : messagesInById)
+            count.store(0, std::memory_order_relaxed);
+        for (auto& count : messagesOutById)
+            count.store(0, std::memory_order_relaxed);
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
@@ -0,0 +1,307 @@
+#ifndef kqmulticlient_
+#define kqmulticlient_
+
+#include "common.h"
+#include "message.h"
+#include "tsqueue.h"
+#include "pool.h"
+#include "slotmap.h"
+#include "connection.h"
+
+namespace kq
+{
+    // Many outbound connections sharing one asio context and a few threads, e.g. for load generators and gateways
+    // A client_interface costs a context and a thread per connection, here a connection only costs it's socket and buffers
+    // Every connection delivers into one incoming queue, owned_message::remote tells which connection a message came from
+    // Q is the queue policy, with more than one thread it has to allow many producers (tsqueue_policy or mpsc_policy, see tsqueue.h and lfqueue.h)
+    template<typename T, typename Q>
+    struct multi_client_interface
+    {
+    public:
+        // nThreads is the amount of threads running the asio context, connections are spread across all of them
+        multi_client_interface(uint64_t(*scrambleFunc)(uint64_t), size_t nThreads = 1);
+
+        virtual ~multi_client_interface();
+
+        // Starts connecting and returns at once with the ID of the new connection, or 0 if host can't be resolved or there are too many connections
+        // Messages can be sent once IsConnected(id), a connection which fails to connect or validate is removed
+        uint32_t Connect(const std::string& host, uint16_t port);
+        // Resolving once is cheaper when opening thousands of connections to the same server
+        uint32_t Connect(const asio::ip::tcp::resolver::results_type& endpoints);
+
+        // Closes the connection, it's ID is invalid from then on, returns false if no connection has this ID (anymore)
+        bool Disconnect(uint32_t id);
+        void DisconnectAll();
+
+        // Whether the connection is validated, and not removed yet
+        bool IsConnected(uint32_t id);
+
+        // Connections connecting, validating or connected
+        size_t GetConnectionCount();
+        // Validated connections
+        size_t GetConnectedCount();
+
+        // Returns false if the connection isn't validated (anymore) or it's outbound queue is over a high-water mark (see connection::SetBackpressure)
+        // priority picks the lane of the outbound queue, by default the one set with SetPriority
+        bool Send(uint32_t id, const message<T>& msg, message_priority priority = priority_by_id);
+        bool Send(uint32_t id, message<T>&& msg, message_priority priority = priority_by_id);
+        bool Send(uint32_t id, const shared_message<T>& msg, message_priority priority = priority_by_id);
+
+        // Builds the message in place, fill(message<T>&) writes it's body straight into pooled memory
+        template<typename Fill>
+        bool SendEmplace(uint32_t id, T msgId, Fill&& fill, message_priority priority = priority_by_id);
+
+        // Sends one message shared by every validated connection
+        void SendAll(const message<T>& msg, message_priority priority = priority_by_id);
+        void SendAll(const shared_message<T>& msg, message_priority priority = priority_by_id);
+
+        // Calls f(connection<T, Q>*) for every connection, connections can't be removed meanwhile, so f must not call Disconnect
+        template<typename F>
+        void ForEachConnection(F&& f);
+
+        // owned_message::remote is deleted soon after it's connection was removed, so it is only safe to use while the connection is open
+        typename Q::template queue<owned_message<T, Q>>& Incoming();
+
+        // Gives the body of a message taken from Incoming() back to the pool the connections read into
+        void Recycle(message<T>& msg);
+
+        const std::shared_ptr<buffer_pool>& GetPool() const;
+
+        // Bodies of nBytes and more are compressed if the server enabled compression as well, 0 (the default) disables it
+        // Applies to connections opened afterwards
+        void SetCompressionThreshold(size_t nBytes) { m_nCompressionThreshold = nBytes; }
+
+        // Bodies bigger than nBytes close the connection before anything is allocated for them
+        // nDefaultMaxFrameSize (64 MB) by default, 0 doesn't limit them
+        // Applies to connections opened afterwards
+        void SetMaxFrameSize(size_t nBytes) { m_nMaxFrameSize = nBytes; }
+
+        // Messages of id are queued in the lane of priority, higher lanes are written first (see message_priority)
+        // Lanes are set before the first Connect, returns false if id is too big for the table
+        bool SetPriority(T id, message_priority priority) { return m_priorities.set(id, priority); }
+
+    public:
+        // Takes client out of m_connections, returns false if it wasn't in there (anymore)
+        bool __RemoveConnection(connection<T, Q>* client);
+
+    private:
+        // Returns the validated connection with this ID or nullptr, m_muxConnections must be locked
+        connection<T, Q>* FindConnected(uint32_t id);
+
+    private:
+        asio::io_context m_context;
+        asio::executor_work_guard<asio::io_context::executor_type> m_work; // Keeps the threads running while no connection has work
+        kq::vector<std::thread> m_vThreads;
+
+        slot_map<connection<T, Q>*> m_connections; // Keyed by connection ID, the keys are the IDs
+        std::mutex m_muxConnections; // Connections are removed from every thread running the context
+
+        typename Q::template queue<owned_message<T, Q>> m_qMessagesIn;
+        std::shared_ptr<buffer_pool> m_pool;
+        std::atomic<size_t> m_nCompressionThreshold;
+        std::atomic<size_t> m_nMaxFrameSize;
+        priority_table<T> m_priorities; // Only read once connecting
+
+        uint64_t(*m_scrambleFunc)(uint64_t);
+    }; // end of multi_client_interface
+
+    template<typename T, typename Q>
+    multi_client_interface<T, Q>::multi_client_interface(uint64_t(*scrambleFunc)(uint64_t), size_t nThreads)
+        : m_context(static_cast<int>(nThreads > 0 ? nThreads : 1)), m_work(asio::make_work_guard(m_context)), m_vThreads(), m_connections(), m_muxConnections(), m_qMessagesIn(),
+        m_pool(std::make_shared<buffer_pool>()), m_nCompressionThreshold(0), m_nMaxFrameSize(nDefaultMaxFrameSize), m_priorities(), m_scrambleFunc(scrambleFunc)
+    {
+        for (size_t i = 0; i < (nThreads > 0 ? nThreads : 1); ++i)
+            m_vThreads.push_back(std::thread([this]() { m_context.run(); }));
+    }
+
+    template<typename T, typename Q>
+    multi_client_interface<T, Q>::~multi_client_interface()
+    {
+        // Once every socket is closed and every connection deleted itself, the context runs out of work and the threads return
+        DisconnectAll();
+        m_work.reset();
+        for (auto& thread : m_vThreads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+    template<typename T, typename Q>
+    uint32_t multi_client_interface<T, Q>::Connect(const std::string& host, uint16_t port)
+    {
+        try
+        {
+            // Resolve hostname/ip to endpoints
+            asio::ip::tcp::resolver resolver(m_context);
+            return Connect(resolver.resolve(host, std::to_string(port)));
+        }
+        catch (std::exception& ec)
+        {
+            std::cout << "[Client] Connect() ERROR: " << ec.what() << '\n';
+            return 0;
+        }
+    }
+
+    template<typename T, typename Q>
+    uint32_t multi_client_interface<T, Q>::Connect(const asio::ip::tcp::resolver::results_type& endpoints)
+    {
+        connection<T, Q>* newconn = new connection<T, Q>(connection<T, Q>::owner::client, m_context, asio::ip::tcp::socket(m_context), m_qMessagesIn, m_scrambleFunc, nullptr, m_pool);
+        newconn->SetCompressionThreshold(m_nCompressionThreshold);
+        newconn->SetMaxFrameSize(m_nMaxFrameSize);
+        newconn->__SetMultiClient(this);
+        newconn->__SetPriorities(&m_priorities);
+
+        // Connecting opens the socket, under the lock so a Disconnect can't come first
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        uint32_t id = m_connections.insert(newconn);
+        if (id == 0)
+        {
+            delete newconn; // The table is full
+            return 0;
+        }
+        newconn->ConnectToServer(endpoints, id);
+        return id;
+    }
+
+    template<typename T, typename Q>
+    bool multi_client_interface<T, Q>::Disconnect(uint32_t id)
+    {
+        // The connection removes itself once it's pending operations failed
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>** client = m_connections.find(id);
+        if (client == nullptr)
+            return false;
+        (*client)->Disconnect();
+        return true;
+    }
+
+    template<typename T, typename Q>
+    void multi_client_interface<T, Q>::DisconnectAll()
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        for (auto& client : m_connections)
+            client->Disconnect();
+    }
+
+    template<typename T, typename Q>
+    bool multi_client_interface<T, Q>::IsConnected(uint32_t id)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        return FindConnected(id) != nullptr;
+    }
+
+    template<typename T, typename Q>
+    size_t multi_client_interface<T, Q>::GetConnectionCount()
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        return m_connections.size();
+    }
+
+    template<typename T, typename Q>
+    size_t multi_client_interface<T, Q>::GetConnectedCount()
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        size_t nConnected = 0;
+        for (auto& client : m_connections)
+            nConnected += client->IsConnected() ? 1 : 0;
+        return nConnected;
+    }
+
+    template<typename T, typename Q>
+    bool multi_client_interface<T, Q>::Send(uint32_t id, const message<T>& msg, message_priority priority)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>* client = FindConnected(id);
+        return client != nullptr && client->Send(msg, priority);
+    }
+
+    template<typename T, typename Q>
+    bool multi_client_interface<T, Q>::Send(uint32_t id, message<T>&& msg, message_priority priority)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>* client = FindConnected(id);
+        return client != nullptr && client->Send(std::move(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    bool multi_client_interface<T, Q>::Send(uint32_t id, const shared_message<T>& msg, message_priority priority)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>* client = FindConnected(id);
+        return client != nullptr && client->Send(msg, priority);
+    }
+
+    template<typename T, typename Q>
+    template<typename Fill>
+    bool multi_client_interface<T, Q>::SendEmplace(uint32_t id, T msgId, Fill&& fill, message_priority priority)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>* client = FindConnected(id);
+        return client != nullptr && client->SendEmplace(msgId, std::forward<Fill>(fill), priority);
+    }
+
+    template<typename T, typename Q>
+    void multi_client_interface<T, Q>::SendAll(const message<T>& msg, message_priority priority)
+    {
+        SendAll(m_pool->share(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    void multi_client_interface<T, Q>::SendAll(const shared_message<T>& msg, message_priority priority)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        for (auto& client : m_connections)
+        {
+            if (client->IsConnected())
+                client->Send(msg, priority);
+        }
+    }
+
+    template<typename T, typename Q>
+    template<typename F>
+    void multi_client_interface<T, Q>::ForEachConnection(F&& f)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        for (auto& client : m_connections)
+            f(client);
+    }
+
+    template<typename T, typename Q>
+    typename Q::template queue<owned_message<T, Q>>& multi_client_interface<T, Q>::Incoming()
+    {
+        return m_qMessagesIn;
+    }
+
+    template<typename T, typename Q>
+    void multi_client_interface<T, Q>::Recycle(message<T>& msg)
+    {
+        m_pool->recycle(msg);
+    }
+
+    template<typename T, typename Q>
+    const std::shared_ptr<buffer_pool>& multi_client_interface<T, Q>::GetPool() const
+    {
+        return m_pool;
+    }
+
+    template<typename T, typename Q>
+    bool multi_client_interface<T, Q>::__RemoveConnection(connection<T, Q>* client)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>** found = m_connections.find(client->getID());
+        if (found == nullptr || *found != client)
+            return false;
+        return m_connections.erase(client->getID());
+    }
+
+    template<typename T, typename Q>
+    connection<T, Q>* multi_client_interface<T, Q>::FindConnected(uint32_t id)
+    {
+        connection<T, Q>** client = m_connections.find(id);
+        return client != nullptr && (*client)->IsConnected() ? *client : nullptr;
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
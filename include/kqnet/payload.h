@@ -0,0 +1,72 @@
+#ifndef kqpayload_
+#define kqpayload_
+
+#include "common.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+namespace kq
+{
+    // A body written straight out of memory or a file the caller owns, instead of out of message<T>::body
+    // The connection keeps lifetime until the body was written, e.g. a handle unmapping the region or closing the file
+    struct external_body
+    {
+        const uint8_t* pData = nullptr; // Start of a memory region, nullptr for a file range
+        int fd = -1; // File the range is sent from when pData is nullptr, with sendfile on Linux
+        uint64_t nOffset = 0; // Start of the range in the file
+        size_t nSize = 0;
+        std::shared_ptr<const void> lifetime;
+    };
+
+    // The nSize bytes at pData, which must stay readable and unchanged until lifetime is released
+    inline external_body memory_body(const void* pData, size_t nSize, std::shared_ptr<const void> lifetime)
+    {
+        external_body body;
+        body.pData = static_cast<const uint8_t*>(pData);
+        body.nSize = nSize;
+        body.lifetime = std::move(lifetime);
+        return body;
+    }
+
+    // nSize bytes of the open file fd from nOffset on, fd must stay open until lifetime is released
+    inline external_body file_body(int fd, uint64_t nOffset, size_t nSize, std::shared_ptr<const void> lifetime)
+    {
+        external_body body;
+        body.fd = fd;
+        body.nOffset = nOffset;
+        body.nSize = nSize;
+        body.lifetime = std::move(lifetime);
+        return body;
+    }
+
+    // Reads up to nSize bytes at nOffset of fd into pOut without moving the file position (except on Windows)
+    // Returns the number of bytes read, 0 at the end of the file, or -1 on errors, where sendfile isn't available
+    inline int64_t read_file_range(int fd, uint64_t nOffset, uint8_t* pOut, size_t nSize)
+    {
+#ifdef _WIN32
+        if (_lseeki64(fd, static_cast<int64_t>(nOffset), SEEK_SET) < 0)
+            return -1;
+        return _read(fd, pOut, static_cast<unsigned int>(std::min<size_t>(nSize, 1u << 30)));
+#else
+        ssize_t nRead;
+        do
+        {
+            nRead = ::pread(fd, pOut, nSize, static_cast<off_t>(nOffset));
+        } while (nRead < 0 && errno == EINTR);
+        return nRead;
+#endif
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
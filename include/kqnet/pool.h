@@ -0,0 +1,385 @@
+#ifndef kqpool_
+#define kqpool_
+
+#include "common.h"
+#include "message.h"
+
+namespace kq
+{
+    struct pool_stats
+    {
+        uint64_t nBuffersReused = 0; // Bodies handed out from the pool
+        uint64_t nBuffersAllocated = 0; // Bodies the pool had to allocate
+        uint64_t nBlocksReused = 0; // Raw blocks (shared messages, handlers) handed out from the pool
+        uint64_t nBlocksAllocated = 0; // Raw blocks the pool had to allocate
+    };
+
+    // buffer_pool recycles message bodies and small raw blocks, so the steady state of a connection makes no heap allocations
+    // Both are sorted in power of two size classes, each class guarded by it's own mutex
+    // The pool is always owned by a std::shared_ptr, allocators and shared messages keep it alive
+    class buffer_pool : public std::enable_shared_from_this<buffer_pool>
+    {
+    public:
+        // nMaxBytesPerClass bounds the memory kept by a single size class, anything released above it is freed
+        buffer_pool(size_t nMaxBytesPerClass = 4 * 1024 * 1024);
+        buffer_pool(const buffer_pool&) = delete;
+        ~buffer_pool();
+
+        // Returns a body of nSize bytes, the content is unspecified
+        kq::vector<uint8_t> acquire(size_t nSize);
+
+        // Gives a body back to the pool
+        void release(kq::vector<uint8_t>&& buffer);
+
+        // Gives the body of a message back to the pool, leaving the message empty
+        template<typename T>
+        void recycle(message<T>& msg);
+
+        // Fills the pool ahead of time with nCount more bodies of nBodySize's class and nCount more raw blocks of every class
+        // Traffic that never has more than that in flight at once allocates nothing from then on, not even the first time it peaks
+        void reserve(size_t nBodySize, size_t nCount);
+
+        // Raw blocks backing pool_allocator
+        void* allocate(size_t nBytes);
+        void deallocate(void* p, size_t nBytes);
+
+        // Copies (or moves) a message into a shared message whose body, message and control block come from the pool
+        // The body goes back to the pool once the last reference is dropped, whichever thread drops it
+        template<typename T>
+        shared_message<T> share(const message<T>& msg);
+        template<typename T>
+        shared_message<T> share(message<T>&& msg);
+
+        // Builds a shared message in place: fill(message<T>&) writes the body straight into the pooled message before it becomes immutable
+        template<typename T, typename Fill>
+        shared_message<T> make(T id, Fill&& fill);
+
+        pool_stats GetStats() const;
+
+    private:
+        static const size_t nMinBufferShift = 6; // 64 bytes
+        static const size_t nMaxBufferShift = 20; // 1 MB, bigger bodies are not pooled
+        static const size_t nMinBlockShift = 4; // 16 bytes
+        static const size_t nMaxBlockShift = 12; // 4 KB, bigger blocks are not pooled
+
+        // Smallest shift whose size holds nBytes
+        static size_t ClassOf(size_t nBytes, size_t nMinShift);
+
+        struct BufferClass
+        {
+            std::mutex mux;
+            kq::vector<kq::vector<uint8_t>> vFree;
+            size_t nMax = 0;
+        };
+
+        struct BlockClass
+        {
+            std::mutex mux;
+            kq::vector<void*> vFree;
+            size_t nMax = 0;
+        };
+
+        BufferClass m_buffers[nMaxBufferShift - nMinBufferShift + 1];
+        BlockClass m_blocks[nMaxBlockShift - nMinBlockShift + 1];
+
+        std::atomic<uint64_t> m_nBuffersReused;
+        std::atomic<uint64_t> m_nBuffersAllocated;
+        std::atomic<uint64_t> m_nBlocksReused;
+        std::atomic<uint64_t> m_nBlocksAllocated;
+    };
+
+    // Allocator drawing from a buffer_pool, used for shared messages and asio handlers
+    template<typename U>
+    struct pool_allocator
+    {
+    public:
+        typedef U value_type;
+
+        pool_allocator(const std::shared_ptr<buffer_pool>& pool) noexcept : m_pool(pool) {}
+        template<typename V>
+        pool_allocator(const pool_allocator<V>& other) noexcept : m_pool(other.m_pool) {}
+
+        U* allocate(size_t n) { return static_cast<U*>(m_pool->allocate(n * sizeof(U))); }
+        void deallocate(U* p, size_t n) { m_pool->deallocate(p, n * sizeof(U)); }
+
+        template<typename V>
+        bool operator==(const pool_allocator<V>& other) const noexcept { return m_pool == other.m_pool; }
+        template<typename V>
+        bool operator!=(const pool_allocator<V>& other) const noexcept { return m_pool != other.m_pool; }
+
+    public:
+        std::shared_ptr<buffer_pool> m_pool;
+    };
+
+    // Wraps a handler given to asio, so asio allocates the operation from the pool
+    // Without it, posting from a thread which doesn't run the context allocates every time,
+    // and the few operations asio caches per thread are not enough for a connection reading and writing at once
+    template<typename Handler>
+    struct pooled_handler
+    {
+    public:
+        typedef pool_allocator<void> allocator_type;
+
+        allocator_type get_allocator() const noexcept { return allocator_type(m_pool); }
+
+        template<typename... Args>
+        void operator()(Args&&... args) { m_handler(std::forward<Args>(args)...); }
+
+    public:
+        Handler m_handler;
+        std::shared_ptr<buffer_pool> m_pool;
+    };
+
+    // Compressed body of a shared message, the first connection writing the message compressed fills it and every other one reuses it
+    struct compressed_body
+    {
+        std::once_flag once;
+        kq::vector<uint8_t> body; // Empty if the body didn't get smaller
+    };
+
+    // Deleter of shared messages made by buffer_pool::share, recycles the body and frees the message into the pool
+    // It lives in the message's control block, so it also holds the compressed body (see std::get_deleter)
+    template<typename T>
+    struct pooled_message_deleter
+    {
+    public:
+        pooled_message_deleter(const std::shared_ptr<buffer_pool>& pool) : m_pool(pool), m_pCompressed(nullptr) {}
+        pooled_message_deleter(const pooled_message_deleter<T>& other) : m_pool(other.m_pool), m_pCompressed(other.m_pCompressed.load()) {}
+
+        void operator()(message<T>* pMsg) const
+        {
+            m_pool->recycle(*pMsg);
+            pMsg->~message<T>();
+            m_pool->deallocate(pMsg, sizeof(message<T>));
+
+            compressed_body* pCompressed = m_pCompressed.load(std::memory_order_acquire);
+            if (pCompressed != nullptr)
+            {
+                m_pool->release(std::move(pCompressed->body));
+                pCompressed->~compressed_body();
+                m_pool->deallocate(pCompressed, sizeof(compressed_body));
+            }
+        }
+
+        // Returns the compressed body, created from the pool by the first connection asking for it
+        compressed_body& compressed()
+        {
+            compressed_body* pCompressed = m_pCompressed.load(std::memory_order_acquire);
+            if (pCompressed != nullptr)
+                return *pCompressed;
+
+            // Connections on other threads may ask at the same time, only one body is kept
+            compressed_body* pNew = new (m_pool->allocate(sizeof(compressed_body))) compressed_body();
+            if (m_pCompressed.compare_exchange_strong(pCompressed, pNew, std::memory_order_acq_rel, std::memory_order_acquire))
+                return *pNew;
+            pNew->~compressed_body();
+            m_pool->deallocate(pNew, sizeof(compressed_body));
+            return *pCompressed;
+        }
+
+    public:
+        std::shared_ptr<buffer_pool> m_pool;
+        std::atomic<compressed_body*> m_pCompressed;
+    };
+
+    template<typename Handler>
+    pooled_handler<typename std::decay<Handler>::type> make_pooled_handler(const std::shared_ptr<buffer_pool>& pool, Handler&& handler)
+    {
+        return { std::forward<Handler>(handler), pool };
+    }
+
+
+    inline buffer_pool::buffer_pool(size_t nMaxBytesPerClass)
+        : m_nBuffersReused(0), m_nBuffersAllocated(0), m_nBlocksReused(0), m_nBlocksAllocated(0)
+    {
+        for (size_t i = 0; i <= nMaxBufferShift - nMinBufferShift; ++i)
+            m_buffers[i].nMax = std::max<size_t>(nMaxBytesPerClass >> (i + nMinBufferShift), 4);
+        for (size_t i = 0; i <= nMaxBlockShift - nMinBlockShift; ++i)
+            m_blocks[i].nMax = std::max<size_t>(nMaxBytesPerClass >> (i + nMinBlockShift), 4);
+    }
+
+    inline buffer_pool::~buffer_pool()
+    {
+        for (auto& blockClass : m_blocks)
+        {
+            for (void* p : blockClass.vFree)
+                ::operator delete(p);
+        }
+    }
+
+    inline size_t buffer_pool::ClassOf(size_t nBytes, size_t nMinShift)
+    {
+        size_t nShift = nMinShift;
+        while ((size_t(1) << nShift) < nBytes)
+            ++nShift;
+        return nShift;
+    }
+
+    inline kq::vector<uint8_t> buffer_pool::acquire(size_t nSize)
+    {
+        size_t nShift = ClassOf(nSize, nMinBufferShift);
+        kq::vector<uint8_t> buffer;
+        if (nShift <= nMaxBufferShift)
+        {
+            BufferClass& bufferClass = m_buffers[nShift - nMinBufferShift];
+            std::unique_lock<std::mutex> lock(bufferClass.mux);
+            if (bufferClass.vFree.empty() == false)
+            {
+                buffer = std::move(bufferClass.vFree.back());
+                bufferClass.vFree.pop_back();
+                lock.unlock();
+
+                // The capacity is already there, resize doesn't allocate
+                m_nBuffersReused.fetch_add(1, std::memory_order_relaxed);
+                buffer.resize(nSize);
+                return buffer;
+            }
+            lock.unlock();
+            // Allocate the whole class size, so the buffer can serve any request of the class once released
+            buffer.reserve(size_t(1) << nShift);
+        }
+        m_nBuffersAllocated.fetch_add(1, std::memory_order_relaxed);
+        buffer.resize(nSize);
+        return buffer;
+    }
+
+    inline void buffer_pool::release(kq::vector<uint8_t>&& buffer)
+    {
+        size_t nCapacity = buffer.capacity();
+        if (nCapacity < (size_t(1) << nMinBufferShift) || nCapacity > (size_t(1) << nMaxBufferShift))
+            return;
+
+        // A buffer belongs to the biggest class it can fully serve
+        size_t nShift = ClassOf(nCapacity, nMinBufferShift);
+        if ((size_t(1) << nShift) > nCapacity)
+            --nShift;
+
+        BufferClass& bufferClass = m_buffers[nShift - nMinBufferShift];
+        std::unique_lock<std::mutex> lock(bufferClass.mux);
+        if (bufferClass.vFree.size() < bufferClass.nMax)
+            bufferClass.vFree.push_back(std::move(buffer));
+    }
+
+    template<typename T>
+    void buffer_pool::recycle(message<T>& msg)
+    {
+        release(std::move(msg.body));
+        msg.body = kq::vector<uint8_t>();
+        msg.head.size = 0;
+    }
+
+    inline void buffer_pool::reserve(size_t nBodySize, size_t nCount)
+    {
+        size_t nShift = ClassOf(nBodySize, nMinBufferShift);
+        if (nShift <= nMaxBufferShift)
+        {
+            BufferClass& bufferClass = m_buffers[nShift - nMinBufferShift];
+            std::unique_lock<std::mutex> lock(bufferClass.mux);
+            size_t nTarget = std::min(bufferClass.vFree.size() + nCount, bufferClass.nMax);
+            // The free list itself must not grow either once the bodies come back
+            bufferClass.vFree.reserve(nTarget);
+            for (size_t i = bufferClass.vFree.size(); i < nTarget; ++i)
+            {
+                kq::vector<uint8_t> buffer;
+                buffer.reserve(size_t(1) << nShift);
+                bufferClass.vFree.push_back(std::move(buffer));
+                m_nBuffersAllocated.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Which classes shared messages and asio's operations fall in depends on the compiler, so every class is filled
+        for (size_t i = 0; i <= nMaxBlockShift - nMinBlockShift; ++i)
+        {
+            BlockClass& blockClass = m_blocks[i];
+            std::unique_lock<std::mutex> lock(blockClass.mux);
+            size_t nTarget = std::min(blockClass.vFree.size() + nCount, blockClass.nMax);
+            blockClass.vFree.reserve(nTarget);
+            for (size_t j = blockClass.vFree.size(); j < nTarget; ++j)
+            {
+                blockClass.vFree.push_back(::operator new(size_t(1) << (i + nMinBlockShift)));
+                m_nBlocksAllocated.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    inline void* buffer_pool::allocate(size_t nBytes)
+    {
+        size_t nShift = ClassOf(nBytes, nMinBlockShift);
+        if (nShift > nMaxBlockShift)
+            return ::operator new(nBytes);
+
+        BlockClass& blockClass = m_blocks[nShift - nMinBlockShift];
+        {
+            std::unique_lock<std::mutex> lock(blockClass.mux);
+            if (blockClass.vFree.empty() == false)
+            {
+                void* p = blockClass.vFree.back();
+                blockClass.vFree.pop_back();
+                m_nBlocksReused.fetch_add(1, std::memory_order_relaxed);
+                return p;
+            }
+        }
+        m_nBlocksAllocated.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size_t(1) << nShift);
+    }
+
+    inline void buffer_pool::deallocate(void* p, size_t nBytes)
+    {
+        size_t nShift = ClassOf(nBytes, nMinBlockShift);
+        if (nShift <= nMaxBlockShift)
+        {
+            BlockClass& blockClass = m_blocks[nShift - nMinBlockShift];
+            std::unique_lock<std::mutex> lock(blockClass.mux);
+            if (blockClass.vFree.size() < blockClass.nMax)
+            {
+                blockClass.vFree.push_back(p);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+    template<typename T>
+    shared_message<T> buffer_pool::share(const message<T>& msg)
+    {
+        message<T> copy;
+        copy.head = msg.head;
+        if (msg.size() > 0)
+        {
+            copy.body = acquire(msg.size());
+            std::memcpy(copy.body.data(), msg.body.data(), msg.size());
+        }
+        return share(std::move(copy));
+    }
+
+    template<typename T>
+    shared_message<T> buffer_pool::share(message<T>&& msg)
+    {
+        message<T>* pMsg = new (allocate(sizeof(message<T>))) message<T>(std::move(msg));
+        return shared_message<T>(pMsg, pooled_message_deleter<T>(shared_from_this()), pool_allocator<message<T>>(shared_from_this()));
+    }
+
+    template<typename T, typename Fill>
+    shared_message<T> buffer_pool::make(T id, Fill&& fill)
+    {
+        message<T>* pMsg = new (allocate(sizeof(message<T>))) message<T>(id);
+        // Owning it straight away frees the message if fill throws
+        shared_message<T> shared(pMsg, pooled_message_deleter<T>(shared_from_this()), pool_allocator<message<T>>(shared_from_this()));
+        fill(*pMsg);
+        pMsg->head.size = pMsg->size();
+        return shared;
+    }
+
+    inline pool_stats buffer_pool::GetStats() const
+    {
+        pool_stats stats;
+        stats.nBuffersReused = m_nBuffersReused.load(std::memory_order_relaxed);
+        stats.nBuffersAllocated = m_nBuffersAllocated.load(std::memory_order_relaxed);
+        stats.nBlocksReused = m_nBlocksReused.load(std::memory_order_relaxed);
+        stats.nBlocksAllocated = m_nBlocksAllocated.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
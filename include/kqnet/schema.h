@@ -0,0 +1,207 @@
+#ifndef kqschema_
+#define kqschema_
+
+#include "common.h"
+#include "message.h"
+#include "serializer.h"
+#include "pool.h"
+
+namespace kq
+{
+    // message_schema binds an ID of T to the payload struct its messages carry, by specializing it:
+    //
+    //     struct Position { float x, y; uint32_t entity; };
+    //     template<> struct message_schema<msgids, msgids::Position> { typedef Position type; };
+    //
+    // A trivially copyable payload is a fixed layout, encoded as one memcpy of sizeof(type) bytes
+    // Any other payload (e.g. holding a std::string) also needs static write(message_writer<T>&, const type&) and read(message_reader<T>&, type&) in the specialization
+    // IDs without a specialization have no schema, using them with schema<T> fails to compile
+    template<typename T, T id>
+    struct message_schema;
+
+    template<typename T, T id>
+    using schema_payload = typename message_schema<T, id>::type;
+
+    // Typed codecs over the schemas of T, e.g:
+    //     schema<msgids>::encode<msgids::Position>(msg, position);
+    //     schema<msgids>::decode<msgids::Position>(msg, position);
+    //     schema<msgids>::dispatch<msgids::Position, msgids::Chat>(msg, handler);
+    template<typename T>
+    struct schema
+    {
+    public:
+        template<T id>
+        static constexpr bool is_fixed() { return std::is_trivially_copyable<schema_payload<T, id>>::value; }
+
+        // Body size of a fixed layout, known at compile time
+        template<T id>
+        static constexpr size_t size()
+        {
+            static_assert(is_fixed<id>(), "Only fixed layouts have a size known at compile time");
+            return sizeof(schema_payload<T, id>);
+        }
+
+        // Replaces the ID and body of msg with payload, a fixed layout is one pre-sized write
+        template<T id, typename Payload>
+        static void encode(message<T>& msg, const Payload& payload);
+
+        template<T id, typename Payload>
+        static message<T> encode(const Payload& payload);
+
+        // Builds the message in place in a pooled shared message, ready for MessageClient/Send
+        template<T id, typename Payload>
+        static shared_message<T> make(const std::shared_ptr<buffer_pool>& pool, const Payload& payload);
+
+        // Returns false if msg doesn't carry id, or its body doesn't hold exactly one payload
+        template<T id, typename Payload>
+        static bool decode(const message<T>& msg, Payload& payload);
+
+        // Decodes msg with the schema of it's ID and calls handler(const payload&), e.g. from OnMessage
+        // Returns false if the ID is not in ids or the body doesn't match the schema, handler is not called then
+        template<T... ids, typename Handler>
+        static bool dispatch(const message<T>& msg, Handler&& handler);
+
+    private:
+        template<T id, typename Payload>
+        static void CheckPayload();
+
+        template<T id>
+        static void Write(message<T>& msg, const schema_payload<T, id>& payload, std::true_type);
+        template<T id>
+        static void Write(message<T>& msg, const schema_payload<T, id>& payload, std::false_type);
+
+        template<T id>
+        static bool Read(const message<T>& msg, schema_payload<T, id>& payload, std::true_type);
+        template<T id>
+        static bool Read(const message<T>& msg, schema_payload<T, id>& payload, std::false_type);
+
+        // Walks ids like a switch, C++14 has no fold expressions
+        template<typename Handler>
+        static bool Dispatch(const message<T>& msg, Handler& handler);
+        template<T first, T... rest, typename Handler>
+        static bool Dispatch(const message<T>& msg, Handler& handler);
+    };
+
+
+    template<typename T>
+    template<T id, typename Payload>
+    void schema<T>::CheckPayload()
+    {
+        static_assert(std::is_same<Payload, schema_payload<T, id>>::value, "The payload type doesn't match the schema of this ID");
+    }
+
+    template<typename T>
+    template<T id>
+    void schema<T>::Write(message<T>& msg, const schema_payload<T, id>& payload, std::true_type)
+    {
+        msg.body.resize(size<id>());
+        std::memcpy(msg.body.data(), &payload, size<id>());
+        msg.head.size = size<id>();
+    }
+
+    template<typename T>
+    template<T id>
+    void schema<T>::Write(message<T>& msg, const schema_payload<T, id>& payload, std::false_type)
+    {
+        msg.body.clear();
+        message_writer<T> writer(msg);
+        message_schema<T, id>::write(writer, payload);
+    }
+
+    template<typename T>
+    template<T id>
+    bool schema<T>::Read(const message<T>& msg, schema_payload<T, id>& payload, std::true_type)
+    {
+        if (msg.size() != size<id>())
+            return false;
+        std::memcpy(&payload, msg.body.data(), size<id>());
+        return true;
+    }
+
+    template<typename T>
+    template<T id>
+    bool schema<T>::Read(const message<T>& msg, schema_payload<T, id>& payload, std::false_type)
+    {
+        message_reader<T> reader(msg);
+        try
+        {
+            message_schema<T, id>::read(reader, payload);
+        }
+        catch (std::out_of_range&)
+        {
+            return false;
+        }
+        return reader.remaining() == 0;
+    }
+
+    template<typename T>
+    template<T id, typename Payload>
+    void schema<T>::encode(message<T>& msg, const Payload& payload)
+    {
+        CheckPayload<id, Payload>();
+        msg.head.id = id;
+        Write<id>(msg, payload, std::integral_constant<bool, is_fixed<id>()>());
+    }
+
+    template<typename T>
+    template<T id, typename Payload>
+    message<T> schema<T>::encode(const Payload& payload)
+    {
+        message<T> msg(id);
+        encode<id>(msg, payload);
+        return msg;
+    }
+
+    template<typename T>
+    template<T id, typename Payload>
+    shared_message<T> schema<T>::make(const std::shared_ptr<buffer_pool>& pool, const Payload& payload)
+    {
+        CheckPayload<id, Payload>();
+        return pool->make(id, [&](message<T>& msg) {
+            // A fixed layout takes a body of exactly it's size, anything else starts from the smallest pooled body and grows
+            msg.body = pool->acquire(is_fixed<id>() ? sizeof(Payload) : 0);
+            encode<id>(msg, payload);
+            });
+    }
+
+    template<typename T>
+    template<T id, typename Payload>
+    bool schema<T>::decode(const message<T>& msg, Payload& payload)
+    {
+        CheckPayload<id, Payload>();
+        if (msg.getID() != id)
+            return false;
+        return Read<id>(msg, payload, std::integral_constant<bool, is_fixed<id>()>());
+    }
+
+    template<typename T>
+    template<T... ids, typename Handler>
+    bool schema<T>::dispatch(const message<T>& msg, Handler&& handler)
+    {
+        return Dispatch<ids...>(msg, handler);
+    }
+
+    template<typename T>
+    template<typename Handler>
+    bool schema<T>::Dispatch(const message<T>& msg, Handler& handler)
+    {
+        return false;
+    }
+
+    template<typename T>
+    template<T first, T... rest, typename Handler>
+    bool schema<T>::Dispatch(const message<T>& msg, Handler& handler)
+    {
+        if (msg.getID() != first)
+            return Dispatch<rest...>(msg, handler);
+
+        schema_payload<T, first> payload;
+        if (Read<first>(msg, payload, std::integral_constant<bool, is_fixed<first>()>()) == false)
+            return false;
+        handler(static_cast<const schema_payload<T, first>&>(payload));
+        return true;
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
@@ -0,0 +1,259 @@
+#ifndef kqserializer_
+#define kqserializer_
+
+#include "common.h"
+#include "message.h"
+#include "wire.h"
+
+namespace kq
+{
+    // message_writer appends fields to the end of a message body, in the same byte layout as message<T>::operator<<
+    // Unlike operator<<, the body can be reserved up front, ranges go in with a single copy, and strings and vectors are length prefixed
+    // The body is grown ahead of the writes and trimmed by finish(), which the destructor calls, so don't send the message while a writer is on it
+    // e.g: message_writer<T> writer(msg); writer.reserve(1024); writer << id << name << positions;
+    template<typename T>
+    struct message_writer
+    {
+    public:
+        message_writer(message<T>& msg);
+        message_writer(const message_writer<T>&) = delete;
+        ~message_writer();
+
+        // Makes room for nBytes more bytes, so the writes that follow don't reallocate the body
+        message_writer<T>& reserve(size_t nBytes);
+
+        // Appends a single trivially copyable value
+        template<typename dataType>
+        message_writer<T>& write(const dataType& value);
+
+        // Appends nCount contiguous values with one copy
+        template<typename dataType>
+        message_writer<T>& write(const dataType* pData, size_t nCount);
+
+        // Appends the length as a varint followed by the characters
+        message_writer<T>& write(const std::string& value);
+
+        // Appends the element count as a varint followed by the elements
+        template<typename dataType>
+        message_writer<T>& write(const std::vector<dataType>& value);
+
+        template<typename dataType>
+        message_writer<T>& operator<<(const dataType& value) { return write(value); }
+
+        // Trims the body to what was written and updates the header, the writer can keep writing afterwards
+        void finish();
+
+        // Bytes written to the message so far, including what was in it before
+        size_t size() const { return m_nSize; }
+
+    private:
+        // Grows the body by nBytes and returns where they start
+        uint8_t* Extend(size_t nBytes);
+
+    private:
+        message<T>& m_msg;
+        size_t m_nSize;
+    };
+
+    // message_reader reads fields from the front of a message body, in the order they were written, without changing the message
+    // Reading past the end of the body throws std::out_of_range, so a malformed message from a peer can't be read out of bounds
+    // e.g: message_reader<T> reader(msg); reader >> id >> name >> positions;
+    template<typename T>
+    struct message_reader
+    {
+    public:
+        message_reader(const message<T>& msg);
+
+        template<typename dataType>
+        message_reader<T>& read(dataType& value);
+
+        template<typename dataType>
+        message_reader<T>& read(dataType* pData, size_t nCount);
+
+        message_reader<T>& read(std::string& value);
+
+        template<typename dataType>
+        message_reader<T>& read(std::vector<dataType>& value);
+
+        template<typename dataType>
+        message_reader<T>& operator>>(dataType& value) { return read(value); }
+
+        // Moves the cursor nBytes forward without reading them
+        message_reader<T>& skip(size_t nBytes);
+
+        // Bytes left after the cursor
+        size_t remaining() const { return m_msg.size() - m_nOffset; }
+        size_t offset() const { return m_nOffset; }
+
+    private:
+        // Returns the next nBytes of the body and moves the cursor past them
+        const uint8_t* Consume(size_t nBytes);
+        size_t ReadLength(size_t nElementSize);
+
+    private:
+        const message<T>& m_msg;
+        size_t m_nOffset;
+    };
+
+
+    template<typename T>
+    message_writer<T>::message_writer(message<T>& msg)
+        : m_msg(msg), m_nSize(msg.size()) {}
+
+    template<typename T>
+    message_writer<T>::~message_writer()
+    {
+        finish();
+    }
+
+    template<typename T>
+    void message_writer<T>::finish()
+    {
+        // Shrinking keeps the capacity, so writing more afterwards doesn't reallocate either
+        m_msg.body.resize(m_nSize);
+        m_msg.head.size = m_nSize;
+    }
+
+    template<typename T>
+    message_writer<T>& message_writer<T>::reserve(size_t nBytes)
+    {
+        if (m_nSize + nBytes > m_msg.body.size())
+            m_msg.body.resize(m_nSize + nBytes);
+        return *this;
+    }
+
+    template<typename T>
+    uint8_t* message_writer<T>::Extend(size_t nBytes)
+    {
+        // A resize per field is what makes operator<< slow, so the body grows geometrically and the writes only move m_nSize
+        if (m_nSize + nBytes > m_msg.body.size())
+            m_msg.body.resize(std::max(m_nSize + nBytes, m_msg.body.size() * 2));
+        uint8_t* pOut = m_msg.body.data() + m_nSize;
+        m_nSize += nBytes;
+        return pOut;
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message_writer<T>& message_writer<T>::write(const dataType& value)
+    {
+        static_assert(std::is_trivially_copyable<dataType>::value, "message_writer can only copy trivially copyable types, strings and vectors");
+        std::memcpy(Extend(sizeof(dataType)), &value, sizeof(dataType));
+        return *this;
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message_writer<T>& message_writer<T>::write(const dataType* pData, size_t nCount)
+    {
+        static_assert(std::is_trivially_copyable<dataType>::value, "message_writer can only copy trivially copyable types, strings and vectors");
+        if (nCount > 0)
+            std::memcpy(Extend(nCount * sizeof(dataType)), pData, nCount * sizeof(dataType));
+        return *this;
+    }
+
+    template<typename T>
+    message_writer<T>& message_writer<T>::write(const std::string& value)
+    {
+        // The prefix and the characters take one Extend
+        uint8_t* pOut = Extend(varint_size(value.size()) + value.size());
+        pOut += encode_varint(value.size(), pOut);
+        if (value.empty() == false)
+            std::memcpy(pOut, value.data(), value.size());
+        return *this;
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message_writer<T>& message_writer<T>::write(const std::vector<dataType>& value)
+    {
+        static_assert(std::is_trivially_copyable<dataType>::value, "message_writer can only copy vectors of trivially copyable types");
+        size_t nBytes = value.size() * sizeof(dataType);
+        uint8_t* pOut = Extend(varint_size(value.size()) + nBytes);
+        pOut += encode_varint(value.size(), pOut);
+        if (nBytes > 0)
+            std::memcpy(pOut, value.data(), nBytes);
+        return *this;
+    }
+
+
+    template<typename T>
+    message_reader<T>::message_reader(const message<T>& msg)
+        : m_msg(msg), m_nOffset(0) {}
+
+    template<typename T>
+    const uint8_t* message_reader<T>::Consume(size_t nBytes)
+    {
+        if (nBytes > remaining())
+            throw std::out_of_range("message_reader: read past the end of the message");
+        const uint8_t* pIn = m_msg.body.data() + m_nOffset;
+        m_nOffset += nBytes;
+        return pIn;
+    }
+
+    template<typename T>
+    size_t message_reader<T>::ReadLength(size_t nElementSize)
+    {
+        uint64_t nLength = 0;
+        size_t nBytes = decode_varint(m_msg.body.data() + m_nOffset, remaining(), nLength);
+        if (nBytes == 0 || nBytes == size_t(-1))
+            throw std::out_of_range("message_reader: invalid length prefix");
+        m_nOffset += nBytes;
+
+        // Checked before anything is allocated, a bogus length must not reserve gigabytes
+        if (nLength > remaining() / nElementSize)
+            throw std::out_of_range("message_reader: length prefix past the end of the message");
+        return static_cast<size_t>(nLength);
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message_reader<T>& message_reader<T>::read(dataType& value)
+    {
+        static_assert(std::is_trivially_copyable<dataType>::value, "message_reader can only copy trivially copyable types, strings and vectors");
+        std::memcpy(&value, Consume(sizeof(dataType)), sizeof(dataType));
+        return *this;
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message_reader<T>& message_reader<T>::read(dataType* pData, size_t nCount)
+    {
+        static_assert(std::is_trivially_copyable<dataType>::value, "message_reader can only copy trivially copyable types, strings and vectors");
+        if (nCount > remaining() / sizeof(dataType))
+            throw std::out_of_range("message_reader: read past the end of the message");
+        if (nCount > 0)
+            std::memcpy(pData, Consume(nCount * sizeof(dataType)), nCount * sizeof(dataType));
+        return *this;
+    }
+
+    template<typename T>
+    message_reader<T>& message_reader<T>::read(std::string& value)
+    {
+        size_t nLength = ReadLength(1);
+        value.assign(reinterpret_cast<const char*>(Consume(nLength)), nLength);
+        return *this;
+    }
+
+    template<typename T>
+    template<typename dataType>
+    message_reader<T>& message_reader<T>::read(std::vector<dataType>& value)
+    {
+        static_assert(std::is_trivially_copyable<dataType>::value, "message_reader can only copy vectors of trivially copyable types");
+        size_t nCount = ReadLength(sizeof(dataType));
+        value.resize(nCount);
+        if (nCount > 0)
+            std::memcpy(value.data(), Consume(nCount * sizeof(dataType)), nCount * sizeof(dataType));
+        return *this;
+    }
+
+    template<typename T>
+    message_reader<T>& message_reader<T>::skip(size_t nBytes)
+    {
+        Consume(nBytes);
+        return *this;
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
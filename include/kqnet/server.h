@@ -5,15 +5,22 @@
 #include "message.h"
 #include "tsqueue.h"
 #include "connection.h"
+#include "pool.h"
+#include "slotmap.h"
+#include "metrics.h"
+#include "dispatch.h"
+#include "stream.h"
 
 namespace kq
 {
-    template<typename T>
+    // Q is the queue policy, it selects the queue incoming messages are delivered through (see tsqueue.h and lfqueue.h)
+    template<typename T, typename Q = tsqueue_policy>
     struct server_interface
     {
     public:
         
-        server_interface(uint16_t port, uint64_t(*scrambleFunc)(uint64_t));
+        // nThreads is the amount of threads running the asio context, connections are spread across all of them
+        server_interface(uint16_t port, uint64_t(*scrambleFunc)(uint64_t), size_t nThreads = 1);
         
         virtual ~server_interface();
 
@@ -23,16 +30,97 @@ namespace kq
 
         void WaitForClientConnection();
 
-        void KickClient(connection<T>* client);
+        // Closes the connection, OnClientDisconnect follows once it's pending read and write have failed
+        void KickClient(connection<T, Q>* client);
+        // Returns false if no connection has this ID (anymore)
+        bool KickClient(uint32_t id);
         
-        void MessageClient(connection<T>* client, const message<T>& msg);
+        // The rvalue overloads hand the body over without copying it, e.g. MessageClient(client, std::move(msg)) from OnMessage
+        // Returns false if the client is gone or it's outbound queue is over a high-water mark (see SetBackpressure)
+        // priority picks the lane of the client's outbound queue, by default the one set with SetPriority
+        bool MessageClient(connection<T, Q>* client, const message<T>& msg, message_priority priority = priority_by_id);
+        bool MessageClient(connection<T, Q>* client, message<T>&& msg, message_priority priority = priority_by_id);
+        bool MessageClient(connection<T, Q>* client, const shared_message<T>& msg, message_priority priority = priority_by_id);
+
+        // Builds the message in place, fill(message<T>&) writes it's body straight into pooled memory
+        template<typename Fill>
+        bool MessageClientEmplace(connection<T, Q>* client, T id, Fill&& fill, message_priority priority = priority_by_id);
+
+        // Looks the client up by it's getID(), returns false if no connection has this ID (anymore) or like above
+        // IDs of removed connections are not reused for a long time, so a stored ID never reaches a different client
+        bool MessageClient(uint32_t id, const message<T>& msg, message_priority priority = priority_by_id);
+        bool MessageClient(uint32_t id, message<T>&& msg, message_priority priority = priority_by_id);
+        bool MessageClient(uint32_t id, const shared_message<T>& msg, message_priority priority = priority_by_id);
 
         // This function will send a message to all clients except the @ignoreClient
-        void MessageAllClients(connection<T>* ignoreClient, const message<T>& msg);
+        // The message is copied once and shared by every connection's outbound queue
+        // priority picks the lane of every client's outbound queue like for MessageClient
+        void MessageAllClients(connection<T, Q>* ignoreClient, const message<T>& msg, message_priority priority = priority_by_id);
+        void MessageAllClients(connection<T, Q>* ignoreClient, message<T>&& msg, message_priority priority = priority_by_id);
+        void MessageAllClients(connection<T, Q>* ignoreClient, const shared_message<T>& msg, message_priority priority = priority_by_id);
+
+        // This function will send a message to every client in @clients, sharing it the same way as MessageAllClients
+        void MessageClients(const kq::vector<connection<T, Q>*>& clients, const message<T>& msg, message_priority priority = priority_by_id);
+        void MessageClients(const kq::vector<connection<T, Q>*>& clients, message<T>&& msg, message_priority priority = priority_by_id);
+        void MessageClients(const kq::vector<connection<T, Q>*>& clients, const shared_message<T>& msg, message_priority priority = priority_by_id);
 
         // nMessagesMax is the maximum amount of messages to answer to in the call to Update
-        void Update(size_t nMessagesMax = -1);
+        // bWait makes Update sleep until at least one message arrives instead of returning straight away, Stop wakes it as well
+        void Update(size_t nMessagesMax = -1, bool bWait = false);
+
+        // Sleeps until at least one message arrives or the timeout passes, then answers like Update
+        // Returns false if the timeout passed without any message
+        template<typename Rep, typename Period>
+        bool UpdateFor(const std::chrono::duration<Rep, Period>& timeout, size_t nMessagesMax = -1);
+
+        // Messages of id are handed to handler(connection<T, Q>*, message<T>&) instead of OnMessage, see dispatch.h
+        // dispatch_inline calls it on the context thread which read the message, so it must not block and may run on every thread at once
+        // Handlers are set before Start, returns false if id is too big for the table
+        bool SetHandler(T id, dispatch_mode mode, typename dispatch_table<T, Q>::handler_type handler) { return m_dispatch.set(id, mode, std::move(handler)); }
+
+        // Messages of id are queued in the lane of priority, a connection writes higher lanes first (see message_priority)
+        // Lanes are set before Start, returns false if id is too big for the table
+        bool SetPriority(T id, message_priority priority) { return m_priorities.set(id, priority); }
+
+        // Fragments of streams of id are handed to handler(connection<T, Q>*, const stream_chunk&) as they are read, on the context thread (see stream.h)
+        // Clients send them with connection<T, Q>::SendStream, set it before Start like SetHandler
+        bool SetStreamHandler(T id, stream_handler<T, Q> handler) { return m_dispatch.set(id, dispatch_inline, make_stream_dispatch<T, Q>(std::move(handler))); }
+
+        // Pool every connection reads bodies from, bodies of answered messages go back to it after OnMessage returns
+        // Messages created with GetPool()->share() are written without copying the body again
+        const std::shared_ptr<buffer_pool>& GetPool() const;
+
+        // Bodies of nBytes and more are compressed on connections whose client enabled compression as well, 0 (the default) disables it
+        // Applies to connections accepted afterwards, OnClientConnect may still change it for a single connection
+        void SetCompressionThreshold(size_t nBytes) { m_nCompressionThreshold = nBytes; }
+        size_t GetCompressionThreshold() const { return m_nCompressionThreshold; }
+
+        // Bodies bigger than nBytes close the connection before anything is allocated for them, see connection<T, Q>::SetMaxFrameSize
+        // Applies to connections accepted afterwards, nDefaultMaxFrameSize (64 MB) by default, 0 doesn't limit them
+        void SetMaxFrameSize(size_t nBytes) { m_nMaxFrameSize = nBytes; }
+        size_t GetMaxFrameSize() const { return m_nMaxFrameSize; }
+
+        // High-water marks of every connection's outbound queue, see connection<T, Q>::SetBackpressure, 0 (the default) leaves them unbounded
+        // Applies to connections accepted afterwards, OnClientConnect may still change them for a single connection
+        void SetBackpressure(size_t nMaxMessages, size_t nMaxBytes, backpressure_policy policy = backpressure_report);
+
+        // Messages and bytes waiting to be written to all clients
+        size_t GetQueuedMessages();
+        size_t GetQueuedBytes();
 
+        // Returns nullptr if no connection has this ID (anymore)
+        connection<T, Q>* GetClient(uint32_t id);
+
+        size_t GetClientCount();
+
+        // Calls f(connection<T, Q>*) for every connection, walking the contiguous connection table
+        // The table is locked meanwhile, so f must not add or remove clients
+        template<typename F>
+        void ForEachClient(F&& f);
+
+        // Counters, queue depths and histograms of the server and all it's connections, cheap enough to take every second
+        // Compiled with KQNET_METRICS 0 only the connection count and queue depths are measured
+        server_metrics GetMetrics();
 
         
 
@@ -44,60 +132,104 @@ namespace kq
             // @ msg - is a message which holds informations sent from clients to the server and should be responded to
 
             
-            virtual bool OnClientConnect(connection<T>* client) = 0;
-            virtual void OnClientDisconnect(connection<T>* client) = 0;
-            virtual void OnClientValidated(connection<T>* client) = 0;
-            virtual void OnClientUnvalidated(connection<T>* client) = 0;
-            virtual void OnMessage(connection<T>* client, message<T>& msg) = 0;
+            virtual bool OnClientConnect(connection<T, Q>* client) = 0;
+            virtual void OnClientDisconnect(connection<T, Q>* client) = 0;
+            virtual void OnClientValidated(connection<T, Q>* client) = 0;
+            virtual void OnClientUnvalidated(connection<T, Q>* client) = 0;
+            virtual void OnMessage(connection<T, Q>* client, message<T>& msg) = 0;
+
+            // Optional, called on client's strand after it's outbound queue crossed a high-water mark, no lock is held so it may kick or message clients
+            // The backpressure_disconnect policy closes the connection itself
+            virtual void OnClientBackpressure(connection<T, Q>* /*client*/) {}
             
 
     public:
-        void __RemoveClient(connection<T>* client);
+        // Take a closed client out of the table and call OnClientDisconnect / OnClientUnvalidated, returns false if it was taken out already
+        // The connection deletes itself later through __DeleteClient, from it's strand
+        bool __RemoveClient(connection<T, Q>* client);
 
-        void __RemoveUnvalidatedClient(connection<T>* client);
+        bool __RemoveUnvalidatedClient(connection<T, Q>* client);
 
+        void __DeleteClient(connection<T, Q>* client);
+
+#if KQNET_METRICS
+        server_counters& __GetCounters() { return m_counters; }
+#endif
 
     private:
-        // Queues for messages and connections
-        tsqueue<owned_message<T>> m_qMessagesIn;
-        kq::deque<connection<T>*> m_qConnections;
+        // Takes client out of m_connections, returns false if it wasn't in there (anymore)
+        // m_muxConnections must be locked
+        bool EraseClient(connection<T, Q>* client);
 
-        // Asio context and it's own thread
+        // Closes a connection of m_connections, m_muxConnections must be locked
+        void Kick(connection<T, Q>* client);
+
+        // Adds the totals of a connection about to be deleted to the server's
+        void RetireClient(connection<T, Q>* client);
+
+    private:
+        // Queues for messages and connections
+        typename Q::template queue<owned_message<T, Q>> m_qMessagesIn;
+        kq::vector<owned_message<T, Q>> m_vMessagesBatch; // Messages drained out of m_qMessagesIn by Update, only touched by the thread calling Update
+        size_t m_nMessagesBatchIndex; // Next message of m_vMessagesBatch to answer to
+        std::shared_ptr<buffer_pool> m_pool;
+        slot_map<connection<T, Q>*> m_connections; // Keyed by connection ID, the keys are the IDs
+        kq::vector<connection<T, Q>*> m_vRemovedClients; // Taken out of m_connections but not deleted yet, Stop deletes what's left
+        std::mutex m_muxConnections; // Connections are added and removed from every thread running the context
+
+        // Asio context and the threads running it
         asio::io_context m_context;
-        std::thread m_thrContext;
+        kq::vector<std::thread> m_vThreads;
+        size_t m_nThreads;
 
         // Asio acceptor, handles new connections
         asio::ip::tcp::acceptor m_acceptor;
 
-        uint32_t m_id; // ID system for connections
+        std::atomic<size_t> m_nCompressionThreshold; // Set by the user's thread, read when accepting
+        std::atomic<size_t> m_nMaxFrameSize;
+        std::atomic<size_t> m_nMaxQueuedMessages;
+        std::atomic<size_t> m_nMaxQueuedBytes;
+        std::atomic<backpressure_policy> m_backpressurePolicy;
+
+        dispatch_table<T, Q> m_dispatch; // Only read once the server started
+        priority_table<T> m_priorities; // Same
+
+#if KQNET_METRICS
+        server_counters m_counters;
+#endif
 
         uint64_t(*m_scrambleFunc)(uint64_t);
         
     }; // end of server_interface
 
-    template<typename T>
-    server_interface<T>::server_interface(uint16_t port, uint64_t(*scrambleFunc)(uint64_t))
-        : m_qMessagesIn(), m_qConnections(), m_context(), m_thrContext(),
-        m_acceptor(m_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)), m_id(1000),
-        m_scrambleFunc(scrambleFunc)
+    template<typename T, typename Q>
+    server_interface<T, Q>::server_interface(uint16_t port, uint64_t(*scrambleFunc)(uint64_t), size_t nThreads)
+        : m_qMessagesIn(), m_vMessagesBatch(), m_nMessagesBatchIndex(0), m_pool(std::make_shared<buffer_pool>()), m_connections(), m_vRemovedClients(), m_muxConnections(), m_context(static_cast<int>(nThreads)), m_vThreads(), m_nThreads(nThreads > 0 ? nThreads : 1),
+        m_acceptor(m_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+        m_nCompressionThreshold(0), m_nMaxFrameSize(nDefaultMaxFrameSize), m_nMaxQueuedMessages(0), m_nMaxQueuedBytes(0), m_backpressurePolicy(backpressure_report), m_dispatch(), m_priorities(), m_scrambleFunc(scrambleFunc)
     {}
 
-    template<typename T>
-    server_interface<T>::~server_interface()
+    template<typename T, typename Q>
+    server_interface<T, Q>::~server_interface()
     {
         Stop();
     }
 
-    template<typename T>
-    bool server_interface<T>::Start()
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::Start()
     {
+        // Stop woke the thread calling Update, it may sleep again from now on
+        m_qMessagesIn.rearm();
+
         try
         {
             // Prime the context to wait for a new connection
             WaitForClientConnection();
 
-            // After priming the context with work, start the context on it's own thread
-            m_thrContext = std::thread([this]() { m_context.run(); });
+            // After priming the context with work, start the context on it's own threads
+            // Every connection serializes it's handlers on a strand, so they can be spread across the threads
+            for (size_t i = 0; i < m_nThreads; ++i)
+                m_vThreads.push_back(std::thread([this]() { m_context.run(); }));
 
         }
         catch (std::exception& ec)
@@ -110,21 +242,39 @@ namespace kq
         return true;
     }
 
-    template<typename T>
-    void server_interface<T>::Stop()
+    template<typename T, typename Q>
+    void server_interface<T, Q>::Stop()
     {
-        for (auto& client : m_qConnections)
-            delete client;
+        // A thread sleeping in Update or UpdateFor returns, and doesn't sleep again until Start
+        m_qMessagesIn.wake();
 
+        // Stop the context first, so no handler is running while the connections are deleted
         m_context.stop();
-        if (m_thrContext.joinable())
-            m_thrContext.join();
+        for (auto& thread : m_vThreads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+        m_vThreads.clear();
+
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        for (auto& client : m_connections)
+        {
+            RetireClient(client);
+            delete client;
+        }
+        m_connections.clear();
+
+        // Their deletes were posted to the context, which won't run them anymore
+        for (auto& client : m_vRemovedClients)
+            delete client;
+        m_vRemovedClients.clear();
 
         std::cout << "[Server] Stopped!\n";
     }
 
-    template<typename T>
-    void server_interface<T>::WaitForClientConnection()
+    template<typename T, typename Q>
+    void server_interface<T, Q>::WaitForClientConnection()
     {
         m_acceptor.async_accept(
             [this](asio::error_code ec, asio::ip::tcp::socket socket) {
@@ -133,21 +283,41 @@ namespace kq
                     // We successfully got a new connection to the server
                     //std::cout << "[Server] New Connection: " << socket.remote_endpoint() << '\n';
 
-                    connection<T>* newconn = new connection<T>(connection<T>::owner::server, m_context, std::move(socket), m_qMessagesIn, m_scrambleFunc, this);
+                    connection<T, Q>* newconn = new connection<T, Q>(connection<T, Q>::owner::server, m_context, std::move(socket), m_qMessagesIn, m_scrambleFunc, this, m_pool);
+                    newconn->SetCompressionThreshold(m_nCompressionThreshold);
+                    newconn->SetMaxFrameSize(m_nMaxFrameSize);
+                    newconn->SetBackpressure(m_nMaxQueuedMessages, m_nMaxQueuedBytes, m_backpressurePolicy);
+                    newconn->__SetDispatch(&m_dispatch);
+                    newconn->__SetPriorities(&m_priorities);
                     // Give the end user the choice to accept or decline certain connections
                     if (OnClientConnect(newconn) == true)
                     {
-                        // Connection approved
-                        m_qConnections.push_back(newconn);
+                        // Connection approved, it's key in the connection table becomes it's ID
+                        uint32_t id;
+                        {
+                            std::unique_lock<std::mutex> lock(m_muxConnections);
+                            id = m_connections.insert(newconn);
+                        }
 
                         // IMPORTANT: Task the connection's context to wait for bytes to arrive
-                        m_qConnections.back()->ConnectToClient(m_id++);
+                        if (id != 0)
+                            newconn->ConnectToClient(id);
+                        else
+                            delete newconn; // The table is full
+#if KQNET_METRICS
+                        (id != 0 ? m_counters.nAccepted : m_counters.nRejected).fetch_add(1, std::memory_order_relaxed);
+#endif
 
                         //std::cout << "[" << m_qConnections.back()->getID() << "] Connection Approved!\n";
                     }
                     else
                     {
                         //std::cout << "[" << socket.remote_endpoint() << "] Connection Denied!\n";
+                        // Deleting it closes the socket, the client sees it's validation fail instead of waiting for it
+                        delete newconn;
+#if KQNET_METRICS
+                        m_counters.nRejected.fetch_add(1, std::memory_order_relaxed);
+#endif
                     }
                 }
                 else
@@ -158,87 +328,375 @@ namespace kq
             });
     }
 
-    template<typename T>
-    void server_interface<T>::KickClient(connection<T>* client)
+    template<typename T, typename Q>
+    void server_interface<T, Q>::KickClient(connection<T, Q>* client)
     {
-        __RemoveClient(client);
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>** found = m_connections.find(client->getID());
+        if (found != nullptr && *found == client)
+            Kick(client);
     }
 
-    template<typename T>
-    void server_interface<T>::MessageClient(connection<T>* client, const message<T>& msg)
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::KickClient(uint32_t id)
     {
-        if (client != nullptr && client->IsConnected() == true)
-        {
-            client->Send(msg);
-        }
-        else
-        {
-            // If we can't communicate with the client, remove it from the active connections 
-            __RemoveClient(client);
-        }
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>** client = m_connections.find(id);
+        if (client == nullptr)
+            return false;
+        Kick(*client);
+        return true;
+    }
+
+    template<typename T, typename Q>
+    void server_interface<T, Q>::Kick(connection<T, Q>* client)
+    {
+        // Only closed here, the failing read removes and deletes the connection on it's strand, so no handler is left dangling
+        client->__CountDisconnect(disconnect_kicked);
+        client->Disconnect();
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::MessageClient(connection<T, Q>* client, const message<T>& msg, message_priority priority)
+    {
+        return MessageClient(client, m_pool->share(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::MessageClient(connection<T, Q>* client, message<T>&& msg, message_priority priority)
+    {
+        return MessageClient(client, m_pool->share(std::move(msg)), priority);
+    }
+
+    template<typename T, typename Q>
+    template<typename Fill>
+    bool server_interface<T, Q>::MessageClientEmplace(connection<T, Q>* client, T id, Fill&& fill, message_priority priority)
+    {
+        return MessageClient(client, m_pool->make(id, std::forward<Fill>(fill)), priority);
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::MessageClient(connection<T, Q>* client, const shared_message<T>& msg, message_priority priority)
+    {
+        // A closed connection is removed by the handler that closed it, removing it from here would race with that handler
+        if (client == nullptr || client->IsConnected() == false)
+            return false;
+        return client->Send(msg, priority);
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::MessageClient(uint32_t id, const message<T>& msg, message_priority priority)
+    {
+        return MessageClient(id, m_pool->share(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::MessageClient(uint32_t id, message<T>&& msg, message_priority priority)
+    {
+        return MessageClient(id, m_pool->share(std::move(msg)), priority);
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::MessageClient(uint32_t id, const shared_message<T>& msg, message_priority priority)
+    {
+        // The table stays locked while sending, so the connection can't be deleted meanwhile
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>** client = m_connections.find(id);
+        if (client == nullptr)
+            return false;
+
+        // A closed connection is removed by the handler that closed it
+        if ((*client)->IsConnected() == false)
+            return false;
+        return (*client)->Send(msg, priority);
     }
 
     // This function will send a message to all clients except the @ignoreClient
-    template<typename T>
-    void server_interface<T>::MessageAllClients(connection<T>* ignoreClient, const message<T>& msg)
+    template<typename T, typename Q>
+    void server_interface<T, Q>::MessageAllClients(connection<T, Q>* ignoreClient, const message<T>& msg, message_priority priority)
+    {
+        MessageAllClients(ignoreClient, m_pool->share(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    void server_interface<T, Q>::MessageAllClients(connection<T, Q>* ignoreClient, message<T>&& msg, message_priority priority)
     {
-        bool removeClients = false;
+        MessageAllClients(ignoreClient, m_pool->share(std::move(msg)), priority);
+    }
 
-        for (auto& client : m_qConnections)
+    template<typename T, typename Q>
+    void server_interface<T, Q>::MessageAllClients(connection<T, Q>* ignoreClient, const shared_message<T>& msg, message_priority priority)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        for (auto& client : m_connections)
         {
-            if (client != nullptr && client->IsConnected() == true)
-            {
-                if (client != ignoreClient)
-                {
-                    client->Send(msg);
-                }
-            }
-            else
+            // A closed connection is removed by the handler that closed it, deleting it from here would race with that handler
+            if (client != ignoreClient && client->IsConnected() == true)
             {
-                // dont use __RemoveClient() here because it would modify the container while looping it
-                // or find a method to use it 
-                removeClients = true;
-                OnClientDisconnect(client);
-                delete client;
-                client = nullptr;
+                client->Send(msg, priority);
             }
         }
-        if (removeClients == true)
+    }
+
+    // This function will send a message to every client in @clients
+    template<typename T, typename Q>
+    void server_interface<T, Q>::MessageClients(const kq::vector<connection<T, Q>*>& clients, const message<T>& msg, message_priority priority)
+    {
+        MessageClients(clients, m_pool->share(msg), priority);
+    }
+
+    template<typename T, typename Q>
+    void server_interface<T, Q>::MessageClients(const kq::vector<connection<T, Q>*>& clients, message<T>&& msg, message_priority priority)
+    {
+        MessageClients(clients, m_pool->share(std::move(msg)), priority);
+    }
+
+    template<typename T, typename Q>
+    void server_interface<T, Q>::MessageClients(const kq::vector<connection<T, Q>*>& clients, const shared_message<T>& msg, message_priority priority)
+    {
+        for (auto& client : clients)
         {
-            std::remove(m_qConnections.begin(), m_qConnections.end(), nullptr);
+            MessageClient(client, msg, priority);
         }
     }
 
     // nMessagesMax is the maximum amount of messages to answer to in the call to Update
-    template<typename T>
-    void server_interface<T>::Update(size_t nMessagesMax)
+    template<typename T, typename Q>
+    void server_interface<T, Q>::Update(size_t nMessagesMax, bool bWait)
     {
+        if (bWait == true)
+            m_qMessagesIn.wait();
+
         size_t nMessagesCount = 0;
-        while (nMessagesCount < nMessagesMax && m_qMessagesIn.empty() == false)
+        while (nMessagesCount < nMessagesMax)
         {
-            // Get first message in queue
-            owned_message<T> msg = m_qMessagesIn.pop_front();
-            // Respond to it
-            OnMessage(msg.remote, msg.msg);
+            // Take as many messages as we may answer to with a single access to the queue
+            // The batch is a vector walked by index, so once it grew to the usual batch size draining allocates nothing
+            if (m_nMessagesBatchIndex == m_vMessagesBatch.size())
+            {
+                m_vMessagesBatch.clear();
+                m_nMessagesBatchIndex = 0;
+                if (m_qMessagesIn.drain(m_vMessagesBatch, nMessagesMax - nMessagesCount) == 0)
+                    break;
+            }
+
+            // Get first message in batch
+            owned_message<T, Q>& msg = m_vMessagesBatch[m_nMessagesBatchIndex++];
+            // Respond to it, with it's handler if the ID has one
+            const typename dispatch_table<T, Q>::entry* entry = m_dispatch.find(msg.msg.head.id);
+#if KQNET_METRICS
+            uint64_t nStart = metrics_now();
+            m_counters.queueResidence.record(nStart - std::min(msg.nQueuedAt, nStart));
+            if (entry != nullptr)
+                entry->handler(msg.remote, msg.msg);
+            else
+                OnMessage(msg.remote, msg.msg);
+            m_counters.handlerDuration.record(metrics_now() - nStart);
+#else
+            if (entry != nullptr)
+                entry->handler(msg.remote, msg.msg);
+            else
+                OnMessage(msg.remote, msg.msg);
+#endif
+            // Whatever body OnMessage left in the message goes back to the pool
+            m_pool->recycle(msg.msg);
 
             ++nMessagesCount;
         }
     }
 
-    template<typename T>
-    void server_interface<T>::__RemoveClient(connection<T>* client)
+    template<typename T, typename Q>
+    template<typename Rep, typename Period>
+    bool server_interface<T, Q>::UpdateFor(const std::chrono::duration<Rep, Period>& timeout, size_t nMessagesMax)
+    {
+        if (m_qMessagesIn.wait_for(timeout) == false)
+            return false;
+
+        Update(nMessagesMax);
+        return true;
+    }
+
+    template<typename T, typename Q>
+    const std::shared_ptr<buffer_pool>& server_interface<T, Q>::GetPool() const
+    {
+        return m_pool;
+    }
+
+    template<typename T, typename Q>
+    void server_interface<T, Q>::SetBackpressure(size_t nMaxMessages, size_t nMaxBytes, backpressure_policy policy)
+    {
+        m_nMaxQueuedMessages = nMaxMessages;
+        m_nMaxQueuedBytes = nMaxBytes;
+        m_backpressurePolicy = policy;
+    }
+
+    template<typename T, typename Q>
+    size_t server_interface<T, Q>::GetQueuedMessages()
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        size_t nMessages = 0;
+        for (auto& client : m_connections)
+            nMessages += client->GetQueuedMessages();
+        return nMessages;
+    }
+
+    template<typename T, typename Q>
+    size_t server_interface<T, Q>::GetQueuedBytes()
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        size_t nBytes = 0;
+        for (auto& client : m_connections)
+            nBytes += client->GetQueuedBytes();
+        return nBytes;
+    }
+
+    template<typename T, typename Q>
+    connection<T, Q>* server_interface<T, Q>::GetClient(uint32_t id)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        connection<T, Q>** client = m_connections.find(id);
+        return client != nullptr ? *client : nullptr;
+    }
+
+    template<typename T, typename Q>
+    size_t server_interface<T, Q>::GetClientCount()
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        return m_connections.size();
+    }
+
+    template<typename T, typename Q>
+    template<typename F>
+    void server_interface<T, Q>::ForEachClient(F&& f)
+    {
+        std::unique_lock<std::mutex> lock(m_muxConnections);
+        for (auto& client : m_connections)
+            f(client);
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::__RemoveClient(connection<T, Q>* client)
     {
+        {
+            std::unique_lock<std::mutex> lock(m_muxConnections);
+            if (EraseClient(client) == false)
+                return false;
+            m_vRemovedClients.push_back(client);
+        }
+        // The table isn't locked anymore, so the callback may message or look up the other clients
         OnClientDisconnect(client);
-        delete client;
-        std::remove(m_qConnections.begin(), m_qConnections.end(), client);
+        return true;
     }
 
-    template<typename T>
-    void server_interface<T>::__RemoveUnvalidatedClient(connection<T>* client)
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::__RemoveUnvalidatedClient(connection<T, Q>* client)
     {
+        {
+            std::unique_lock<std::mutex> lock(m_muxConnections);
+            if (EraseClient(client) == false)
+                return false;
+            m_vRemovedClients.push_back(client);
+        }
+#if KQNET_METRICS
+        m_counters.nValidationFailed.fetch_add(1, std::memory_order_relaxed);
+#endif
         OnClientUnvalidated(client);
+        return true;
+    }
+
+    template<typename T, typename Q>
+    void server_interface<T, Q>::__DeleteClient(connection<T, Q>* client)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_muxConnections);
+            auto it = std::find(m_vRemovedClients.begin(), m_vRemovedClients.end(), client);
+            if (it == m_vRemovedClients.end())
+                return;
+            *it = m_vRemovedClients.back();
+            m_vRemovedClients.pop_back();
+        }
         delete client;
-        std::remove(m_qConnections.begin(), m_qConnections.end(), client);
+    }
+
+    template<typename T, typename Q>
+    bool server_interface<T, Q>::EraseClient(connection<T, Q>* client)
+    {
+        if (client == nullptr)
+            return false;
+
+        // The slot must still hold this very connection, not one that reused it
+        connection<T, Q>** found = m_connections.find(client->getID());
+        if (found == nullptr || *found != client)
+            return false;
+        RetireClient(client);
+        return m_connections.erase(client->getID());
+    }
+
+    template<typename T, typename Q>
+    void server_interface<T, Q>::RetireClient(connection<T, Q>* client)
+    {
+#if KQNET_METRICS
+        auto read = client->GetReadStats();
+        auto write = client->GetWriteStats();
+        m_counters.nRetiredMessagesIn.fetch_add(read.nMessages, std::memory_order_relaxed);
+        m_counters.nRetiredBytesIn.fetch_add(read.nBytes, std::memory_order_relaxed);
+        m_counters.nRetiredMessagesOut.fetch_add(write.nMessages, std::memory_order_relaxed);
+        m_counters.nRetiredBytesOut.fetch_add(write.nBytes, std::memory_order_relaxed);
+#endif
+    }
+
+    template<typename T, typename Q>
+    server_metrics server_interface<T, Q>::GetMetrics()
+    {
+        server_metrics metrics;
+        metrics.nIncomingQueued = m_qMessagesIn.count();
+        {
+            std::unique_lock<std::mutex> lock(m_muxConnections);
+            metrics.nConnections = m_connections.size();
+            for (auto& client : m_connections)
+            {
+                metrics.nOutgoingQueuedMessages += client->GetQueuedMessages();
+                metrics.nOutgoingQueuedBytes += client->GetQueuedBytes();
+                for (size_t i = 0; i < priority_count; ++i)
+                    metrics.outgoingQueuedByLane[i] += client->GetLaneStats(static_cast<message_priority>(i)).nQueued;
+#if KQNET_METRICS
+                auto read = client->GetReadStats();
+                auto write = client->GetWriteStats();
+                metrics.nMessagesIn += read.nMessages;
+                metrics.nBytesIn += read.nBytes;
+                metrics.nMessagesOut += write.nMessages;
+                metrics.nBytesOut += write.nBytes;
+#endif
+            }
+        }
+
+#if KQNET_METRICS
+        metrics.nAccepted = m_counters.nAccepted.load(std::memory_order_relaxed);
+        metrics.nRejected = m_counters.nRejected.load(std::memory_order_relaxed);
+        metrics.nValidated = m_counters.nValidated.load(std::memory_order_relaxed);
+        metrics.nValidationFailed = m_counters.nValidationFailed.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < disconnect_reason_count; ++i)
+            metrics.disconnects[i] = m_counters.disconnects[i].load(std::memory_order_relaxed);
+
+        metrics.nMessagesIn += m_counters.nRetiredMessagesIn.load(std::memory_order_relaxed);
+        metrics.nBytesIn += m_counters.nRetiredBytesIn.load(std::memory_order_relaxed);
+        metrics.nMessagesOut += m_counters.nRetiredMessagesOut.load(std::memory_order_relaxed);
+        metrics.nBytesOut += m_counters.nRetiredBytesOut.load(std::memory_order_relaxed);
+        metrics.messagesInById.resize(server_counters::nIds + 1);
+        metrics.messagesOutById.resize(server_counters::nIds + 1);
+        for (size_t i = 0; i <= server_counters::nIds; ++i)
+        {
+            metrics.messagesInById[i] = m_counters.messagesInById[i].load(std::memory_order_relaxed);
+            metrics.messagesOutById[i] = m_counters.messagesOutById[i].load(std::memory_order_relaxed);
+        }
+
+        metrics.queueResidence = m_counters.queueResidence.snapshot();
+        metrics.handlerDuration = m_counters.handlerDuration.snapshot();
+        for (size_t i = 0; i < priority_count; ++i)
+            metrics.laneWait[i] = m_counters.laneWait[i].snapshot();
+#endif
+        metrics.nNanoseconds = metrics_now();
+        return metrics;
     }
 
 }// namespace kq
@@ -0,0 +1,169 @@
+#ifndef kqslotmap_
+#define kqslotmap_
+
+#include "common.h"
+
+namespace kq
+{
+    // slot_map stores values behind stable 32 bit keys with O(1) insert, erase and lookup
+    // A key is the index of a slot in it's low nIndexBits bits and the slot's generation above them
+    // Erasing bumps the generation, so the key of an erased value never finds the value that reuses it's slot
+    // Values are kept contiguous, so walking all of them (begin/end) touches no holes
+    template<typename V>
+    struct slot_map
+    {
+    public:
+        static const uint32_t nIndexBits = 20; // Up to about a million values at once
+        static const uint32_t nMaxSlots = uint32_t(1) << nIndexBits;
+        static const uint32_t nGenerationMask = (uint32_t(1) << (32 - nIndexBits)) - 1;
+
+        typedef typename kq::vector<V>::iterator iterator;
+        typedef typename kq::vector<V>::const_iterator const_iterator;
+
+        slot_map();
+
+        // Returns the key of value, or 0 if there are nMaxSlots values already, a valid key is never 0
+        uint32_t insert(const V& value);
+
+        // Returns false if key doesn't refer to a value (anymore)
+        bool erase(uint32_t key);
+
+        // Returns nullptr if key doesn't refer to a value (anymore)
+        V* find(uint32_t key);
+        const V* find(uint32_t key) const;
+
+        bool contains(uint32_t key) const { return find(key) != nullptr; }
+
+        size_t size() const { return m_vValues.size(); }
+        bool empty() const { return m_vValues.empty(); }
+
+        void clear();
+
+        // Values in no particular order, erase moves the last value into the erased one's place
+        iterator begin() { return m_vValues.begin(); }
+        iterator end() { return m_vValues.end(); }
+        const_iterator begin() const { return m_vValues.begin(); }
+        const_iterator end() const { return m_vValues.end(); }
+
+        // Value and key at position i of the dense storage
+        V& value_at(size_t i) { return m_vValues[i]; }
+        const V& value_at(size_t i) const { return m_vValues[i]; }
+        uint32_t key_at(size_t i) const { return MakeKey(m_vValueSlots[i]); }
+
+    private:
+        static const uint32_t nNone = uint32_t(-1);
+
+        struct Slot
+        {
+            uint32_t nGeneration; // Starts at 1, so no key is 0
+            uint32_t nValue; // Position in m_vValues while the slot is used, the next free slot otherwise
+            bool bUsed;
+        };
+
+        uint32_t MakeKey(uint32_t nSlot) const { return (m_vSlots[nSlot].nGeneration << nIndexBits) | nSlot; }
+
+    private:
+        kq::vector<Slot> m_vSlots;
+        kq::vector<V> m_vValues;
+        kq::vector<uint32_t> m_vValueSlots; // Slot of each value of m_vValues
+
+        // Free slots are reused first in first out, so a slot's generation wraps as late as possible
+        uint32_t m_nFreeHead;
+        uint32_t m_nFreeTail;
+    };
+
+
+    template<typename V>
+    slot_map<V>::slot_map()
+        : m_vSlots(), m_vValues(), m_vValueSlots(), m_nFreeHead(nNone), m_nFreeTail(nNone) {}
+
+    template<typename V>
+    uint32_t slot_map<V>::insert(const V& value)
+    {
+        uint32_t nSlot;
+        if (m_nFreeHead != nNone)
+        {
+            nSlot = m_nFreeHead;
+            m_nFreeHead = m_vSlots[nSlot].nValue;
+            if (m_nFreeHead == nNone)
+                m_nFreeTail = nNone;
+        }
+        else
+        {
+            if (m_vSlots.size() == nMaxSlots)
+                return 0;
+            nSlot = static_cast<uint32_t>(m_vSlots.size());
+            m_vSlots.push_back(Slot{ 1, nNone, false });
+        }
+
+        Slot& slot = m_vSlots[nSlot];
+        slot.nValue = static_cast<uint32_t>(m_vValues.size());
+        slot.bUsed = true;
+        m_vValues.push_back(value);
+        m_vValueSlots.push_back(nSlot);
+        return MakeKey(nSlot);
+    }
+
+    template<typename V>
+    bool slot_map<V>::erase(uint32_t key)
+    {
+        uint32_t nSlot = key & (nMaxSlots - 1);
+        if (find(key) == nullptr)
+            return false;
+
+        // The last value takes the place of the erased one
+        Slot& slot = m_vSlots[nSlot];
+        uint32_t nLast = static_cast<uint32_t>(m_vValues.size() - 1);
+        if (slot.nValue != nLast)
+        {
+            m_vValues[slot.nValue] = std::move(m_vValues[nLast]);
+            m_vValueSlots[slot.nValue] = m_vValueSlots[nLast];
+            m_vSlots[m_vValueSlots[slot.nValue]].nValue = slot.nValue;
+        }
+        m_vValues.pop_back();
+        m_vValueSlots.pop_back();
+
+        slot.bUsed = false;
+        slot.nGeneration = (slot.nGeneration + 1) & nGenerationMask;
+        if (slot.nGeneration == 0)
+            slot.nGeneration = 1;
+
+        slot.nValue = nNone;
+        if (m_nFreeTail != nNone)
+            m_vSlots[m_nFreeTail].nValue = nSlot;
+        else
+            m_nFreeHead = nSlot;
+        m_nFreeTail = nSlot;
+        return true;
+    }
+
+    template<typename V>
+    V* slot_map<V>::find(uint32_t key)
+    {
+        return const_cast<V*>(static_cast<const slot_map<V>*>(this)->find(key));
+    }
+
+    template<typename V>
+    const V* slot_map<V>::find(uint32_t key) const
+    {
+        uint32_t nSlot = key & (nMaxSlots - 1);
+        if (nSlot >= m_vSlots.size())
+            return nullptr;
+
+        const Slot& slot = m_vSlots[nSlot];
+        if (slot.bUsed == false || slot.nGeneration != (key >> nIndexBits))
+            return nullptr;
+        return &m_vValues[slot.nValue];
+    }
+
+    template<typename V>
+    void slot_map<V>::clear()
+    {
+        // Every used slot is erased, so keys handed out so far stay invalid
+        while (m_vValues.empty() == false)
+            erase(key_at(m_vValues.size() - 1));
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+#ifndef kqstream_
+#define kqstream_
+
+#include "common.h"
+#include "message.h"
+#include "wire.h"
+#include "metrics.h"
+#include "dispatch.h"
+
+namespace kq
+{
+    // A stream sends a payload too big to build in memory as a sequence of fragments, ordinary messages of one ID
+    // The body of a fragment is the stream number and the offset of it's data as varints, a flags byte, then the data
+    // Fragments are only built once the writer has room for them, after every queued message, so neither side holds more than a fragment per stream
+
+    enum stream_flags : uint8_t
+    {
+        stream_last = 1 // The final fragment of the stream
+    };
+
+    // Most bytes a fragment spends before it's data
+    const size_t nMaxStreamHeaderSize = 2 * nMaxVarintSize + 1;
+
+    // Data bytes per fragment unless told otherwise, the size of a connection's write batch
+    const size_t nDefaultStreamChunkSize = 64 * 1024;
+
+    // Largest body a connection reads unless SetMaxFrameSize says otherwise, bigger payloads are sent as streams
+    const size_t nDefaultMaxFrameSize = 64 * 1024 * 1024;
+
+    // Reads up to nMax bytes of the payload into pOut and returns how many, returning fewer than nMax ends the stream
+    // Called on the connection's strand whenever a fragment is due, so it must not block for long
+    typedef std::function<size_t(uint8_t* pOut, size_t nMax)> stream_source;
+
+    // A fragment as the receiver sees it, pData points into the message and is only valid during the callback
+    struct stream_chunk
+    {
+        uint64_t nStream = 0; // Numbers the streams a connection sent, from 1 up
+        uint64_t nOffset = 0; // Position of pData in the payload
+        const uint8_t* pData = nullptr;
+        size_t nSize = 0;
+        bool bLast = false;
+    };
+
+    template<typename T, typename Q>
+    using stream_handler = std::function<void(connection<T, Q>*, const stream_chunk&)>;
+
+    // A stream being sent, kept by the connection until it's last fragment was built
+    template<typename T>
+    struct outbound_stream
+    {
+        T id;
+        uint64_t nStream;
+        uint64_t nOffset;
+        size_t nChunkSize; // Data bytes per fragment
+        stream_source source;
+    };
+
+    // Writes the header of a fragment to pOut, which must hold nMaxStreamHeaderSize bytes, returns the number of bytes written
+    inline size_t encode_stream_header(uint64_t nStream, uint64_t nOffset, uint8_t flags, uint8_t* pOut)
+    {
+        size_t nSize = encode_varint(nStream, pOut);
+        nSize += encode_varint(nOffset, pOut + nSize);
+        pOut[nSize] = flags;
+        return nSize + 1;
+    }
+
+    // Reads the fragment out of the body of msg, returns false if the body isn't a fragment
+    template<typename T>
+    bool decode_stream_chunk(const message<T>& msg, stream_chunk& chunk)
+    {
+        const uint8_t* pIn = msg.body.data();
+        size_t nAvailable = msg.size();
+        size_t nStreamBytes = decode_varint(pIn, nAvailable, chunk.nStream);
+        if (nStreamBytes == 0 || nStreamBytes == size_t(-1))
+            return false;
+        size_t nOffsetBytes = decode_varint(pIn + nStreamBytes, nAvailable - nStreamBytes, chunk.nOffset);
+        if (nOffsetBytes == 0 || nOffsetBytes == size_t(-1) || nStreamBytes + nOffsetBytes == nAvailable)
+            return false;
+
+        size_t nHeadSize = nStreamBytes + nOffsetBytes + 1;
+        uint8_t flags = pIn[nHeadSize - 1];
+        if ((flags & ~stream_last) != 0)
+            return false;
+        chunk.bLast = (flags & stream_last) != 0;
+        chunk.pData = pIn + nHeadSize;
+        chunk.nSize = nAvailable - nHeadSize;
+        return true;
+    }
+
+    // Wraps handler into an inline handler of a dispatch_table, a message which isn't a fragment closes the connection
+    template<typename T, typename Q>
+    typename dispatch_table<T, Q>::handler_type make_stream_dispatch(stream_handler<T, Q> handler)
+    {
+        return [handler = std::move(handler)](connection<T, Q>* remote, message<T>& msg) {
+            stream_chunk chunk;
+            if (decode_stream_chunk(msg, chunk) == false)
+            {
+                std::cout << '[' << remote->getID() << ']' << "Stream ERROR: malformed fragment\n";
+                remote->__CountDisconnect(disconnect_malformed);
+                return remote->Disconnect();
+            }
+            handler(remote, chunk);
+        };
+    }
+
+} // namespace kq
+
+#endif
\ No newline at end of file
@@ -1,90 +1,259 @@
-#ifndef kqtsqueue_
-#define kqtsqueue_
-
-#include "common.h"
-
-namespace kq
-{
-	template<typename T>
-	class tsqueue
-	{
-	public:
-		tsqueue() = default;
-		tsqueue(const tsqueue<T>&) = delete;
-		virtual ~tsqueue() { clear(); }
-
-	public:
-		// Returns and maintains item at front of Queue
-		const T& front()
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			return deqQueue.front();
-		}
-
-		// Returns and maintains item at back of Queue
-		const T& back()
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			return deqQueue.back();
-		}
-
-		// Removes and returns item from front of Queue
-		T pop_front()
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			auto t = std::move(deqQueue.front());
-			deqQueue.pop_front();
-			return t;
-		}
-
-		// Removes and returns item from back of Queue
-		T pop_back()
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			auto t = std::move(deqQueue.back());
-			deqQueue.pop_back();
-			return t;
-		}
-
-		// Adds an item to back of Queue
-		void push_back(const T& item)
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			deqQueue.emplace_back(std::move(item));
-		}
-
-		// Adds an item to front of Queue
-		void push_front(const T& item)
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			deqQueue.emplace_front(std::move(item));
-		}
-
-		// Returns true if Queue has no items
-		bool empty()
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			return deqQueue.empty();
-		}
-
-		// Returns number of items in Queue
-		size_t count()
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			return deqQueue.size();
-		}
-
-		// Clears Queue
-		void clear()
-		{
-			std::unique_lock<std::mutex> lock(muxQueue);
-			deqQueue.clear();
-		}
-
-	protected:
-		std::mutex muxQueue;
-		kq::deque<T> deqQueue;
-	};
-}
-
+#ifndef kqtsqueue_
+#define kqtsqueue_
+
+#include "common.h"
+
+namespace kq
+{
+	// Unbounded queue guarded by a mutex, items live in a ring which doubles once it's full and never shrinks
+	// Once Queue reached it's usual depth, pushing and popping allocate nothing
+	template<typename T>
+	class tsqueue
+	{
+	public:
+		tsqueue() = default;
+		tsqueue(const tsqueue<T>&) = delete;
+		virtual ~tsqueue() { clear(); }
+
+	public:
+		// Returns and maintains item at front of Queue
+		const T& front()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			return *at(0);
+		}
+
+		// Returns and maintains item at back of Queue
+		const T& back()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			return *at(nCount - 1);
+		}
+
+		// Removes and returns item from front of Queue
+		T pop_front()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			return take_front();
+		}
+
+		// Removes and returns item from back of Queue
+		T pop_back()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			T* pItem = at(nCount - 1);
+			T t = std::move(*pItem);
+			pItem->~T();
+			--nCount;
+			return t;
+		}
+
+		// Adds a copy of an item to back of Queue
+		void push_back(const T& item)
+		{
+			emplace_back(item);
+		}
+
+		// Moves an item to back of Queue
+		void push_back(T&& item)
+		{
+			emplace_back(std::move(item));
+		}
+
+		// Queue is never full, these are here for code written against the bounded queues of lfqueue.h
+		bool try_push_back(const T& item) { push_back(item); return true; }
+		bool try_push_back(T&& item) { push_back(std::move(item)); return true; }
+
+		// Constructs an item in place at back of Queue
+		template<typename... Args>
+		void emplace_back(Args&&... args)
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			grow();
+			new (at(nCount)) T(std::forward<Args>(args)...);
+			++nCount;
+			notify(lock);
+		}
+
+		// Adds a copy of an item to front of Queue
+		void push_front(const T& item)
+		{
+			emplace_front(item);
+		}
+
+		// Moves an item to front of Queue
+		void push_front(T&& item)
+		{
+			emplace_front(std::move(item));
+		}
+
+		// Returns true if Queue has no items
+		bool empty()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			return nCount == 0;
+		}
+
+		// Returns number of items in Queue
+		size_t count()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			return nCount;
+		}
+
+		// Clears Queue, the ring is kept
+		void clear()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			for (size_t i = 0; i < nCount; ++i)
+				at(i)->~T();
+			nHead = 0;
+			nCount = 0;
+		}
+
+		// Moves up to nMax items from front of Queue to the back of out, under a single lock
+		// Returns the amount of items moved
+		template<typename Container>
+		size_t drain(Container& out, size_t nMax = -1)
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			size_t nMoved = 0;
+			while (nMoved < nMax && nCount > 0)
+			{
+				out.push_back(take_front());
+				++nMoved;
+			}
+			return nMoved;
+		}
+
+		// Blocks until Queue has at least one item or wake was called
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			++nWaiting;
+			cvBlocking.wait(lock, [this]() { return nCount > 0 || bWoken; });
+			--nWaiting;
+		}
+
+		// Blocks until Queue has at least one item, timeout passes or wake was called, returns true if Queue has items
+		template<typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			++nWaiting;
+			cvBlocking.wait_for(lock, timeout, [this]() { return nCount > 0 || bWoken; });
+			--nWaiting;
+			return nCount > 0;
+		}
+
+		// Blocks until Queue has at least one item, then removes and returns item from front of Queue
+		T wait_pop()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			++nWaiting;
+			cvBlocking.wait(lock, [this]() { return nCount > 0; });
+			--nWaiting;
+			return take_front();
+		}
+
+		// Wakes the threads in wait and wait_for, both return at once from then on until rearm, wait_pop still waits for an item
+		void wake()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			bWoken = true;
+			lock.unlock();
+			cvBlocking.notify_all();
+		}
+
+		// Lets wait and wait_for sleep again after wake
+		void rearm()
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			bWoken = false;
+		}
+
+	protected:
+		struct Slot
+		{
+			T* get() { return reinterpret_cast<T*>(&storage); }
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+		};
+
+		// Item nIndex counted from the front, muxQueue must be locked
+		T* at(size_t nIndex)
+		{
+			return pRing[(nHead + nIndex) & (nCapacity - 1)].get();
+		}
+
+		T take_front()
+		{
+			T* pItem = at(0);
+			T t = std::move(*pItem);
+			pItem->~T();
+			nHead = (nHead + 1) & (nCapacity - 1);
+			--nCount;
+			return t;
+		}
+
+		template<typename... Args>
+		void emplace_front(Args&&... args)
+		{
+			std::unique_lock<std::mutex> lock(muxQueue);
+			grow();
+			size_t nFront = (nHead + nCapacity - 1) & (nCapacity - 1);
+			new (pRing[nFront].get()) T(std::forward<Args>(args)...);
+			nHead = nFront;
+			++nCount;
+			notify(lock);
+		}
+
+		// Makes room for one more item, the only place Queue allocates
+		void grow()
+		{
+			if (nCount < nCapacity)
+				return;
+			size_t nNewCapacity = nCapacity > 0 ? nCapacity * 2 : nMinCapacity;
+			std::unique_ptr<Slot[]> pNewRing(new Slot[nNewCapacity]);
+			for (size_t i = 0; i < nCount; ++i)
+			{
+				T* pItem = at(i);
+				new (pNewRing[i].get()) T(std::move(*pItem));
+				pItem->~T();
+			}
+			pRing = std::move(pNewRing);
+			nCapacity = nNewCapacity;
+			nHead = 0;
+		}
+
+		// Wakes a waiting consumer, pushes pay for the notification only when somebody is waiting
+		void notify(std::unique_lock<std::mutex>& lock)
+		{
+			bool bWaiting = nWaiting > 0;
+			lock.unlock();
+			if (bWaiting)
+				cvBlocking.notify_one();
+		}
+
+	protected:
+		static const size_t nMinCapacity = 16; // Always a power of two
+
+		std::mutex muxQueue;
+		std::unique_ptr<Slot[]> pRing;
+		size_t nCapacity = 0;
+		size_t nHead = 0; // Slot of the front item
+		size_t nCount = 0;
+		std::condition_variable cvBlocking;
+		size_t nWaiting = 0;
+		bool bWoken = false;
+	};
+
+	// Queue policies select the queue a connection delivers incoming messages through, see lfqueue.h for the lock-free ones
+	// This is the default one, unbounded and guarded by a mutex
+	struct tsqueue_policy
+	{
+		template<typename U>
+		using queue = tsqueue<U>;
+	};
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,188 @@
+#ifndef kqwire_
+#define kqwire_
+
+#include "common.h"
+#include "message.h"
+
+namespace kq
+{
+    // A varint holds 7 bits per byte, least significant group first, with the high bit set on every byte but the last
+    const size_t nMaxVarintSize = 10; // A 64 bit varint
+
+    // Number of bytes encode_varint writes for nValue
+    inline size_t varint_size(uint64_t nValue);
+
+    // Writes nValue to pOut, which must hold nMaxVarintSize bytes, returns the number of bytes written
+    inline size_t encode_varint(uint64_t nValue, uint8_t* pOut);
+
+    // Reads a varint out of the nAvailable bytes at pIn
+    // Returns the number of bytes read, 0 if the varint is not complete yet, or -1 if the bytes are not a valid varint
+    inline size_t decode_varint(const uint8_t* pIn, size_t nAvailable, uint64_t& nValue);
+
+    // On the wire a message_header is the ID, little-endian with the width of T's underlying type,
+    // followed by the body size as a varint
+    // The layout doesn't depend on the struct, padding, or the size of size_t, so peers of any platform can talk to each other
+    template<typename T>
+    struct wire_header
+    {
+    public:
+        typedef typename std::make_unsigned<typename std::underlying_type<T>::type>::type id_type;
+
+        static const size_t nIDSize = sizeof(id_type);
+        static const size_t nMaxSizeBytes = nMaxVarintSize;
+        static const size_t nMaxSize = nIDSize + nMaxSizeBytes;
+
+        // Number of bytes encode writes for a body of nBodySize bytes
+        static size_t size(size_t nBodySize);
+
+        // Writes head to pOut, which must hold nMaxSize bytes, returns the number of bytes written
+        static size_t encode(const message_header<T>& head, uint8_t* pOut);
+
+        // Reads a header out of the nAvailable bytes at pIn
+        // Returns the number of bytes read, 0 if the header is not complete yet, or -1 if the bytes are not a valid header
+        static size_t decode(const uint8_t* pIn, size_t nAvailable, message_header<T>& head);
+
+        // Connections which negotiated compression spend the lowest bit of the size varint on a flag marking compressed frames
+        // Otherwise these behave like size, encode and decode
+        static size_t size_flagged(size_t nBodySize);
+        static size_t encode_flagged(const message_header<T>& head, bool bFlag, uint8_t* pOut);
+        static size_t decode_flagged(const uint8_t* pIn, size_t nAvailable, message_header<T>& head, bool& bFlag);
+
+    private:
+        static size_t Encode(T id, uint64_t nValue, uint8_t* pOut);
+        static size_t Decode(const uint8_t* pIn, size_t nAvailable, T& id, uint64_t& nValue);
+    };
+
+    inline size_t varint_size(uint64_t nValue)
+    {
+        size_t nBytes = 1;
+        while (nValue >= 0x80)
+        {
+            nValue >>= 7;
+            ++nBytes;
+        }
+        return nBytes;
+    }
+
+    inline size_t encode_varint(uint64_t nValue, uint8_t* pOut)
+    {
+        size_t nIndex = 0;
+        while (nValue >= 0x80)
+        {
+            pOut[nIndex++] = static_cast<uint8_t>(nValue | 0x80);
+            nValue >>= 7;
+        }
+        pOut[nIndex++] = static_cast<uint8_t>(nValue);
+        return nIndex;
+    }
+
+    inline size_t decode_varint(const uint8_t* pIn, size_t nAvailable, uint64_t& nValue)
+    {
+        uint64_t nResult = 0;
+        for (size_t i = 0; i < nMaxVarintSize; ++i)
+        {
+            if (i == nAvailable)
+                return 0;
+
+            uint8_t byte = pIn[i];
+            // The tenth byte only has room for the 64th bit
+            if (i == nMaxVarintSize - 1 && byte > 1)
+                return size_t(-1);
+            nResult |= static_cast<uint64_t>(byte & 0x7F) << (7 * i);
+            if ((byte & 0x80) == 0)
+            {
+                nValue = nResult;
+                return i + 1;
+            }
+        }
+
+        // More than 10 bytes of varint
+        return size_t(-1);
+    }
+
+    template<typename T>
+    size_t wire_header<T>::size(size_t nBodySize)
+    {
+        return nIDSize + varint_size(nBodySize);
+    }
+
+    template<typename T>
+    size_t wire_header<T>::encode(const message_header<T>& head, uint8_t* pOut)
+    {
+        return Encode(head.id, head.size, pOut);
+    }
+
+    template<typename T>
+    size_t wire_header<T>::decode(const uint8_t* pIn, size_t nAvailable, message_header<T>& head)
+    {
+        uint64_t nSize = 0;
+        size_t nHeadSize = Decode(pIn, nAvailable, head.id, nSize);
+        if (nHeadSize == 0 || nHeadSize == size_t(-1))
+            return nHeadSize;
+
+        // A size this platform can't hold in memory is as bad as a broken varint
+        if (nSize > static_cast<uint64_t>(std::numeric_limits<size_t>::max()))
+            return size_t(-1);
+
+        head.size = static_cast<size_t>(nSize);
+        return nHeadSize;
+    }
+
+    template<typename T>
+    size_t wire_header<T>::size_flagged(size_t nBodySize)
+    {
+        return nIDSize + varint_size((static_cast<uint64_t>(nBodySize) << 1) | 1);
+    }
+
+    template<typename T>
+    size_t wire_header<T>::encode_flagged(const message_header<T>& head, bool bFlag, uint8_t* pOut)
+    {
+        return Encode(head.id, (static_cast<uint64_t>(head.size) << 1) | (bFlag ? 1 : 0), pOut);
+    }
+
+    template<typename T>
+    size_t wire_header<T>::decode_flagged(const uint8_t* pIn, size_t nAvailable, message_header<T>& head, bool& bFlag)
+    {
+        uint64_t nValue = 0;
+        size_t nHeadSize = Decode(pIn, nAvailable, head.id, nValue);
+        if (nHeadSize == 0 || nHeadSize == size_t(-1))
+            return nHeadSize;
+
+        if ((nValue >> 1) > static_cast<uint64_t>(std::numeric_limits<size_t>::max()))
+            return size_t(-1);
+
+        bFlag = (nValue & 1) != 0;
+        head.size = static_cast<size_t>(nValue >> 1);
+        return nHeadSize;
+    }
+
+    template<typename T>
+    size_t wire_header<T>::Encode(T id, uint64_t nValue, uint8_t* pOut)
+    {
+        id_type nID = static_cast<id_type>(id);
+        for (size_t i = 0; i < nIDSize; ++i)
+            pOut[i] = static_cast<uint8_t>(nID >> (8 * i));
+
+        return nIDSize + encode_varint(nValue, pOut + nIDSize);
+    }
+
+    template<typename T>
+    size_t wire_header<T>::Decode(const uint8_t* pIn, size_t nAvailable, T& id, uint64_t& nValue)
+    {
+        if (nAvailable <= nIDSize)
+            return 0;
+
+        size_t nValueBytes = decode_varint(pIn + nIDSize, nAvailable - nIDSize, nValue);
+        if (nValueBytes == 0 || nValueBytes == size_t(-1))
+            return nValueBytes;
+
+        id_type nID = 0;
+        for (size_t i = 0; i < nIDSize; ++i)
+            nID |= static_cast<id_type>(static_cast<id_type>(pIn[i]) << (8 * i));
+        id = static_cast<T>(nID);
+
+        return nIDSize + nValueBytes;
+    }
+}
+
+#endif
\ No newline at end of file
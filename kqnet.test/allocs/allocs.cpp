@@ -0,0 +1,78 @@
+#include "common.h"
+#include "alloccounter.h"
+
+#include <sstream>
+
+// Counts heap allocations per echoed message once the connections are warmed up, the expected result is 0
+// Bodies come from the buffer pools of the server and the client, shared messages and posted handlers from their raw blocks
+// Both the default tsqueue policy and the lock-free ring policies are measured, tsqueue's ring only grows while warming up
+// Output is csv: policy,phase,messages,allocations,allocs_per_msg
+
+const size_t nWindow = 64; // Messages the client keeps in flight
+const size_t nBodySize = 256;
+const size_t nRounds = 5;
+const size_t nMeasured = 100000;
+
+// Echoes nMessages through the server keeping up to nInFlight of them on the way, returns the allocations made meanwhile by every thread of the program
+template<typename Q>
+uint64_t RunEcho(kq::client_interface<msgids, Q>& client, const kq::message<msgids>& msg, size_t nMessages, size_t nInFlight)
+{
+    uint64_t nStart = AllocationCount();
+    EchoWindow(client, msg, nMessages, nInFlight);
+    return AllocationCount() - nStart;
+}
+
+// Returns the allocations of every steady round together
+template<typename ServerQ, typename ClientQ>
+uint64_t Measure(std::stringstream& results, const char* name, uint16_t port)
+{
+    uint64_t nSteady = 0;
+    echoServer<ServerQ> server(port);
+    server.Run();
+
+    kq::client_interface<msgids, ClientQ> client(scramble);
+    if (client.Connect("127.0.0.1", port))
+    {
+        kq::message<msgids> msg(msgids::Transmitted);
+        for (size_t i = 0; i < nBodySize / sizeof(uint64_t); ++i)
+            msg << uint64_t(i);
+
+        // The pools are filled for far more messages than the window lets be in flight, so they never grow while measuring
+        server.GetPool()->reserve(nBodySize, nWindow * 8);
+        client.GetPool()->reserve(nBodySize, nWindow * 8);
+
+        // Bursts of 4 windows grow the queues, batches and asio's handler caches past what a single window needs
+        size_t nWarmup = 10000;
+        uint64_t nAllocations = RunEcho(client, msg, nWarmup, nWindow * 4);
+        results << name << ",warmup," << nWarmup << ',' << nAllocations << ',' << double(nAllocations) / nWarmup << '\n';
+
+        for (size_t nRound = 0; nRound < nRounds; ++nRound)
+        {
+            nAllocations = RunEcho(client, msg, nMeasured, nWindow);
+            nSteady += nAllocations;
+            results << name << ",steady" << nRound << ',' << nMeasured << ',' << nAllocations << ',' << double(nAllocations) / nMeasured << '\n';
+        }
+    }
+    else
+    {
+        results << name << ",failed,,,\n";
+        nSteady = uint64_t(-1);
+    }
+
+    server.Halt();
+    return nSteady;
+}
+
+int main()
+{
+    // Teardown prints connection errors, so the results are printed once servers and clients are gone
+    std::stringstream results;
+    results << "policy,phase,messages,allocations,allocs_per_msg\n";
+
+    uint64_t nTsqueue = Measure<kq::tsqueue_policy, kq::tsqueue_policy>(results, "tsqueue", 60200);
+    uint64_t nLockFree = Measure<kq::mpsc_policy<>, kq::spsc_policy<>>(results, "lockfree", 60201);
+
+    // Exits with 0 only if no steady round of either policy allocated at all
+    std::cout << results.str();
+    return nTsqueue == 0 && nLockFree == 0 ? 0 : 1;
+}
\ No newline at end of file
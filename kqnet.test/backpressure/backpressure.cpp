@@ -0,0 +1,177 @@
+#include "common.h"
+
+#include <sstream>
+
+// Fills the outbound queue of a client which stopped reading and checks what every backpressure policy did with it
+// The client's incoming queue only has room for a few messages, once it's full the client doesn't read from the socket anymore
+// The last run kicks the client from OnClientBackpressure while broadcasting, which holds the server's connection table
+// Output is csv: policy,sent,refused,dropped,queued,backpressure_calls,disconnected,result
+
+const size_t nMaxQueued = 16; // High-water mark of the server's outbound queues, in messages
+const size_t nBurst = 2000;
+const size_t nBodySize = 1024 * 1024; // The marks hold more than the socket buffers, so the queue stays full
+
+// Holds 4 messages, so the client stalls after a few of them arrived
+typedef kq::spsc_policy<4> stalledPolicy;
+
+struct backpressureServer : public kq::server_interface<msgids>
+{
+    backpressureServer(uint16_t port) : kq::server_interface<msgids>(port, scramble) {}
+
+    bool OnClientConnect(kq::connection<msgids>* client) { return true; }
+    void OnClientDisconnect(kq::connection<msgids>* client) { m_bDisconnected = true; }
+    void OnClientValidated(kq::connection<msgids>* client) { m_nClient = client->getID(); m_bValidated = true; }
+    void OnClientUnvalidated(kq::connection<msgids>* client) {}
+    void OnMessage(kq::connection<msgids>* client, kq::message<msgids>& msg) {}
+
+    void OnClientBackpressure(kq::connection<msgids>* client)
+    {
+        m_nBackpressure++;
+        if (m_bKick)
+            KickClient(client);
+    }
+
+    bool m_bKick = false;
+    std::atomic<uint32_t> m_nClient{ 0 };
+    std::atomic<bool> m_bValidated{ false };
+    std::atomic<bool> m_bDisconnected{ false };
+    std::atomic<size_t> m_nBackpressure{ 0 };
+};
+
+// Waits up to a few seconds for check() to hold
+template<typename Check>
+bool WaitFor(Check check)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (check() == false)
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Returns false if the policy didn't do what it should have
+bool Run(std::stringstream& results, const char* name, kq::backpressure_policy policy, uint16_t port)
+{
+    backpressureServer server(port);
+    server.SetBackpressure(nMaxQueued, 0, policy);
+    server.Start();
+
+    bool bPassed = false;
+    size_t nRefused = 0;
+    uint64_t nDropped = 0;
+    size_t nQueued = 0;
+    bool bDisconnected = false;
+    // The client is deleted after the server stopped, like in scaling
+    kq::client_interface<msgids, stalledPolicy>* pClient = new kq::client_interface<msgids, stalledPolicy>(scramble);
+    {
+        kq::client_interface<msgids, stalledPolicy>& client = *pClient;
+        kq::message<msgids> msg(msgids::Transmitted);
+        msg.body.resize(nBodySize);
+        msg.head.size = msg.size();
+        kq::shared_message<msgids> shared = kq::make_shared_message(msg);
+
+        // The client's own queue isn't bounded, so it accepts what it sends
+        bool bClientSent = client.Connect("127.0.0.1", port) && WaitFor([&]() { return server.m_bValidated == true; }) && client.Send(shared);
+
+        // Sent by ID, the connection may already be deleted once the disconnect policy closed it
+        for (size_t i = 0; bClientSent && i < nBurst; ++i)
+        {
+            if (server.MessageClient(server.m_nClient, shared) == false)
+                nRefused++;
+        }
+
+        // The posted sends are done once the queue stopped changing, the client doesn't read anything meanwhile
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        server.ForEachClient([&](kq::connection<msgids>* c) {
+            nDropped = c->GetDroppedMessages();
+            nQueued = c->GetQueuedMessages();
+            });
+
+        switch (policy)
+        {
+        case kq::backpressure_report:
+            // Everything is queued, every send over the mark returned false
+            bPassed = nRefused > 0 && nDropped == 0 && nQueued > nMaxQueued;
+            break;
+        case kq::backpressure_drop_newest:
+            // Every refused send was dropped, nothing over the mark was queued
+            bPassed = nRefused > 0 && nDropped == nRefused && nQueued <= nMaxQueued;
+            break;
+        case kq::backpressure_drop_oldest:
+            // Every send was queued, older messages made room for it
+            bPassed = nRefused == 0 && nDropped > 0;
+            break;
+        case kq::backpressure_disconnect:
+            bPassed = nRefused > 0 && WaitFor([&]() { return server.m_bDisconnected == true; });
+            break;
+        }
+        bPassed = bPassed && bClientSent && server.m_nBackpressure > 0;
+        bDisconnected = server.m_bDisconnected;
+        bPassed = bPassed && (policy == kq::backpressure_disconnect || bDisconnected == false);
+
+        client.Disconnect();
+        bPassed = bPassed && client.Send(shared) == false;
+    }
+
+    results << name << ',' << nBurst << ',' << nRefused << ',' << nDropped << ',' << nQueued << ',' << server.m_nBackpressure << ','
+        << bDisconnected << ',' << (bPassed ? "passed" : "failed") << '\n';
+
+    server.Stop();
+    delete pClient;
+    return bPassed;
+}
+
+// Returns false if the client wasn't kicked, the broadcasts lock the connection table the kick locks as well
+bool RunKick(std::stringstream& results, uint16_t port)
+{
+    backpressureServer server(port);
+    server.m_bKick = true;
+    server.SetBackpressure(nMaxQueued, 0, kq::backpressure_report);
+    server.Start();
+
+    bool bPassed = false;
+    kq::client_interface<msgids, stalledPolicy>* pClient = new kq::client_interface<msgids, stalledPolicy>(scramble);
+    {
+        kq::client_interface<msgids, stalledPolicy>& client = *pClient;
+        kq::message<msgids> msg(msgids::Transmitted);
+        msg.body.resize(nBodySize);
+        msg.head.size = msg.size();
+        kq::shared_message<msgids> shared = kq::make_shared_message(msg);
+
+        if (client.Connect("127.0.0.1", port) && WaitFor([&]() { return server.m_bValidated == true; }))
+        {
+            // Once kicked the client is skipped by the remaining broadcasts
+            for (size_t i = 0; i < nBurst; ++i)
+                server.MessageAllClients(nullptr, shared);
+            bPassed = WaitFor([&]() { return server.m_bDisconnected == true; }) && server.m_nBackpressure > 0;
+        }
+        client.Disconnect();
+    }
+
+    results << "kick_from_callback," << nBurst << ",,,," << server.m_nBackpressure << ',' << server.m_bDisconnected << ','
+        << (bPassed ? "passed" : "failed") << '\n';
+
+    server.Stop();
+    delete pClient;
+    return bPassed;
+}
+
+int main()
+{
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "policy,sent,refused,dropped,queued,backpressure_calls,disconnected,result\n";
+
+    bool bPassed = Run(results, "report", kq::backpressure_report, 60800);
+    bPassed = Run(results, "drop_newest", kq::backpressure_drop_newest, 60801) && bPassed;
+    bPassed = Run(results, "drop_oldest", kq::backpressure_drop_oldest, 60802) && bPassed;
+    bPassed = Run(results, "disconnect", kq::backpressure_disconnect, 60803) && bPassed;
+    bPassed = RunKick(results, 60804) && bPassed;
+
+    // Exits with 0 only if every policy passed and the kick didn't deadlock
+    std::cout << results.str();
+    return bPassed ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,330 @@
+#include "common.h"
+
+#include <sstream>
+#include <cstdlib>
+
+// Loopback benchmarks of server_interface and client_interface in one process, to compare results across commits
+//   size:    echo with 4 clients and body sizes from 0 B to 1 MB
+//   clients: echo of 64 B bodies with 1 to 10000 connections of one multi_client_interface, the first argument can lower the maximum
+//   fanout:  MessageAllClients to 1 to 1000 clients, latency is from the broadcast to the client taking the message out of it's queue
+// Latency is the round trip from Send to the client taking the echo out of it's queue, measured with a kq::histogram
+// Output is csv: suite,bytes,clients,messages,seconds,msgs_per_sec,MB_per_sec,p50_us,p99_us,p999_us
+
+struct benchResult
+{
+    bool bOk = false;
+    size_t nMessages = 0; // Messages received by the clients
+    double seconds = 0;
+    kq::histogram_snapshot latency;
+};
+
+// A connected client and the send times of it's messages in flight, echoes come back in the order they were sent
+struct benchClient
+{
+    kq::client_interface<msgids>* client = nullptr;
+    uint32_t id = 0; // Or the ID of a connection of a multi_client_interface
+    kq::vector<uint64_t> sendTimes; // Ring of nWindow send times
+    size_t nSent = 0;
+    size_t nReceived = 0;
+};
+
+const size_t nMaxDrivers = 8; // Threads sending and receiving for the clients
+
+bool ConnectClients(kq::vector<benchClient>& clients, uint16_t port, size_t nWindow)
+{
+    // Every client connects at once, then all results are waited for
+    kq::vector<std::future<kq::connect_result>> results;
+    for (auto& client : clients)
+    {
+        client.client = new kq::client_interface<msgids>(scramble);
+        client.sendTimes.resize(nWindow);
+        results.push_back(client.client->ConnectAsync("127.0.0.1", port));
+    }
+
+    bool bConnected = true;
+    for (auto& result : results)
+        bConnected = result.get() == kq::connect_success && bConnected;
+    return bConnected;
+}
+
+void DeleteClients(kq::vector<benchClient>& clients)
+{
+    for (auto& client : clients)
+        delete client.client;
+}
+
+// Splits the clients over up to nMaxDrivers threads running work(first, last)
+template<typename Work>
+void RunDrivers(size_t nClients, Work work)
+{
+    size_t nDrivers = std::min(nClients, nMaxDrivers);
+    kq::vector<std::thread> drivers;
+    for (size_t i = 0; i < nDrivers; ++i)
+        drivers.push_back(std::thread(work, nClients * i / nDrivers, nClients * (i + 1) / nDrivers));
+    for (auto& driver : drivers)
+        driver.join();
+}
+
+benchResult RunEcho(uint16_t port, size_t nClients, size_t nBodySize, size_t nMessagesPerClient, size_t nWindow)
+{
+    benchResult result;
+    echoServer<> server(port);
+    server.Run();
+
+    kq::vector<benchClient> clients(nClients);
+    if (ConnectClients(clients, port, nWindow) == false)
+    {
+        DeleteClients(clients);
+        return result;
+    }
+
+    kq::message<msgids> msg(msgids::Transmitted);
+    msg.body.resize(nBodySize);
+    msg.head.size = msg.size();
+
+    kq::histogram latency;
+    auto start = std::chrono::steady_clock::now();
+
+    RunDrivers(nClients, [&](size_t nFirst, size_t nLast) {
+        size_t nDone = 0;
+        while (nDone < nLast - nFirst)
+        {
+            bool bProgress = false;
+            nDone = 0;
+            for (size_t i = nFirst; i < nLast; ++i)
+            {
+                benchClient& client = clients[i];
+                while (client.nSent < nMessagesPerClient && client.nSent - client.nReceived < nWindow)
+                {
+                    client.sendTimes[client.nSent % nWindow] = kq::metrics_now();
+                    client.client->Send(msg);
+                    ++client.nSent;
+                    bProgress = true;
+                }
+                while (client.client->Incoming().empty() == false)
+                {
+                    auto echo = client.client->Incoming().pop_front();
+                    latency.record(kq::metrics_now() - client.sendTimes[client.nReceived % nWindow]);
+                    client.client->Recycle(echo.msg);
+                    ++client.nReceived;
+                    bProgress = true;
+                }
+                if (client.nReceived == nMessagesPerClient)
+                    ++nDone;
+            }
+            if (bProgress == false)
+                std::this_thread::yield();
+        }
+        });
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.nMessages = nClients * nMessagesPerClient;
+    result.latency = latency.snapshot();
+    result.bOk = true;
+    DeleteClients(clients);
+    return result;
+}
+
+// Like RunEcho, with all connections in one multi_client_interface driven by a single thread
+benchResult RunEchoMany(uint16_t port, size_t nConnections, size_t nBodySize, size_t nMessagesPerConnection, size_t nWindow)
+{
+    benchResult result;
+    echoServer<> server(port);
+    server.Run();
+
+    kq::multi_client_interface<msgids> clients(scramble, 2);
+    kq::vector<benchClient> connections(nConnections);
+    for (auto& connection : connections)
+    {
+        connection.sendTimes.resize(nWindow);
+        connection.id = clients.Connect("127.0.0.1", port);
+        if (connection.id == 0)
+            return result;
+    }
+    // The run fails if a connection failed, or none validated for a while, e.g. when the process ran out of sockets
+    size_t nConnected = 0;
+    auto lastProgress = std::chrono::steady_clock::now();
+    while (nConnected < nConnections)
+    {
+        if (clients.GetConnectionCount() < nConnections || std::chrono::steady_clock::now() - lastProgress > std::chrono::seconds(5))
+            return result;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        size_t nNow = clients.GetConnectedCount();
+        if (nNow != nConnected)
+            lastProgress = std::chrono::steady_clock::now();
+        nConnected = nNow;
+    }
+
+    // The low bits of a connection's ID are it's slot, echoes find the state of their connection through it
+    const uint32_t nSlotMask = kq::slot_map<kq::connection<msgids>*>::nMaxSlots - 1;
+    kq::vector<size_t> slots;
+    for (size_t i = 0; i < nConnections; ++i)
+    {
+        uint32_t nSlot = connections[i].id & nSlotMask;
+        if (slots.size() <= nSlot)
+            slots.resize(nSlot + 1);
+        slots[nSlot] = i;
+    }
+
+    kq::message<msgids> msg(msgids::Transmitted);
+    msg.body.resize(nBodySize);
+    msg.head.size = msg.size();
+    kq::shared_message<msgids> shared = clients.GetPool()->share(msg);
+
+    kq::histogram latency;
+    auto send = [&](size_t i) {
+        benchClient& connection = connections[i];
+        while (connection.nSent < nMessagesPerConnection && connection.nSent - connection.nReceived < nWindow)
+        {
+            connection.sendTimes[connection.nSent % nWindow] = kq::metrics_now();
+            clients.Send(connection.id, shared);
+            ++connection.nSent;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nConnections; ++i)
+        send(i);
+
+    size_t nRemaining = nConnections * nMessagesPerConnection;
+    while (nRemaining > 0)
+    {
+        auto echo = clients.Incoming().wait_pop();
+        size_t i = slots[echo.remote->getID() & nSlotMask];
+        benchClient& connection = connections[i];
+        latency.record(kq::metrics_now() - connection.sendTimes[connection.nReceived % nWindow]);
+        clients.Recycle(echo.msg);
+        ++connection.nReceived;
+        --nRemaining;
+        send(i);
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.nMessages = nConnections * nMessagesPerConnection;
+    result.latency = latency.snapshot();
+    result.bOk = true;
+    return result;
+}
+
+benchResult RunFanout(uint16_t port, size_t nClients, size_t nBodySize, size_t nBroadcasts, size_t nWindow)
+{
+    benchResult result;
+    echoServer<> server(port);
+    server.Run();
+
+    kq::vector<benchClient> clients(nClients);
+    if (ConnectClients(clients, port, 1) == false)
+    {
+        DeleteClients(clients);
+        return result;
+    }
+    // MessageAllClients only reaches validated connections, the last client may not be validated on the server's side yet
+    while (server.nValidated < nClients)
+        std::this_thread::yield();
+
+    kq::message<msgids> msg(msgids::Received);
+    msg.body.resize(nBodySize);
+    msg.head.size = msg.size();
+
+    // Every client receives the broadcasts in order, so the n-th message it receives was broadcast at broadcastTimes[n]
+    std::unique_ptr<std::atomic<uint64_t>[]> broadcastTimes(new std::atomic<uint64_t>[nBroadcasts]);
+    std::atomic<size_t> nDelivered(0);
+    kq::histogram latency;
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread broadcaster([&]() {
+        for (size_t i = 0; i < nBroadcasts; ++i)
+        {
+            // Keep no more than nWindow broadcasts in flight to each client
+            while (i >= nWindow && nDelivered.load() < (i - nWindow + 1) * nClients)
+                std::this_thread::yield();
+            broadcastTimes[i] = kq::metrics_now();
+            server.MessageAllClients(nullptr, msg);
+        }
+        });
+
+    RunDrivers(nClients, [&](size_t nFirst, size_t nLast) {
+        size_t nDone = 0;
+        while (nDone < nLast - nFirst)
+        {
+            bool bProgress = false;
+            nDone = 0;
+            for (size_t i = nFirst; i < nLast; ++i)
+            {
+                benchClient& client = clients[i];
+                while (client.client->Incoming().empty() == false)
+                {
+                    auto received = client.client->Incoming().pop_front();
+                    latency.record(kq::metrics_now() - broadcastTimes[client.nReceived].load());
+                    client.client->Recycle(received.msg);
+                    ++client.nReceived;
+                    nDelivered.fetch_add(1);
+                    bProgress = true;
+                }
+                if (client.nReceived == nBroadcasts)
+                    ++nDone;
+            }
+            if (bProgress == false)
+                std::this_thread::yield();
+        }
+        });
+    broadcaster.join();
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.nMessages = nClients * nBroadcasts;
+    result.latency = latency.snapshot();
+    result.bOk = true;
+    DeleteClients(clients);
+    return result;
+}
+
+void PrintResult(std::stringstream& results, const char* suite, size_t nBodySize, size_t nClients, const benchResult& result)
+{
+    results << suite << ',' << nBodySize << ',' << nClients << ',';
+    if (result.bOk == false)
+    {
+        results << "failed,,,,,,\n";
+        return;
+    }
+    double nBytes = double(result.nMessages) * (kq::wire_header<msgids>::size(nBodySize) + nBodySize);
+    results << result.nMessages << ',' << result.seconds << ',' << result.nMessages / result.seconds << ',' << nBytes / result.seconds / (1024 * 1024) << ','
+        << result.latency.percentile(50) / 1000.0 << ',' << result.latency.percentile(99) / 1000.0 << ',' << result.latency.percentile(99.9) / 1000.0 << '\n';
+}
+
+int main(int argc, char** argv)
+{
+    size_t nMaxClients = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "suite,bytes,clients,messages,seconds,msgs_per_sec,MB_per_sec,p50_us,p99_us,p999_us\n";
+
+    // Below the ephemeral ports of Linux and Windows, thousands of client sockets would otherwise take some of the ports of later runs
+    uint16_t port = 30200;
+    for (size_t nBodySize : { 0, 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 })
+    {
+        // About 64 MB per run and 4 MB in flight per client, but at least a few hundred messages
+        size_t nMessages = std::max<size_t>(std::min<size_t>(20000, (64 << 20) / (nBodySize + 64) / 4), 256);
+        size_t nWindow = std::max<size_t>(std::min<size_t>(256, (4 << 20) / (nBodySize + 64)), 2);
+        PrintResult(results, "size", nBodySize, 4, RunEcho(port++, 4, nBodySize, nMessages, nWindow));
+    }
+
+    for (size_t nClients : { 1, 10, 100, 1000, 10000 })
+    {
+        if (nClients > nMaxClients)
+            break;
+        size_t nMessages = std::max<size_t>(200000 / nClients, 20);
+        PrintResult(results, "clients", 64, nClients, RunEchoMany(port++, nClients, 64, nMessages, 16));
+    }
+
+    for (size_t nClients : { 1, 10, 100, 1000 })
+    {
+        if (nClients > nMaxClients)
+            break;
+        size_t nBroadcasts = std::max<size_t>(200000 / nClients, 200);
+        PrintResult(results, "fanout", 64, nClients, RunFanout(port++, nClients, 64, nBroadcasts, 16));
+    }
+
+    std::cout << results.str();
+    return 0;
+}
\ No newline at end of file
@@ -7,13 +7,15 @@ int main()
 
     while(true)
     {
-        std::this_thread::sleep_for(std::chrono::seconds(2));
         client.Send(kq::message<msgids>{msgids::Transmitted});
 
-        if(!client.Incoming().empty())
+        // Sleep until the answer arrives, but send again after 2 seconds either way
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        if(client.Incoming().wait_for(std::chrono::seconds(2)))
         {
             auto msg = client.Incoming().pop_front().msg;
             std::cout << "I got this message: " << msg.getID() << "\n";
         }
+        std::this_thread::sleep_until(deadline);
     }
 }
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef kqalloccounter_
+#define kqalloccounter_
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counts every call to the global operator new of the program
+// Replaces the global allocation functions, so include it from a single translation unit
+
+// Inlined into a delete expression, the malloc and free inside would look mismatched with the new expression to the compiler
+#if defined(_MSC_VER)
+#define KQ_ALLOC_NOINLINE __declspec(noinline)
+#elif defined(__GNUC__)
+#define KQ_ALLOC_NOINLINE __attribute__((noinline))
+#else
+#define KQ_ALLOC_NOINLINE
+#endif
+
+std::atomic<uint64_t> g_nAllocations(0);
+
+KQ_ALLOC_NOINLINE void* operator new(size_t nBytes)
+{
+    g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(nBytes > 0 ? nBytes : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+KQ_ALLOC_NOINLINE void* operator new[](size_t nBytes)
+{
+    return operator new(nBytes);
+}
+
+KQ_ALLOC_NOINLINE void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+KQ_ALLOC_NOINLINE void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+// The sized forms go through the unsized ones, so every delete pairs with the operator new above
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    operator delete[](p);
+}
+
+uint64_t AllocationCount()
+{
+    return g_nAllocations.load(std::memory_order_relaxed);
+}
+
+#endif
\ No newline at end of file
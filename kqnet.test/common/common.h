@@ -12,4 +12,100 @@ uint64_t scramble(uint64_t input)
     auto out = input ^ 0x5A9B6C2F0F011;
     out = (out & 0xF0F0F0F0F0F0F0) >> 4;
     return out;
+}
+
+// Answers every message with it's own body as Received, counts the validated clients and keeps the last of them
+template<typename Q = kq::tsqueue_policy>
+struct echoServer : public kq::server_interface<msgids, Q>
+{
+    echoServer(uint16_t port, size_t nThreads = 1) : kq::server_interface<msgids, Q>(port, scramble, nThreads), nValidated(0), lastClient(nullptr), bRunning(false) {}
+
+    ~echoServer()
+    {
+        Halt();
+    }
+
+    bool OnClientConnect(kq::connection<msgids, Q>* client) { return true; }
+    void OnClientDisconnect(kq::connection<msgids, Q>* client) {}
+    void OnClientValidated(kq::connection<msgids, Q>* client) { lastClient = client; ++nValidated; }
+    void OnClientUnvalidated(kq::connection<msgids, Q>* client) {}
+
+    void OnMessage(kq::connection<msgids, Q>* client, kq::message<msgids>& msg)
+    {
+        msg.getID() = msgids::Received;
+        this->MessageClient(client, std::move(msg));
+    }
+
+    // Starts the server and a thread calling Update until Halt, which the destructor calls as well
+    void Run();
+
+    void Halt();
+
+    std::atomic<size_t> nValidated;
+    std::atomic<kq::connection<msgids, Q>*> lastClient;
+    std::atomic<bool> bRunning;
+    std::thread updater;
+};
+
+template<typename Q>
+void echoServer<Q>::Run()
+{
+    this->Start();
+    bRunning = true;
+    updater = std::thread([this]() {
+        while (bRunning)
+            this->UpdateFor(std::chrono::milliseconds(100));
+        });
+}
+
+template<typename Q>
+void echoServer<Q>::Halt()
+{
+    if (updater.joinable())
+    {
+        bRunning = false;
+        updater.join();
+    }
+    this->Stop();
+}
+
+// Connects client to the echo server and waits until the server validated it as well, returns false if connecting failed
+template<typename ServerQ, typename ClientQ>
+bool ConnectEcho(kq::client_interface<msgids, ClientQ>& client, echoServer<ServerQ>& server, uint16_t port)
+{
+    size_t nValidated = server.nValidated;
+    if (client.Connect("127.0.0.1", port) == false)
+        return false;
+    while (server.nValidated == nValidated)
+        std::this_thread::yield();
+    return true;
+}
+
+// Sends msg nMessages times keeping up to nWindow of them in flight, every echo is taken out of the client's queue and recycled
+// latency, if given, records the round trip of every message, echoes come back in the order they were sent
+template<typename Q, typename Message>
+void EchoWindow(kq::client_interface<msgids, Q>& client, const Message& msg, size_t nMessages, size_t nWindow, kq::histogram* latency = nullptr)
+{
+    // Left empty without latency, so the loop doesn't allocate
+    kq::vector<uint64_t> sendTimes;
+    if (latency != nullptr)
+        sendTimes.resize(nWindow);
+
+    size_t nSent = 0, nReceived = 0;
+    while (nReceived < nMessages)
+    {
+        while (nSent < nMessages && nSent - nReceived < nWindow)
+        {
+            if (latency != nullptr)
+                sendTimes[nSent % nWindow] = kq::metrics_now();
+            client.Send(msg);
+            ++nSent;
+        }
+        // There is always at least one message in flight here
+        kq::owned_message<msgids, Q> echo = client.Incoming().wait_pop();
+        if (latency != nullptr)
+            latency->record(kq::metrics_now() - sendTimes[nReceived % nWindow]);
+        client.Recycle(echo.msg);
+        ++nReceived;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,187 @@
+#include "common.h"
+
+#include <sstream>
+#include <random>
+
+// Measures lz_codec on its own, then echo throughput over the loopback with compression off and on
+// Payloads are synthetic: "state" is an array of slowly changing entity records, like a bulk state update, "random" doesn't compress at all
+// Output is csv, one table per part:
+// payload,body_size,ratio,compress_MB_per_sec,decompress_MB_per_sec
+// payload,body_size,threshold,messages,seconds,msgs_per_sec,wire_MB,ratio,compress_ms,decompress_ms
+
+struct entityRecord
+{
+    uint32_t id;
+    float x, y, z;
+    uint16_t health;
+    uint16_t flags;
+};
+
+kq::vector<uint8_t> MakePayload(const std::string& payload, size_t nSize)
+{
+    kq::vector<uint8_t> body(nSize);
+    if (payload == "state")
+    {
+        entityRecord record = { 0, 0.0f, 0.0f, 0.0f, 100, 0 };
+        for (size_t i = 0; i + sizeof(record) <= nSize; i += sizeof(record))
+        {
+            record.id++;
+            record.x += 0.25f;
+            record.health = uint16_t(100 - (record.id % 3));
+            std::memcpy(body.data() + i, &record, sizeof(record));
+        }
+    }
+    else
+    {
+        std::mt19937 rng(42);
+        for (auto& byte : body)
+            byte = uint8_t(rng());
+    }
+    return body;
+}
+
+// Returns false if the body didn't survive the round trip
+bool RunCodec(std::stringstream& results, const std::string& payload, size_t nSize)
+{
+    kq::vector<uint8_t> body = MakePayload(payload, nSize);
+    kq::vector<uint8_t> block(kq::lz_codec::bound(nSize));
+    kq::vector<uint8_t> restored(nSize);
+    size_t nIterations = std::max<size_t>(1, (256 * 1024 * 1024) / nSize / 8);
+
+    size_t nBlock = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nIterations; ++i)
+        nBlock = kq::lz_codec::compress(body.data(), nSize, block.data(), block.size());
+    double compressSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nIterations; ++i)
+        kq::lz_codec::decompress(block.data(), nBlock, restored.data(), nSize);
+    double decompressSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (std::memcmp(body.data(), restored.data(), nSize) != 0)
+    {
+        std::cout << "Round trip mismatch for " << payload << '\n';
+        return false;
+    }
+
+    double nMB = double(nSize) * nIterations / (1024 * 1024);
+    results << payload << ',' << nSize << ',' << double(nSize) / nBlock << ',' << nMB / compressSeconds << ',' << nMB / decompressSeconds << '\n';
+    return true;
+}
+
+// Every block here is malformed, decompress has to reject it without reading or writing past the buffers
+// Returns false if any of them was accepted
+bool RunMalformed()
+{
+    const size_t nSize = 16 * 1024;
+    kq::vector<uint8_t> body = MakePayload("state", nSize);
+    kq::vector<uint8_t> block(kq::lz_codec::bound(nSize));
+    block.resize(kq::lz_codec::compress(body.data(), nSize, block.data(), block.size()));
+    kq::vector<uint8_t> restored(nSize + 1);
+
+    struct malformedCase
+    {
+        const char* name;
+        kq::vector<uint8_t> block;
+        size_t nOut;
+    };
+    // 0x10 is one literal and a match of 4, 0x1F one literal and a match length continued in the next bytes
+    kq::vector<malformedCase> cases = {
+        { "empty", {}, nSize },
+        { "truncated", kq::vector<uint8_t>(block.begin(), block.begin() + block.size() / 2), nSize },
+        { "short_output", block, nSize - 1 },
+        { "long_output", block, nSize + 1 },
+        { "offset_zero", { 0x10, 'a', 0x00, 0x00 }, 5 },
+        { "offset_past_start", { 0x10, 'a', 0x02, 0x00 }, 5 },
+        { "missing_offset", { 0x10, 'a', 0x01 }, 5 },
+        { "missing_length", { 0x1F, 'a', 0x01, 0x00, 0xFF }, 300 },
+        { "literals_past_input", { 0x50, 'a', 'b' }, 5 },
+    };
+
+    bool bPassed = true;
+    for (const malformedCase& c : cases)
+    {
+        size_t nResult = kq::lz_codec::decompress(c.block.data(), c.block.size(), restored.data(), c.nOut);
+        if (nResult != size_t(-1))
+        {
+            std::cout << "Malformed block " << c.name << " was accepted\n";
+            bPassed = false;
+        }
+    }
+    return bPassed;
+}
+
+const size_t nMessages = 2000;
+const size_t nWindow = 32;
+
+void RunEcho(std::stringstream& results, uint16_t port, const std::string& payload, size_t nSize, size_t nThreshold)
+{
+    echoServer<> server(port);
+    server.SetCompressionThreshold(nThreshold);
+    server.Run();
+
+    // The client is deleted after the server stopped, like in scaling
+    kq::client_interface<msgids>* pClient = new kq::client_interface<msgids>(scramble);
+    {
+        kq::client_interface<msgids>& client = *pClient;
+        client.SetCompressionThreshold(nThreshold);
+
+        kq::message<msgids> msg(msgids::Transmitted);
+        msg.body = MakePayload(payload, nSize);
+        msg.head.size = msg.size();
+        kq::shared_message<msgids> shared = kq::make_shared_message(msg);
+
+        if (ConnectEcho(client, server, port))
+        {
+            auto start = std::chrono::steady_clock::now();
+            EchoWindow(client, shared, nMessages, nWindow);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            // Every byte of the echo passed through the server's connection once each way
+            kq::connection<msgids>* connection = server.lastClient;
+            double nWireMB = double(connection->GetReadStats().nBytes + connection->GetWriteStats().nBytes) / (1024 * 1024);
+            kq::compression_stats serverStats = connection->GetCompressionStats();
+            kq::compression_stats clientStats = client.GetCompressionStats();
+            double compressMs = double(serverStats.nCompressNanoseconds + clientStats.nCompressNanoseconds) / 1e6;
+            double decompressMs = double(serverStats.nDecompressNanoseconds + clientStats.nDecompressNanoseconds) / 1e6;
+
+            results << payload << ',' << nSize << ',' << nThreshold << ',' << nMessages << ',' << seconds << ',' << nMessages / seconds << ','
+                << nWireMB << ',' << serverStats.Ratio() << ',' << compressMs << ',' << decompressMs << '\n';
+        }
+        else
+        {
+            results << payload << ',' << nSize << ',' << nThreshold << ",failed,,,,,,\n";
+        }
+    }
+
+    server.Halt();
+    delete pClient;
+}
+
+int main()
+{
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream codecResults;
+    codecResults << "payload,body_size,ratio,compress_MB_per_sec,decompress_MB_per_sec\n";
+    std::stringstream echoResults;
+    echoResults << "payload,body_size,threshold,messages,seconds,msgs_per_sec,wire_MB,ratio,compress_ms,decompress_ms\n";
+
+    bool bPassed = RunMalformed();
+    for (const char* payload : { "state", "random" })
+    {
+        for (size_t nSize : { 1024, 16 * 1024, 256 * 1024 })
+            bPassed = RunCodec(codecResults, payload, nSize) && bPassed;
+    }
+
+    uint16_t port = 60300;
+    for (const char* payload : { "state", "random" })
+    {
+        for (size_t nThreshold : { 0, 1024 })
+            RunEcho(echoResults, port++, payload, 64 * 1024, nThreshold);
+    }
+
+    // Exits with 0 only if every round trip matched and every malformed block was rejected
+    std::cout << codecResults.str() << '\n' << echoResults.str();
+    return bPassed ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "common.h"
+
+#include <future>
+#include <sstream>
+
+// Request/response round trips over the loopback, polling client and server against the awaitables of coro.h
+// Built as C++20, see Makefile
+// Output is csv: mode,round_trips,seconds,round_trips_per_sec,p50_us,p99_us
+
+const size_t nRoundTrips = 20000;
+const size_t nBodySize = 64;
+
+// Echoes every message back, from a coroutine per client or from OnMessage
+struct coroutineServer : public echoServer<>
+{
+    coroutineServer(uint16_t port, bool bCoroutines) : echoServer<>(port), bCoroutines(bCoroutines) {}
+
+    void OnClientValidated(kq::connection<msgids>* client)
+    {
+        echoServer<>::OnClientValidated(client);
+        // Called on the connection's strand before it reads, so every message reaches the coroutine
+        if (bCoroutines)
+            Serve(client);
+    }
+
+    static kq::task Serve(kq::connection<msgids>* client)
+    {
+        while (auto msg = co_await client->receive())
+        {
+            msg->getID() = msgids::Received;
+            co_await client->send(std::move(*msg));
+        }
+    }
+
+    bool bCoroutines;
+};
+
+kq::task RunCoroutineClient(kq::client_interface<msgids>& client, uint16_t port, kq::histogram& latency, std::promise<bool>& done)
+{
+    if (co_await client.connect("127.0.0.1", port) != kq::connect_success)
+    {
+        done.set_value(false);
+        co_return;
+    }
+
+    kq::message<msgids> msg(msgids::Transmitted);
+    msg.body.resize(nBodySize);
+    msg.head.size = msg.size();
+    kq::shared_message<msgids> shared = client.GetPool()->share(msg);
+
+    // Every iteration resumes on the client's context thread, right where the echo was read
+    for (size_t i = 0; i < nRoundTrips; ++i)
+    {
+        uint64_t start = kq::metrics_now();
+        co_await client.send(shared);
+        auto echo = co_await client.receive();
+        if (!echo)
+        {
+            done.set_value(false);
+            co_return;
+        }
+        latency.record(kq::metrics_now() - start);
+        client.Recycle(*echo);
+    }
+    done.set_value(true);
+}
+
+bool RunPollingClient(kq::client_interface<msgids>& client, uint16_t port, kq::histogram& latency)
+{
+    if (client.Connect("127.0.0.1", port) == false)
+        return false;
+
+    kq::message<msgids> msg(msgids::Transmitted);
+    msg.body.resize(nBodySize);
+    msg.head.size = msg.size();
+    kq::shared_message<msgids> shared = client.GetPool()->share(msg);
+
+    EchoWindow(client, shared, nRoundTrips, 1, &latency);
+    return true;
+}
+
+void Run(std::stringstream& results, uint16_t port, bool bCoroutines)
+{
+    // Only the polling server needs Update, the coroutines answer from the context's threads
+    coroutineServer server(port, bCoroutines);
+    server.Run();
+
+    kq::histogram latency;
+    bool bSucceeded;
+    auto start = std::chrono::steady_clock::now();
+    {
+        kq::client_interface<msgids> client(scramble);
+        if (bCoroutines)
+        {
+            std::promise<bool> done;
+            std::future<bool> result = done.get_future();
+            RunCoroutineClient(client, port, latency, done);
+            bSucceeded = result.get();
+        }
+        else
+        {
+            bSucceeded = RunPollingClient(client, port, latency);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    server.Halt();
+
+    kq::histogram_snapshot snapshot = latency.snapshot();
+    results << (bCoroutines ? "coroutines" : "polling") << ',';
+    if (bSucceeded == false)
+    {
+        results << "failed,,,,\n";
+        return;
+    }
+    results << nRoundTrips << ',' << seconds << ',' << nRoundTrips / seconds << ','
+        << snapshot.percentile(50) / 1000.0 << ',' << snapshot.percentile(99) / 1000.0 << '\n';
+}
+
+int main()
+{
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "mode,round_trips,seconds,round_trips_per_sec,p50_us,p99_us\n";
+
+    Run(results, 60400, false);
+    Run(results, 60401, true);
+
+    std::cout << results.str();
+    return 0;
+}
\ No newline at end of file
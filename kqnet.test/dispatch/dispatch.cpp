@@ -0,0 +1,94 @@
+#include "common.h"
+
+#include <sstream>
+
+// Ping round trips over the loopback, answered by OnMessage, by a queued handler and by an inline handler of the dispatch table
+// Output is csv: mode,round_trips,seconds,round_trips_per_sec,p50_us,p99_us
+
+const size_t nRoundTrips = 20000;
+
+struct pingServer : public kq::server_interface<msgids>
+{
+    pingServer(uint16_t port) : kq::server_interface<msgids>(port, scramble) {}
+
+    bool OnClientConnect(kq::connection<msgids>* client) { return true; }
+    void OnClientDisconnect(kq::connection<msgids>* client) {}
+    void OnClientValidated(kq::connection<msgids>* client) {}
+    void OnClientUnvalidated(kq::connection<msgids>* client) {}
+
+    void OnMessage(kq::connection<msgids>* client, kq::message<msgids>& msg)
+    {
+        switch (msg.getID())
+        {
+        case msgids::Transmitted:
+            msg.getID() = msgids::Received;
+            client->Send(std::move(msg));
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+void Run(std::stringstream& results, uint16_t port, const char* mode, bool bHandler, kq::dispatch_mode dispatchMode)
+{
+    pingServer server(port);
+    if (bHandler)
+    {
+        server.SetHandler(msgids::Transmitted, dispatchMode, [](kq::connection<msgids>* client, kq::message<msgids>& msg) {
+            msg.getID() = msgids::Received;
+            client->Send(std::move(msg));
+            });
+    }
+    server.Start();
+
+    std::atomic<bool> bRunning(true);
+    std::thread updater([&]() {
+        while (bRunning)
+            server.UpdateFor(std::chrono::milliseconds(100));
+        });
+
+    kq::histogram latency;
+    bool bConnected;
+    auto start = std::chrono::steady_clock::now();
+    {
+        kq::client_interface<msgids> client(scramble);
+        bConnected = client.Connect("127.0.0.1", port);
+        for (size_t i = 0; bConnected && i < nRoundTrips; ++i)
+        {
+            uint64_t nStart = kq::metrics_now();
+            client.Send(kq::message<msgids>(msgids::Transmitted));
+            client.Incoming().wait_pop();
+            latency.record(kq::metrics_now() - nStart);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bRunning = false;
+    updater.join();
+    server.Stop();
+
+    results << mode << ',';
+    if (bConnected == false)
+    {
+        results << "failed,,,,\n";
+        return;
+    }
+    kq::histogram_snapshot snapshot = latency.snapshot();
+    results << nRoundTrips << ',' << seconds << ',' << nRoundTrips / seconds << ','
+        << snapshot.percentile(50) / 1000.0 << ',' << snapshot.percentile(99) / 1000.0 << '\n';
+}
+
+int main()
+{
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "mode,round_trips,seconds,round_trips_per_sec,p50_us,p99_us\n";
+
+    Run(results, 60500, "on_message", false, kq::dispatch_queued);
+    Run(results, 60501, "queued", true, kq::dispatch_queued);
+    Run(results, 60502, "inline", true, kq::dispatch_inline);
+
+    std::cout << results.str();
+    return 0;
+}
\ No newline at end of file
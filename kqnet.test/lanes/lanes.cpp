@@ -0,0 +1,126 @@
+#include "common.h"
+
+#include <sstream>
+
+// Ping round trips over the loopback while the server streams bulk data to the same client
+// Without lanes every pong queues behind the bulk data, with lanes it overtakes it at the next write
+// Output is csv: mode,pings,bulk_mb,p50_us,p99_us,max_us,queue_wait_p50_us,queue_wait_p99_us
+
+const size_t nPings = 2000;
+const size_t nBulkSize = 64 * 1024;
+const size_t nBulkQueued = 8 * 1024 * 1024; // Bytes of bulk data the server keeps in the outbound queue
+
+enum lanemsgids : uint8_t
+{
+    Ping,
+    Pong,
+    Bulk
+};
+
+struct laneServer : public kq::server_interface<lanemsgids>
+{
+    laneServer(uint16_t port) : kq::server_interface<lanemsgids>(port, scramble) {}
+
+    bool OnClientConnect(kq::connection<lanemsgids>* client) { return true; }
+    void OnClientDisconnect(kq::connection<lanemsgids>* client) {}
+    void OnClientValidated(kq::connection<lanemsgids>* client) {}
+    void OnClientUnvalidated(kq::connection<lanemsgids>* client) {}
+
+    void OnMessage(kq::connection<lanemsgids>* client, kq::message<lanemsgids>& msg) {}
+};
+
+void Run(std::stringstream& results, uint16_t port, bool bLanes)
+{
+    laneServer server(port);
+    if (bLanes)
+    {
+        server.SetPriority(Pong, kq::priority_high);
+        server.SetPriority(Bulk, kq::priority_low);
+    }
+    // Pongs are answered straight from the context thread, so only the outbound queue delays them
+    server.SetHandler(Ping, kq::dispatch_inline, [](kq::connection<lanemsgids>* client, kq::message<lanemsgids>& msg) {
+        msg.getID() = Pong;
+        client->Send(std::move(msg));
+        });
+    server.Start();
+
+    kq::message<lanemsgids> bulk(Bulk);
+    bulk.body.resize(nBulkSize);
+    bulk.head.size = bulk.size();
+    kq::shared_message<lanemsgids> sharedBulk = server.GetPool()->share(bulk);
+
+    // Tops up the outbound queue of every client with bulk data
+    std::atomic<bool> bRunning(true);
+    std::thread pump([&]() {
+        while (bRunning)
+        {
+            bool bFull = true;
+            server.ForEachClient([&](kq::connection<lanemsgids>* client) {
+                if (client->IsConnected() && client->GetQueuedBytes() < nBulkQueued)
+                {
+                    client->Send(sharedBulk);
+                    bFull = false;
+                }
+                });
+            if (bFull)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        });
+
+    kq::histogram latency;
+    std::atomic<size_t> nBulkBytes(0);
+    bool bConnected;
+    {
+        kq::client_interface<lanemsgids> client(scramble);
+        // Bulk data is consumed on the context thread, so only pongs wait in Incoming()
+        client.SetHandler(Bulk, [&](kq::connection<lanemsgids>* server, kq::message<lanemsgids>& msg) {
+            nBulkBytes.fetch_add(msg.size(), std::memory_order_relaxed);
+            });
+        bConnected = client.Connect("127.0.0.1", port);
+
+        // Let the bulk stream fill the queue before the first ping
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        uint64_t nStart = kq::metrics_now();
+        if (bConnected)
+            client.Send(kq::message<lanemsgids>(Ping));
+        for (size_t i = 0; bConnected && i < nPings;)
+        {
+            auto msg = client.Incoming().wait_pop();
+            latency.record(kq::metrics_now() - nStart);
+            ++i;
+            nStart = kq::metrics_now();
+            client.Send(kq::message<lanemsgids>(Ping));
+        }
+    }
+    // Time spent in the server's outbound queue alone, without the socket buffers in between, by every message of the pong's lane
+    kq::histogram_snapshot pongWait = server.GetMetrics().laneWait[bLanes ? kq::priority_high : kq::priority_normal];
+
+    bRunning = false;
+    pump.join();
+    server.Stop();
+
+    results << (bLanes ? "lanes" : "single_queue") << ',';
+    if (bConnected == false)
+    {
+        results << "failed,,,,,,\n";
+        return;
+    }
+    kq::histogram_snapshot snapshot = latency.snapshot();
+    results << nPings << ',' << nBulkBytes.load() / (1024.0 * 1024.0) << ','
+        << snapshot.percentile(50) / 1000.0 << ',' << snapshot.percentile(99) / 1000.0 << ',' << snapshot.nMax / 1000.0 << ','
+        << pongWait.percentile(50) / 1000.0 << ',' << pongWait.percentile(99) / 1000.0 << '\n';
+}
+
+int main()
+{
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "mode,pings,bulk_mb,p50_us,p99_us,max_us,queue_wait_p50_us,queue_wait_p99_us\n";
+
+    Run(results, 60500, false);
+    Run(results, 60501, true);
+
+    std::cout << results.str();
+    return 0;
+}
\ No newline at end of file
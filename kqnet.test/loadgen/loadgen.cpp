@@ -0,0 +1,151 @@
+#include "common.h"
+
+#include <cstdlib>
+#include <memory>
+
+// Load generator: many connections of one multi_client_interface echoing messages through a server
+// Usage: loadgen [connections] [seconds] [body_size] [window] [threads] [host port]
+// Without a host an echo server is started in process on 127.0.0.1, any server answering Transmitted with the same body works
+// Every connection keeps window messages in flight and sends the next one once an echo comes back
+// Output is csv, a row per second and a total: second,connected,messages,msgs_per_sec,MB_per_sec,p50_us,p99_us,p999_us
+
+// Send times of the messages a connection has in flight, echoes come back in the order they were sent
+struct connectionState
+{
+    uint32_t id = 0;
+    kq::vector<uint64_t> sendTimes;
+    size_t nSent = 0;
+    size_t nReceived = 0;
+};
+
+void PrintRow(const std::string& second, size_t nConnected, size_t nMessages, double seconds, size_t nBodySize, const kq::histogram_snapshot& latency)
+{
+    double nBytes = double(nMessages) * (kq::wire_header<msgids>::size(nBodySize) + nBodySize);
+    std::cout << second << ',' << nConnected << ',' << nMessages << ',' << nMessages / seconds << ',' << nBytes / seconds / (1024 * 1024) << ','
+        << latency.percentile(50) / 1000.0 << ',' << latency.percentile(99) / 1000.0 << ',' << latency.percentile(99.9) / 1000.0 << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    size_t nConnections = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000;
+    size_t nSeconds = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10;
+    size_t nBodySize = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 64;
+    size_t nWindow = std::max<size_t>(argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 4, 1);
+    size_t nThreads = argc > 5 ? std::strtoul(argv[5], nullptr, 10) : 2;
+    bool bLocal = argc < 8;
+    std::string host = bLocal ? "127.0.0.1" : argv[6];
+    uint16_t port = bLocal ? 30300 : static_cast<uint16_t>(std::strtoul(argv[7], nullptr, 10));
+
+    std::unique_ptr<echoServer<>> server;
+    if (bLocal)
+    {
+        server.reset(new echoServer<>(port, 2));
+        server->Run();
+    }
+
+    kq::multi_client_interface<msgids> clients(scramble, nThreads);
+    asio::io_context resolverContext;
+    asio::ip::tcp::resolver resolver(resolverContext);
+    auto endpoints = resolver.resolve(host, std::to_string(port));
+
+    // States are indexed by the slot of the connection's ID, the low bits of it
+    const uint32_t nSlotMask = kq::slot_map<kq::connection<msgids>*>::nMaxSlots - 1;
+    kq::vector<connectionState> states;
+    for (size_t i = 0; i < nConnections; ++i)
+    {
+        uint32_t id = clients.Connect(endpoints);
+        if (id == 0)
+            break;
+        if (states.size() <= (id & nSlotMask))
+            states.resize((id & nSlotMask) + 1);
+        states[id & nSlotMask].id = id;
+        states[id & nSlotMask].sendTimes.resize(nWindow);
+    }
+
+    kq::message<msgids> msg(msgids::Transmitted);
+    msg.body.resize(nBodySize);
+    msg.head.size = msg.size();
+    kq::shared_message<msgids> shared = clients.GetPool()->share(msg);
+
+    auto fill = [&](connectionState& state) {
+        while (state.nSent - state.nReceived < nWindow && clients.Send(state.id, shared))
+        {
+            state.sendTimes[state.nSent % nWindow] = kq::metrics_now();
+            ++state.nSent;
+        }
+    };
+
+    std::cout << "second,connected,messages,msgs_per_sec,MB_per_sec,p50_us,p99_us,p999_us" << std::endl;
+
+    kq::histogram total;
+    std::unique_ptr<kq::histogram> interval(new kq::histogram());
+    size_t nTotal = 0, nInterval = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto intervalStart = start, lastFill = start - std::chrono::seconds(1);
+    size_t nSecond = 0;
+    while (nSecond < nSeconds)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        // Connections which validated since, or whose window didn't fit their queue, are filled up every 100 ms
+        if (now - lastFill >= std::chrono::milliseconds(100))
+        {
+            for (auto& state : states)
+            {
+                if (state.id != 0)
+                    fill(state);
+            }
+            lastFill = now;
+        }
+
+        if (clients.Incoming().wait_for(std::chrono::milliseconds(10)))
+        {
+            while (clients.Incoming().empty() == false)
+            {
+                auto echo = clients.Incoming().pop_front();
+                connectionState& state = states[echo.remote->getID() & nSlotMask];
+                uint64_t nLatency = kq::metrics_now() - state.sendTimes[state.nReceived % nWindow];
+                total.record(nLatency);
+                interval->record(nLatency);
+                clients.Recycle(echo.msg);
+                ++state.nReceived;
+                ++nInterval;
+                fill(state);
+            }
+        }
+
+        now = std::chrono::steady_clock::now();
+        if (now - intervalStart >= std::chrono::seconds(1))
+        {
+            double seconds = std::chrono::duration<double>(now - intervalStart).count();
+            PrintRow(std::to_string(++nSecond), clients.GetConnectedCount(), nInterval, seconds, nBodySize, interval->snapshot());
+            nTotal += nInterval;
+            nInterval = 0;
+            interval.reset(new kq::histogram());
+            intervalStart = now;
+        }
+    }
+    PrintRow("total", clients.GetConnectedCount(), nTotal, std::chrono::duration<double>(intervalStart - start).count(), nBodySize, total.snapshot());
+
+    // Echoes still in flight are waited for, so no connection is closed with messages of it in the server's queue
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    size_t nInFlight = 0;
+    for (auto& state : states)
+        nInFlight += state.nSent - state.nReceived;
+    while (nInFlight > 0 && std::chrono::steady_clock::now() < deadline)
+    {
+        if (clients.Incoming().wait_for(std::chrono::milliseconds(10)))
+        {
+            while (clients.Incoming().empty() == false)
+            {
+                clients.Incoming().pop_front();
+                --nInFlight;
+            }
+        }
+    }
+
+    clients.DisconnectAll();
+    if (bLocal)
+        server->Halt();
+    return 0;
+}
\ No newline at end of file
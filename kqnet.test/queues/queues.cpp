@@ -0,0 +1,74 @@
+#include "common.h"
+
+#include <sstream>
+
+// Microbenchmark of the queues a connection can deliver incoming messages through
+// Producers push owned messages while a single consumer pops them, like the context threads and Update do
+// Output is csv: queue,producers,items,seconds,Mitems_per_sec
+
+const size_t nItems = 1 << 21;
+
+template<typename Queue>
+double RunQueue(size_t nProducers)
+{
+    Queue queue;
+    size_t nPerProducer = nItems / nProducers;
+    std::atomic<bool> bGo(false);
+
+    kq::vector<std::thread> producers;
+    for (size_t i = 0; i < nProducers; ++i)
+    {
+        producers.push_back(std::thread([&]() {
+            kq::owned_message<msgids> item{ nullptr, kq::message<msgids>{ msgids::Transmitted } };
+            while (bGo == false)
+                std::this_thread::yield();
+            for (size_t n = 0; n < nPerProducer; ++n)
+                queue.push_back(item);
+            }));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bGo = true;
+
+    size_t nPopped = 0;
+    while (nPopped < nPerProducer * nProducers)
+    {
+        if (queue.empty() == false)
+        {
+            queue.pop_front();
+            ++nPopped;
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (auto& producer : producers)
+        producer.join();
+    return seconds;
+}
+
+void Report(std::stringstream& results, const char* name, size_t nProducers, double seconds)
+{
+    size_t nTotal = (nItems / nProducers) * nProducers;
+    results << name << ',' << nProducers << ',' << nTotal << ',' << seconds << ',' << nTotal / seconds / 1e6 << '\n';
+}
+
+int main()
+{
+    std::stringstream results;
+    results << "queue,producers,items,seconds,Mitems_per_sec\n";
+
+    Report(results, "spscqueue", 1, RunQueue<kq::spscqueue<kq::owned_message<msgids>>>(1));
+
+    for (size_t nProducers : { 1, 4, 16 })
+    {
+        Report(results, "tsqueue", nProducers, RunQueue<kq::tsqueue<kq::owned_message<msgids>>>(nProducers));
+        Report(results, "mpscqueue", nProducers, RunQueue<kq::mpscqueue<kq::owned_message<msgids>>>(nProducers));
+    }
+
+    std::cout << results.str();
+    return 0;
+}
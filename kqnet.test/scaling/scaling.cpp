@@ -0,0 +1,66 @@
+#include "common.h"
+
+#include <sstream>
+
+// Measures echo throughput of server_interface over the loopback for an increasing amount of context threads
+// Output is csv: threads,clients,messages,seconds,msgs_per_sec,MB_per_sec
+
+const size_t nClients = 8;
+const size_t nMessagesPerClient = 20000;
+const size_t nWindow = 256; // Messages a client keeps in flight
+const size_t nBodySize = 64;
+
+double RunEcho(uint16_t port, size_t nThreads)
+{
+    echoServer<> server(port, nThreads);
+    server.Run();
+
+    kq::vector<kq::client_interface<msgids>*> clients;
+    for (size_t i = 0; i < nClients; ++i)
+    {
+        clients.push_back(new kq::client_interface<msgids>(scramble));
+        clients.back()->Connect("127.0.0.1", port);
+    }
+
+    kq::message<msgids> msg(msgids::Transmitted);
+    for (size_t i = 0; i < nBodySize / sizeof(uint64_t); ++i)
+        msg << uint64_t(i);
+
+    auto start = std::chrono::steady_clock::now();
+
+    kq::vector<std::thread> workers;
+    for (auto client : clients)
+    {
+        workers.push_back(std::thread([client, &msg]() { EchoWindow(*client, msg, nMessagesPerClient, nWindow); }));
+    }
+    for (auto& worker : workers)
+        worker.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    server.Halt();
+    for (auto client : clients)
+        delete client;
+
+    return seconds;
+}
+
+int main()
+{
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "threads,clients,messages,seconds,msgs_per_sec,MB_per_sec\n";
+
+    uint16_t port = 60100;
+    for (size_t nThreads : { 1, 2, 4, 8 })
+    {
+        double seconds = RunEcho(port++, nThreads);
+        double nMessages = double(nClients * nMessagesPerClient);
+        double nBytes = nMessages * (kq::wire_header<msgids>::size(nBodySize) + nBodySize) * 2; // Request and echo
+        results << nThreads << ',' << nClients << ',' << nClients * nMessagesPerClient << ',' << seconds << ','
+            << nMessages / seconds << ',' << nBytes / seconds / (1024 * 1024) << '\n';
+    }
+
+    std::cout << results.str();
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "common.h"
+
+#include <sstream>
+
+// Compares encoding and decoding a message with operator<< / operator>> against message_writer / message_reader and schema<T>
+// Every case packs the same array of nElements floats, field by field, as one range or as a fixed layout payload
+// Output is csv: method,elements,iterations,seconds,MB_per_sec
+
+const size_t nElements = 10000;
+const size_t nIterations = 2000;
+
+// Keeps the compiler from dropping the decoded values
+volatile float fSink = 0.0f;
+
+struct floatArray
+{
+    float values[nElements];
+};
+
+namespace kq
+{
+    template<> struct message_schema<msgids, msgids::Transmitted> { typedef floatArray type; };
+}
+
+template<typename Encode>
+double RunEncode(Encode encode)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nIterations; ++i)
+    {
+        kq::message<msgids> msg(msgids::Transmitted);
+        encode(msg);
+        fSink = fSink + msg.body[msg.size() - 1];
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<typename Decode>
+double RunDecode(const kq::message<msgids>& encoded, Decode decode)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nIterations; ++i)
+        fSink = fSink + decode(encoded);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Report(std::stringstream& results, const char* method, double seconds)
+{
+    double nBytes = double(nElements * sizeof(float)) * nIterations;
+    results << method << ',' << nElements << ',' << nIterations << ',' << seconds << ',' << nBytes / seconds / (1024 * 1024) << '\n';
+}
+
+int main()
+{
+    std::vector<float> values(nElements);
+    for (size_t i = 0; i < nElements; ++i)
+        values[i] = float(i) * 0.5f;
+
+    std::stringstream results;
+    results << "method,elements,iterations,seconds,MB_per_sec\n";
+
+    Report(results, "encode_operator", RunEncode([&](kq::message<msgids>& msg) {
+        for (float value : values)
+            msg << value;
+        }));
+
+    Report(results, "encode_writer", RunEncode([&](kq::message<msgids>& msg) {
+        kq::message_writer<msgids> writer(msg);
+        writer.reserve(nElements * sizeof(float));
+        for (float value : values)
+            writer << value;
+        }));
+
+    Report(results, "encode_writer_range", RunEncode([&](kq::message<msgids>& msg) {
+        kq::message_writer<msgids>(msg).write(values.data(), values.size());
+        }));
+
+    Report(results, "encode_writer_vector", RunEncode([&](kq::message<msgids>& msg) {
+        kq::message_writer<msgids>(msg) << values;
+        }));
+
+    kq::message<msgids> encoded(msgids::Transmitted);
+    kq::message_writer<msgids>(encoded).write(values.data(), values.size());
+
+    // operator>> shrinks the message, so every iteration works on a copy, like a message taken out of Incoming() would be
+    Report(results, "decode_operator", RunDecode(encoded, [&](const kq::message<msgids>& msg) {
+        kq::message<msgids> copy(msg);
+        float fSum = 0.0f, value = 0.0f;
+        for (size_t i = 0; i < nElements; ++i)
+        {
+            copy >> value;
+            fSum += value;
+        }
+        return fSum;
+        }));
+
+    Report(results, "decode_reader", RunDecode(encoded, [&](const kq::message<msgids>& msg) {
+        kq::message_reader<msgids> reader(msg);
+        float fSum = 0.0f, value = 0.0f;
+        for (size_t i = 0; i < nElements; ++i)
+        {
+            reader >> value;
+            fSum += value;
+        }
+        return fSum;
+        }));
+
+    std::vector<float> decoded(nElements);
+    Report(results, "decode_reader_range", RunDecode(encoded, [&](const kq::message<msgids>& msg) {
+        kq::message_reader<msgids>(msg).read(decoded.data(), decoded.size());
+        return decoded[nElements - 1];
+        }));
+
+    kq::message<msgids> encodedVector(msgids::Transmitted);
+    kq::message_writer<msgids>(encodedVector) << values;
+    Report(results, "decode_reader_vector", RunDecode(encodedVector, [&](const kq::message<msgids>& msg) {
+        kq::message_reader<msgids>(msg) >> decoded;
+        return decoded[nElements - 1];
+        }));
+
+    floatArray array;
+    std::memcpy(array.values, values.data(), sizeof(array.values));
+    Report(results, "encode_schema", RunEncode([&](kq::message<msgids>& msg) {
+        kq::schema<msgids>::encode<msgids::Transmitted>(msg, array);
+        }));
+
+    Report(results, "decode_schema", RunDecode(encoded, [&](const kq::message<msgids>& msg) {
+        kq::schema<msgids>::decode<msgids::Transmitted>(msg, array);
+        return array.values[nElements - 1];
+        }));
+
+    // A round trip of every kind of field, so the benchmark also fails loudly if the formats disagree
+    kq::message<msgids> check(msgids::Transmitted);
+    kq::message_writer<msgids>(check) << uint32_t(42) << std::string("kqnet") << values << 2.5;
+    uint32_t nCheck = 0;
+    std::string strCheck;
+    std::vector<float> vCheck;
+    double dCheck = 0.0;
+    kq::message_reader<msgids> reader(check);
+    reader >> nCheck >> strCheck >> vCheck >> dCheck;
+    if (nCheck != 42 || strCheck != "kqnet" || vCheck != values || dCheck != 2.5 || reader.remaining() != 0)
+    {
+        std::cout << "Round trip mismatch\n";
+        return 1;
+    }
+
+    std::cout << results.str();
+    return 0;
+}
\ No newline at end of file
@@ -46,7 +46,8 @@ int main()
 
     while(true)
     {
-        server.Update();
+        // Sleeps until messages arrive instead of spinning
+        server.Update(-1, true);
     }
 
     return 0;
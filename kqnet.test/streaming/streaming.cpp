@@ -0,0 +1,141 @@
+#include "common.h"
+
+#include <sstream>
+
+// A big payload sent by the server as one message and as a stream of fragments, while the client keeps pinging
+// The single message is built in full on both ends and holds up every pong until it is written, the stream does neither
+// Output is csv: mode,payload_mb,seconds,mb_per_sec,pings,ping_p50_us,ping_max_us
+
+const size_t nPayloadSize = 256 * 1024 * 1024;
+const size_t nChunkSize = 64 * 1024;
+
+enum streammsgids : uint8_t
+{
+    Ping,
+    Pong,
+    Payload
+};
+
+// Byte i of the payload, so the client can check every fragment landed at it's offset
+uint8_t PayloadByte(uint64_t i)
+{
+    return static_cast<uint8_t>((i * 31) ^ (i >> 12));
+}
+
+struct streamServer : public kq::server_interface<streammsgids>
+{
+    streamServer(uint16_t port, bool bStream) : kq::server_interface<streammsgids>(port, scramble), bStream(bStream) {}
+
+    bool OnClientConnect(kq::connection<streammsgids>* client) { return true; }
+    void OnClientDisconnect(kq::connection<streammsgids>* client) {}
+    void OnClientUnvalidated(kq::connection<streammsgids>* client) {}
+    void OnMessage(kq::connection<streammsgids>* client, kq::message<streammsgids>& msg) {}
+
+    void OnClientValidated(kq::connection<streammsgids>* client)
+    {
+        if (bStream)
+        {
+            // The source is asked for a fragment at a time, the payload never exists in memory
+            uint64_t nOffset = 0;
+            client->SendStream(Payload, [nOffset](uint8_t* pOut, size_t nMax) mutable {
+                size_t nSize = static_cast<size_t>(std::min<uint64_t>(nMax, nPayloadSize - nOffset));
+                for (size_t i = 0; i < nSize; ++i)
+                    pOut[i] = PayloadByte(nOffset + i);
+                nOffset += nSize;
+                return nSize;
+                }, nChunkSize);
+        }
+        else
+        {
+            client->SendEmplace(Payload, [](kq::message<streammsgids>& msg) {
+                msg.body.resize(nPayloadSize);
+                for (size_t i = 0; i < nPayloadSize; ++i)
+                    msg.body[i] = PayloadByte(i);
+                });
+        }
+    }
+
+    bool bStream;
+};
+
+void Run(std::stringstream& results, uint16_t port, bool bStream)
+{
+    streamServer server(port, bStream);
+    // Pongs are answered straight from the context thread
+    server.SetHandler(Ping, kq::dispatch_inline, [](kq::connection<streammsgids>* client, kq::message<streammsgids>& msg) {
+        msg.getID() = Pong;
+        client->Send(std::move(msg));
+        });
+    server.Start();
+
+    std::atomic<uint64_t> nReceived(0);
+    std::atomic<bool> bValid(true);
+    std::atomic<bool> bDone(false);
+    kq::histogram latency;
+    bool bConnected;
+    auto start = std::chrono::steady_clock::now();
+    {
+        kq::client_interface<streammsgids> client(scramble);
+        if (bStream)
+        {
+            // A fragment is the only thing this client ever has to hold, so anything bigger is refused
+            client.SetMaxFrameSize(nChunkSize + kq::nMaxStreamHeaderSize);
+            client.SetStreamHandler(Payload, [&](kq::connection<streammsgids>* remote, const kq::stream_chunk& chunk) {
+                if (chunk.nOffset != nReceived)
+                    bValid = false;
+                for (size_t i = 0; i < chunk.nSize; i += 4096)
+                    bValid = bValid && chunk.pData[i] == PayloadByte(chunk.nOffset + i);
+                nReceived += chunk.nSize;
+                if (chunk.bLast)
+                    bDone = true;
+                });
+        }
+        else
+        {
+            // The single message is bigger than the default limit
+            client.SetMaxFrameSize(0);
+            client.SetHandler(Payload, [&](kq::connection<streammsgids>* remote, kq::message<streammsgids>& msg) {
+                for (size_t i = 0; i < msg.size(); i += 4096)
+                    bValid = bValid && msg.body[i] == PayloadByte(i);
+                nReceived += msg.size();
+                bDone = true;
+                });
+        }
+
+        bConnected = client.Connect("127.0.0.1", port);
+        while (bConnected && bDone == false)
+        {
+            uint64_t nStart = kq::metrics_now();
+            client.Send(kq::message<streammsgids>(Ping));
+            client.Incoming().wait_pop();
+            latency.record(kq::metrics_now() - nStart);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    server.Stop();
+
+    results << (bStream ? "stream" : "single_message") << ',';
+    if (bConnected == false || bValid == false || nReceived != nPayloadSize)
+    {
+        results << "failed,,,,,\n";
+        return;
+    }
+    kq::histogram_snapshot snapshot = latency.snapshot();
+    double mb = nPayloadSize / (1024.0 * 1024.0);
+    results << mb << ',' << seconds << ',' << mb / seconds << ',' << snapshot.nCount << ','
+        << snapshot.percentile(50) / 1000.0 << ',' << snapshot.nMax / 1000.0 << '\n';
+}
+
+int main()
+{
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "mode,payload_mb,seconds,mb_per_sec,pings,ping_p50_us,ping_max_us\n";
+
+    Run(results, 60600, false);
+    Run(results, 60601, true);
+
+    std::cout << results.str();
+    return 0;
+}
\ No newline at end of file
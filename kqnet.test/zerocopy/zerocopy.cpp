@@ -0,0 +1,179 @@
+#include "common.h"
+
+#include <sstream>
+#include <cstdio>
+#include <ctime>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// The server sends ranges of a file to a client over the loopback, read into message bodies, out of a mapping of the file, and with sendfile
+// The buffered path copies every byte into the message and out of it again, the other two hand the socket the file's pages
+// cpu_ms_per_gb is the process' cpu time (server and client) per GB received, the client's side is the same in every mode
+// Output is csv: mode,mb,seconds,mb_per_sec,cpu_ms_per_gb
+
+const size_t nFileSize = 64 * 1024 * 1024;
+const size_t nRangeSize = 1024 * 1024;
+const uint64_t nTotalSize = 1024ull * 1024 * 1024;
+const size_t nMaxQueued = 8 * 1024 * 1024; // Bytes the server keeps in the outbound queue
+
+enum zerocopymsgids : uint8_t
+{
+    Range
+};
+
+enum sendmode
+{
+    mode_buffered,
+    mode_mapped,
+    mode_sendfile
+};
+
+struct zerocopyServer : public kq::server_interface<zerocopymsgids>
+{
+    zerocopyServer(uint16_t port) : kq::server_interface<zerocopymsgids>(port, scramble) {}
+
+    bool OnClientConnect(kq::connection<zerocopymsgids>* client) { return true; }
+    void OnClientDisconnect(kq::connection<zerocopymsgids>* client) {}
+    void OnClientValidated(kq::connection<zerocopymsgids>* client) {}
+    void OnClientUnvalidated(kq::connection<zerocopymsgids>* client) {}
+    void OnMessage(kq::connection<zerocopymsgids>* client, kq::message<zerocopymsgids>& msg) {}
+};
+
+#ifndef _WIN32
+
+// Byte i of the file, so the client can check the ranges arrived intact
+uint8_t FileByte(uint64_t i)
+{
+    return static_cast<uint8_t>((i * 131) ^ (i >> 10));
+}
+
+void Run(std::stringstream& results, uint16_t port, int fd, sendmode mode)
+{
+    zerocopyServer server(port);
+    server.Start();
+
+    // The mapping is unmapped once the last range sent out of it was written
+    std::shared_ptr<const void> mapping;
+    if (mode == mode_mapped)
+    {
+        void* pMap = ::mmap(nullptr, nFileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (pMap != MAP_FAILED)
+            mapping = std::shared_ptr<const void>(pMap, [](const void* p) { ::munmap(const_cast<void*>(p), nFileSize); });
+    }
+
+    std::atomic<uint64_t> nReceived(0);
+    std::atomic<bool> bValid(true);
+    bool bConnected;
+    std::clock_t cpuStart = std::clock();
+    auto start = std::chrono::steady_clock::now();
+    {
+        kq::client_interface<zerocopymsgids> client(scramble);
+        // Ranges are consumed on the context thread, sampling a byte per page
+        client.SetHandler(Range, [&](kq::connection<zerocopymsgids>* remote, kq::message<zerocopymsgids>& msg) {
+            uint64_t nOffset = nReceived.load(std::memory_order_relaxed) % nFileSize;
+            for (size_t i = 0; i < msg.size(); i += 4096)
+                bValid = bValid && msg.body[i] == FileByte(nOffset + i);
+            nReceived.fetch_add(msg.size(), std::memory_order_relaxed);
+            });
+        bConnected = client.Connect("127.0.0.1", port) && (mode != mode_mapped || mapping != nullptr);
+
+        kq::connection<zerocopymsgids>* remote = nullptr;
+        while (bConnected && remote == nullptr)
+        {
+            server.ForEachClient([&](kq::connection<zerocopymsgids>* c) { remote = c; });
+            std::this_thread::yield();
+        }
+
+        for (uint64_t nSent = 0; bConnected && nSent < nTotalSize;)
+        {
+            if (remote->GetQueuedBytes() > nMaxQueued)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                continue;
+            }
+            uint64_t nOffset = nSent % nFileSize;
+            if (mode == mode_buffered)
+            {
+                remote->SendEmplace(Range, [&](kq::message<zerocopymsgids>& msg) {
+                    msg.body.resize(nRangeSize);
+                    kq::read_file_range(fd, nOffset, msg.body.data(), nRangeSize);
+                    });
+            }
+            else if (mode == mode_mapped)
+            {
+                remote->SendExternal(Range, kq::memory_body(static_cast<const uint8_t*>(mapping.get()) + nOffset, nRangeSize, mapping));
+            }
+            else
+            {
+                remote->SendExternal(Range, kq::file_body(fd, nOffset, nRangeSize, nullptr));
+            }
+            nSent += nRangeSize;
+        }
+
+        while (bConnected && nReceived < nTotalSize && client.IsConnected())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpuSeconds = double(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+    server.Stop();
+
+    results << (mode == mode_buffered ? "buffered" : mode == mode_mapped ? "mapped" : "sendfile") << ',';
+    if (bConnected == false || bValid == false || nReceived != nTotalSize)
+    {
+        results << "failed,,,\n";
+        return;
+    }
+    double mb = nTotalSize / (1024.0 * 1024.0);
+    results << mb << ',' << seconds << ',' << mb / seconds << ',' << cpuSeconds * 1000.0 / (mb / 1024.0) << '\n';
+}
+
+int main()
+{
+    // The file is written once and then read from the page cache by every run
+    char path[] = "/tmp/kqnet_zerocopyXXXXXX";
+    int fd = ::mkstemp(path);
+    if (fd < 0)
+    {
+        std::cout << "Couldn't create the file\n";
+        return 1;
+    }
+    ::unlink(path);
+    std::vector<uint8_t> chunk(nRangeSize);
+    for (size_t nOffset = 0; nOffset < nFileSize; nOffset += nRangeSize)
+    {
+        for (size_t i = 0; i < nRangeSize; ++i)
+            chunk[i] = FileByte(nOffset + i);
+        if (::pwrite(fd, chunk.data(), nRangeSize, static_cast<off_t>(nOffset)) != static_cast<ssize_t>(nRangeSize))
+        {
+            std::cout << "Couldn't write the file\n";
+            return 1;
+        }
+    }
+
+    // The runs print connection errors while tearing down, so the results are printed once all runs are done
+    std::stringstream results;
+    results << "mode,mb,seconds,mb_per_sec,cpu_ms_per_gb\n";
+
+    Run(results, 60700, fd, mode_buffered);
+    Run(results, 60701, fd, mode_mapped);
+    Run(results, 60702, fd, mode_sendfile);
+
+    ::close(fd);
+    std::cout << results.str();
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::cout << "zerocopy needs pread, mmap and sendfile, it isn't supported on Windows\n";
+    return 0;
+}
+
+#endif
\ No newline at end of file